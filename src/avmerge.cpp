@@ -0,0 +1,633 @@
+/* Copyright 2021-2023 Silas Parker.
+ *
+ * This file is part of NB Dashcam Tools.
+ *
+ * NB Dashcam Tools is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * NB Dashcam Tools is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NB Dashcam Tools. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "avmerge.hpp"
+
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QFile>
+
+#ifdef HAVE_LIBAV
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/opt.h>
+}
+
+static QString avError(int err)
+{
+    char buf[AV_ERROR_MAX_STRING_SIZE] = {0};
+    av_strerror(err, buf, sizeof(buf));
+    return QString::fromUtf8(buf);
+}
+#endif
+
+
+AvMerge::AvMerge(QObject* parent) :
+    QThread(parent),
+    mInputs(),
+    mOutput(),
+    mIncludeSubtitles(true),
+    mEncoder(),
+    mQuality(30),
+    mThreads(0),
+    mDuration(0.0),
+    mSucceeded(false),
+    mError()
+{
+}
+
+bool AvMerge::isAvailable()
+{
+#ifdef HAVE_LIBAV
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool AvMerge::hasEncoder(const QString& name)
+{
+#ifdef HAVE_LIBAV
+    return avcodec_find_encoder_by_name(name.toLatin1().constData()) != nullptr;
+#else
+    Q_UNUSED(name);
+    return false;
+#endif
+}
+
+QByteArray AvMerge::readSubtitleData(const QString& input, QString* errMsg)
+{
+    QByteArray data;
+#ifdef HAVE_LIBAV
+    AVFormatContext* ctx = nullptr;
+    int err = avformat_open_input(&ctx, input.toUtf8().constData(), nullptr, nullptr);
+    if (err >= 0)
+        err = avformat_find_stream_info(ctx, nullptr);
+    if (err < 0)
+    {
+        *errMsg = tr("Failed to open input file:\n%1\n%2").arg(input, avError(err));
+        avformat_close_input(&ctx);
+        return data;
+    }
+
+    // Only the subtitle packets are read from the file
+    err = av_find_best_stream(ctx, AVMEDIA_TYPE_SUBTITLE, -1, -1, nullptr, 0);
+    if (err < 0)
+    {
+        *errMsg = tr("No subtitle stream in file");
+        avformat_close_input(&ctx);
+        return data;
+    }
+    const int index = err;
+    for (unsigned int s = 0; s < ctx->nb_streams; ++s)
+    {
+        if (int(s) != index)
+            ctx->streams[s]->discard = AVDISCARD_ALL;
+    }
+
+    AVPacket* packet = av_packet_alloc();
+    while (packet && (err = av_read_frame(ctx, packet)) >= 0)
+    {
+        if (packet->stream_index == index)
+            data.append(reinterpret_cast<const char*>(packet->data), packet->size);
+        av_packet_unref(packet);
+    }
+    if (!packet || err != AVERROR_EOF)
+    {
+        *errMsg = packet ? tr("Failed to read subtitle stream:\n%1").arg(avError(err)) : tr("Out of memory");
+        data.clear();
+    }
+    av_packet_free(&packet);
+    avformat_close_input(&ctx);
+#else
+    Q_UNUSED(input);
+    *errMsg = tr("FFmpeg libraries not available");
+#endif
+    return data;
+}
+
+#ifdef HAVE_LIBAV
+
+// The streams that are merged, in output order
+enum MergeStream
+{
+    MergeVideo = 0,
+    MergeAudio,
+    MergeSubtitle,
+    MergeStreamCount
+};
+
+// Holds the state of one merge, everything is released by the destructor
+// whichever step fails
+class AvMerge::Writer
+{
+public:
+    explicit Writer(AvMerge* merge);
+    ~Writer();
+
+    bool run(QString* errMsg);
+
+private:
+    bool openInput(const QString& path, QString* errMsg);
+    bool openOutput(QString* errMsg);
+    bool openDecoder(QString* errMsg);
+    bool copyPacket(int stream, QString* errMsg);
+    bool decodePacket(AVPacket* packet, QString* errMsg);
+    bool encodeFrame(AVFrame* frame, QString* errMsg);
+    void closeInput();
+    void reportProgress(qint64 positionUs, bool force);
+
+    AvMerge* mMerge;
+    const bool mEncode;
+
+    AVFormatContext* mInput;
+    int mInputIndex[MergeStreamCount];
+    qint64 mInputOffsetUs;
+    AVCodecContext* mDecoder;
+
+    AVFormatContext* mOutput;
+    AVStream* mOutputStream[MergeStreamCount];
+    int64_t mLastDts[MergeStreamCount];
+    AVCodecContext* mEncoder;
+    int64_t mLastEncodePts;
+
+    AVPacket* mPacket;
+    AVPacket* mEncodedPacket;
+    AVFrame* mFrame;
+
+    qint64 mDurationUs;
+    QElapsedTimer mProgressTimer;
+};
+
+AvMerge::Writer::Writer(AvMerge* merge) :
+    mMerge(merge),
+    mEncode(!merge->mEncoder.isEmpty()),
+    mInput(nullptr),
+    mInputOffsetUs(0),
+    mDecoder(nullptr),
+    mOutput(nullptr),
+    mEncoder(nullptr),
+    mLastEncodePts(AV_NOPTS_VALUE),
+    mPacket(av_packet_alloc()),
+    mEncodedPacket(av_packet_alloc()),
+    mFrame(av_frame_alloc()),
+    mDurationUs(qint64(merge->mDuration * AV_TIME_BASE)),
+    mProgressTimer()
+{
+    for (int stream = 0; stream < MergeStreamCount; ++stream)
+    {
+        mInputIndex[stream] = -1;
+        mOutputStream[stream] = nullptr;
+        mLastDts[stream] = AV_NOPTS_VALUE;
+    }
+}
+
+AvMerge::Writer::~Writer()
+{
+    closeInput();
+    avcodec_free_context(&mEncoder);
+    if (mOutput)
+    {
+        if (!(mOutput->oformat->flags & AVFMT_NOFILE))
+            avio_closep(&mOutput->pb);
+        avformat_free_context(mOutput);
+    }
+    av_frame_free(&mFrame);
+    av_packet_free(&mEncodedPacket);
+    av_packet_free(&mPacket);
+}
+
+bool AvMerge::Writer::run(QString* errMsg)
+{
+    if (!mPacket || !mEncodedPacket || !mFrame)
+    {
+        *errMsg = tr("Out of memory");
+        return false;
+    }
+
+    mProgressTimer.start();
+    const QStringList& inputs = mMerge->mInputs;
+    for (int i = 0; i < inputs.size(); ++i)
+    {
+        if (!openInput(inputs.at(i), errMsg))
+            return false;
+        if (i == 0 && !openOutput(errMsg))
+            return false;
+        if (mEncode && !openDecoder(errMsg))
+            return false;
+
+        // Rebased so each clip starts where the last one ended
+        const qint64 startUs = (mInput->start_time != AV_NOPTS_VALUE) ? mInput->start_time : 0;
+        const qint64 clipOffsetUs = mInputOffsetUs - startUs;
+        qint64 clipEndUs = 0;
+
+        int err = 0;
+        while ((err = av_read_frame(mInput, mPacket)) >= 0)
+        {
+            if (mMerge->isInterruptionRequested())
+            {
+                av_packet_unref(mPacket);
+                *errMsg = tr("Merge cancelled");
+                return false;
+            }
+
+            int stream = 0;
+            while (stream < MergeStreamCount && mInputIndex[stream] != mPacket->stream_index)
+                ++stream;
+            if (stream == MergeStreamCount)
+            {
+                av_packet_unref(mPacket);
+                continue;
+            }
+
+            const AVRational inputTimeBase = mInput->streams[mPacket->stream_index]->time_base;
+            if (mPacket->pts != AV_NOPTS_VALUE)
+            {
+                const qint64 endUs = av_rescale_q(mPacket->pts + mPacket->duration, inputTimeBase, AV_TIME_BASE_Q) - startUs;
+                clipEndUs = qMax(clipEndUs, endUs);
+                if (stream == MergeVideo)
+                    reportProgress(mInputOffsetUs + endUs, false);
+            }
+
+            // Timestamps are moved into the merged timeline here, decoded
+            // frames keep them
+            av_packet_rescale_ts(mPacket, inputTimeBase, AV_TIME_BASE_Q);
+            if (mPacket->pts != AV_NOPTS_VALUE)
+                mPacket->pts += clipOffsetUs;
+            if (mPacket->dts != AV_NOPTS_VALUE)
+                mPacket->dts += clipOffsetUs;
+
+            const bool ok = (stream == MergeVideo && mEncode)
+                ? decodePacket(mPacket, errMsg)
+                : copyPacket(stream, errMsg);
+            av_packet_unref(mPacket);
+            if (!ok)
+                return false;
+        }
+        if (err != AVERROR_EOF)
+        {
+            *errMsg = tr("Failed to read input file:\n%1\n%2").arg(inputs.at(i), avError(err));
+            return false;
+        }
+
+        // Frames still held by the decoder belong to this clip
+        if (mEncode && !decodePacket(nullptr, errMsg))
+            return false;
+
+        mInputOffsetUs += (mInput->duration > 0) ? mInput->duration : clipEndUs;
+        closeInput();
+    }
+
+    if (mEncode && !encodeFrame(nullptr, errMsg))
+        return false;
+
+    const int err = av_write_trailer(mOutput);
+    if (err < 0)
+    {
+        *errMsg = tr("Failed to write output file:\n%1").arg(avError(err));
+        return false;
+    }
+    reportProgress(mInputOffsetUs, true);
+    return true;
+}
+
+bool AvMerge::Writer::openInput(const QString& path, QString* errMsg)
+{
+    int err = avformat_open_input(&mInput, path.toUtf8().constData(), nullptr, nullptr);
+    if (err >= 0)
+        err = avformat_find_stream_info(mInput, nullptr);
+    if (err < 0)
+    {
+        *errMsg = tr("Failed to open input file:\n%1\n%2").arg(path, avError(err));
+        return false;
+    }
+
+    for (int stream = 0; stream < MergeStreamCount; ++stream)
+        mInputIndex[stream] = -1;
+    for (unsigned int s = 0; s < mInput->nb_streams; ++s)
+    {
+        AVStream* st = mInput->streams[s];
+        int stream = MergeStreamCount;
+        switch (st->codecpar->codec_type)
+        {
+        case AVMEDIA_TYPE_VIDEO: stream = MergeVideo; break;
+        case AVMEDIA_TYPE_AUDIO: stream = MergeAudio; break;
+        case AVMEDIA_TYPE_SUBTITLE: stream = mMerge->mIncludeSubtitles ? MergeSubtitle : MergeStreamCount; break;
+        default: break;
+        }
+
+        // First of each kind only, the demuxer skips the data of the rest
+        if (stream != MergeStreamCount && mInputIndex[stream] < 0)
+            mInputIndex[stream] = int(s);
+        else
+            st->discard = AVDISCARD_ALL;
+    }
+
+    if (mInputIndex[MergeVideo] < 0)
+    {
+        *errMsg = tr("No video in input file:\n%1").arg(path);
+        return false;
+    }
+
+    // Every clip has to have the streams of the first
+    if (mOutput)
+    {
+        bool match = true;
+        for (int stream = 0; match && stream < MergeStreamCount; ++stream)
+        {
+            match = ((mInputIndex[stream] >= 0) == (mOutputStream[stream] != nullptr));
+            if (match && !mEncode && mInputIndex[stream] >= 0)
+            {
+                const AVCodecParameters* in = mInput->streams[mInputIndex[stream]]->codecpar;
+                const AVCodecParameters* out = mOutputStream[stream]->codecpar;
+                match = (in->codec_id == out->codec_id) && (in->width == out->width) && (in->height == out->height);
+            }
+        }
+        if (!match)
+        {
+            *errMsg = tr("Clip format does not match the first clip:\n%1").arg(path);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool AvMerge::Writer::openOutput(QString* errMsg)
+{
+    const QByteArray path = mMerge->mOutput.toUtf8();
+    int err = avformat_alloc_output_context2(&mOutput, nullptr, "mp4", path.constData());
+    if (err < 0)
+    {
+        *errMsg = tr("Failed to open output file:\n%1").arg(avError(err));
+        return false;
+    }
+
+    for (int stream = 0; stream < MergeStreamCount; ++stream)
+    {
+        if (mInputIndex[stream] < 0)
+            continue;
+
+        const AVStream* in = mInput->streams[mInputIndex[stream]];
+        AVStream* out = avformat_new_stream(mOutput, nullptr);
+        if (!out)
+        {
+            *errMsg = tr("Out of memory");
+            return false;
+        }
+        mOutputStream[stream] = out;
+
+        if (stream == MergeVideo && mEncode)
+        {
+            const QByteArray name = mMerge->mEncoder.toLatin1();
+            const AVCodec* codec = avcodec_find_encoder_by_name(name.constData());
+            mEncoder = codec ? avcodec_alloc_context3(codec) : nullptr;
+            if (!mEncoder)
+            {
+                *errMsg = tr("Encoder not available: %1").arg(mMerge->mEncoder);
+                return false;
+            }
+
+            const AVCodecParameters* par = in->codecpar;
+            mEncoder->width = par->width;
+            mEncoder->height = par->height;
+            mEncoder->pix_fmt = AVPixelFormat(par->format);
+            mEncoder->sample_aspect_ratio = par->sample_aspect_ratio;
+            mEncoder->time_base = in->time_base;
+            mEncoder->framerate = av_guess_frame_rate(mInput, const_cast<AVStream*>(in), nullptr);
+            mEncoder->thread_count = mMerge->mThreads;
+            if (mOutput->oformat->flags & AVFMT_GLOBALHEADER)
+                mEncoder->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+            AVDictionary* options = nullptr;
+            av_dict_set(&options, "crf", QByteArray::number(mMerge->mQuality).constData(), 0);
+            err = avcodec_open2(mEncoder, codec, &options);
+            av_dict_free(&options);
+            if (err >= 0)
+                err = avcodec_parameters_from_context(out->codecpar, mEncoder);
+            if (err < 0)
+            {
+                *errMsg = tr("Failed to start encoder:\n%1").arg(avError(err));
+                return false;
+            }
+            out->time_base = mEncoder->time_base;
+        }
+        else
+        {
+            err = avcodec_parameters_copy(out->codecpar, in->codecpar);
+            if (err < 0)
+            {
+                *errMsg = tr("Failed to open output file:\n%1").arg(avError(err));
+                return false;
+            }
+            // The muxer picks the tag for the container
+            out->codecpar->codec_tag = 0;
+            out->time_base = in->time_base;
+        }
+        av_dict_copy(&out->metadata, in->metadata, 0);
+    }
+
+    // Keeps a udta box at the end of the file for the camera data
+    av_dict_set(&mOutput->metadata, "encoder", LIBAVFORMAT_IDENT, 0);
+
+    if (!(mOutput->oformat->flags & AVFMT_NOFILE))
+    {
+        err = avio_open(&mOutput->pb, path.constData(), AVIO_FLAG_WRITE);
+        if (err < 0)
+        {
+            *errMsg = tr("Failed to open output file:\n%1").arg(avError(err));
+            return false;
+        }
+    }
+
+    err = avformat_write_header(mOutput, nullptr);
+    if (err < 0)
+    {
+        *errMsg = tr("Failed to write output file:\n%1").arg(avError(err));
+        return false;
+    }
+    return true;
+}
+
+bool AvMerge::Writer::openDecoder(QString* errMsg)
+{
+    const AVStream* in = mInput->streams[mInputIndex[MergeVideo]];
+    const AVCodec* codec = avcodec_find_decoder(in->codecpar->codec_id);
+    mDecoder = codec ? avcodec_alloc_context3(codec) : nullptr;
+    if (!mDecoder)
+    {
+        *errMsg = tr("Decoder not available");
+        return false;
+    }
+
+    int err = avcodec_parameters_to_context(mDecoder, in->codecpar);
+    if (err >= 0)
+    {
+        // Packets are rebased to microseconds before decoding
+        mDecoder->pkt_timebase = AV_TIME_BASE_Q;
+        mDecoder->thread_count = 0;
+        err = avcodec_open2(mDecoder, codec, nullptr);
+    }
+    if (err < 0)
+    {
+        *errMsg = tr("Failed to start decoder:\n%1").arg(avError(err));
+        return false;
+    }
+    return true;
+}
+
+bool AvMerge::Writer::copyPacket(int stream, QString* errMsg)
+{
+    AVStream* out = mOutputStream[stream];
+    av_packet_rescale_ts(mPacket, AV_TIME_BASE_Q, out->time_base);
+
+    // Rounding at a join can put a packet behind the last one
+    if (mPacket->dts != AV_NOPTS_VALUE)
+    {
+        if (mLastDts[stream] != AV_NOPTS_VALUE && mPacket->dts <= mLastDts[stream])
+        {
+            mPacket->dts = mLastDts[stream] + 1;
+            if (mPacket->pts != AV_NOPTS_VALUE && mPacket->pts < mPacket->dts)
+                mPacket->pts = mPacket->dts;
+        }
+        mLastDts[stream] = mPacket->dts;
+    }
+
+    mPacket->stream_index = out->index;
+    mPacket->pos = -1;
+    const int err = av_interleaved_write_frame(mOutput, mPacket);
+    if (err < 0)
+    {
+        *errMsg = tr("Failed to write output file:\n%1").arg(avError(err));
+        return false;
+    }
+    return true;
+}
+
+bool AvMerge::Writer::decodePacket(AVPacket* packet, QString* errMsg)
+{
+    int err = avcodec_send_packet(mDecoder, packet);
+    if (err < 0 && err != AVERROR_EOF)
+    {
+        *errMsg = tr("Failed to decode video:\n%1").arg(avError(err));
+        return false;
+    }
+
+    while ((err = avcodec_receive_frame(mDecoder, mFrame)) >= 0)
+    {
+        if (mFrame->width != mEncoder->width || mFrame->height != mEncoder->height ||
+            mFrame->format != mEncoder->pix_fmt)
+        {
+            av_frame_unref(mFrame);
+            *errMsg = tr("Clip format does not match the first clip");
+            return false;
+        }
+
+        const int64_t ts = (mFrame->best_effort_timestamp != AV_NOPTS_VALUE)
+            ? mFrame->best_effort_timestamp : mFrame->pts;
+        int64_t pts = av_rescale_q(ts, AV_TIME_BASE_Q, mEncoder->time_base);
+        if (mLastEncodePts != AV_NOPTS_VALUE && pts <= mLastEncodePts)
+            pts = mLastEncodePts + 1;
+        mLastEncodePts = pts;
+        mFrame->pts = pts;
+        mFrame->pict_type = AV_PICTURE_TYPE_NONE;
+
+        const bool ok = encodeFrame(mFrame, errMsg);
+        av_frame_unref(mFrame);
+        if (!ok)
+            return false;
+    }
+    if (err != AVERROR(EAGAIN) && err != AVERROR_EOF)
+    {
+        *errMsg = tr("Failed to decode video:\n%1").arg(avError(err));
+        return false;
+    }
+
+    // Ready for the next clip
+    if (!packet)
+        avcodec_flush_buffers(mDecoder);
+    return true;
+}
+
+bool AvMerge::Writer::encodeFrame(AVFrame* frame, QString* errMsg)
+{
+    int err = avcodec_send_frame(mEncoder, frame);
+    if (err < 0)
+    {
+        *errMsg = tr("Failed to encode video:\n%1").arg(avError(err));
+        return false;
+    }
+
+    AVStream* out = mOutputStream[MergeVideo];
+    while ((err = avcodec_receive_packet(mEncoder, mEncodedPacket)) >= 0)
+    {
+        av_packet_rescale_ts(mEncodedPacket, mEncoder->time_base, out->time_base);
+        mEncodedPacket->stream_index = out->index;
+        err = av_interleaved_write_frame(mOutput, mEncodedPacket);
+        if (err < 0)
+        {
+            *errMsg = tr("Failed to write output file:\n%1").arg(avError(err));
+            return false;
+        }
+    }
+    if (err != AVERROR(EAGAIN) && err != AVERROR_EOF)
+    {
+        *errMsg = tr("Failed to encode video:\n%1").arg(avError(err));
+        return false;
+    }
+    return true;
+}
+
+void AvMerge::Writer::closeInput()
+{
+    avcodec_free_context(&mDecoder);
+    avformat_close_input(&mInput);
+}
+
+void AvMerge::Writer::reportProgress(qint64 positionUs, bool force)
+{
+    // A few updates a second is enough for any display
+    if (!force && mProgressTimer.elapsed() < 200)
+        return;
+    mProgressTimer.restart();
+    const qint64 written = (mOutput && mOutput->pb) ? avio_tell(mOutput->pb) : 0;
+    emit mMerge->progress(positionUs, qMax(mDurationUs, positionUs), written);
+}
+
+#endif // HAVE_LIBAV
+
+void AvMerge::run()
+{
+    mSucceeded = false;
+    mError.clear();
+#ifdef HAVE_LIBAV
+    QString err;
+    {
+        Writer writer(this);
+        mSucceeded = writer.run(&err);
+    }
+    if (!mSucceeded)
+    {
+        qDebug() << "In process merge failed:" << err;
+        mError = err;
+        QFile::remove(mOutput);
+    }
+#else
+    mError = tr("FFmpeg libraries not available");
+#endif
+}
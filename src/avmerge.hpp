@@ -0,0 +1,73 @@
+/* Copyright 2021-2023 Silas Parker.
+ *
+ * This file is part of NB Dashcam Tools.
+ *
+ * NB Dashcam Tools is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * NB Dashcam Tools is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NB Dashcam Tools. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef AVMERGE_HPP
+#define AVMERGE_HPP
+
+#include <QThread>
+#include <QStringList>
+
+// Joins clips through the FFmpeg libraries inside the process, copying or
+// re-encoding the video and copying the other streams. Only built in when
+// the libraries are found, see isAvailable().
+class AvMerge : public QThread
+{
+    Q_OBJECT
+
+public:
+    explicit AvMerge(QObject* parent = nullptr);
+
+    static bool isAvailable();
+    static bool hasEncoder(const QString& name);
+
+    // Reads the payload of every packet of the first subtitle stream, for
+    // files the GPS export can not parse itself
+    static QByteArray readSubtitleData(const QString& input, QString* errMsg);
+
+    void setInputs(const QStringList& inputs) {mInputs = inputs;}
+    void setOutput(const QString& output) {mOutput = output;}
+    void setIncludeSubtitles(bool include) {mIncludeSubtitles = include;}
+    void setEncoder(const QString& encoder) {mEncoder = encoder;} // Empty copies the video
+    void setQuality(int quality) {mQuality = quality;}
+    void setThreads(int threads) {mThreads = threads;}
+    void setDuration(double duration) {mDuration = duration;}
+
+    bool succeeded() const {return mSucceeded;}
+    const QString& errorString() const {return mError;}
+
+signals:
+    void progress(qint64 positionUs, qint64 durationUs, qint64 bytesWritten);
+
+protected:
+    void run() override;
+
+private:
+    class Writer;
+
+    QStringList mInputs;
+    QString mOutput;
+    bool mIncludeSubtitles;
+    QString mEncoder;
+    int mQuality;
+    int mThreads;
+    double mDuration;
+    bool mSucceeded;
+    QString mError;
+};
+
+#endif // AVMERGE_HPP
@@ -0,0 +1,205 @@
+/* Copyright 2021-2023 Silas Parker.
+ *
+ * This file is part of NB Dashcam Tools.
+ *
+ * NB Dashcam Tools is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * NB Dashcam Tools is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NB Dashcam Tools. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "clipcache.hpp"
+
+#include <QDataStream>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QStandardPaths>
+
+static const quint32 cacheMagic = 0x4E424343; // "NBCC"
+static const quint32 cacheVersion = 1;
+static const int maxEntries = 50000;
+
+ClipCache* ClipCache::mInstance = nullptr;
+
+ClipCache* ClipCache::instance()
+{
+    if (!mInstance)
+        mInstance = new ClipCache();
+    return mInstance;
+}
+
+void ClipCache::destroy()
+{
+    if (mInstance)
+        mInstance->save();
+    delete mInstance;
+    mInstance = nullptr;
+}
+
+bool ClipCache::find(const QString& path, ClipInfo* info)
+{
+    qint64 size = 0;
+    qint64 mtime = 0;
+    if (!stat(path, &size, &mtime))
+        return false;
+
+    QMutexLocker lock(&mMutex);
+    if (!mLoaded)
+        load();
+
+    QHash<QString, Entry>::const_iterator it = mEntries.constFind(QFileInfo(path).absoluteFilePath());
+    if (it == mEntries.constEnd() || it->size != size || it->mtime != mtime)
+        return false;
+
+    *info = it->info;
+    info->path = path;
+    return true;
+}
+
+void ClipCache::insert(const ClipInfo& info)
+{
+    Entry entry;
+    if (!(info.isValid() && stat(info.path, &entry.size, &entry.mtime)))
+        return;
+    entry.info = info;
+
+    QMutexLocker lock(&mMutex);
+    if (!mLoaded)
+        load();
+    mEntries.insert(QFileInfo(info.path).absoluteFilePath(), entry);
+    mDirty = true;
+}
+
+bool ClipCache::load()
+{
+    // Called with the mutex held on first use
+    mLoaded = true;
+
+    QFile file(mFilePath);
+    if (!file.open(QIODevice::ReadOnly))
+        return false;
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_12);
+
+    quint32 magic = 0;
+    quint32 version = 0;
+    quint32 count = 0;
+    stream >> magic >> version >> count;
+    if (magic != cacheMagic || version != cacheVersion)
+    {
+        qDebug() << "Ignoring clip cache with unknown format" << mFilePath;
+        return false;
+    }
+
+    mEntries.reserve(int(qMin(count, quint32(maxEntries))));
+    for (quint32 i = 0; i < count && stream.status() == QDataStream::Ok; ++i)
+    {
+        QString key;
+        Entry entry;
+        ClipInfo& info = entry.info;
+        stream
+            >> key >> entry.size >> entry.mtime
+            >> info.duration >> info.infoString >> info.udta
+            >> info.gpsScanned >> info.gpsValid >> info.gpsStartMs >> info.gpsEndMs
+            >> info.minLatitude >> info.maxLatitude >> info.minLongitude >> info.maxLongitude;
+        if (stream.status() != QDataStream::Ok)
+            break;
+        info.path = key;
+        mEntries.insert(key, entry);
+    }
+
+    if (stream.status() != QDataStream::Ok)
+    {
+        qWarning() << "Clip cache is corrupt, discarding" << mFilePath;
+        mEntries.clear();
+        return false;
+    }
+
+    qDebug() << "Loaded clip cache" << mFilePath << mEntries.size() << "entries";
+    return true;
+}
+
+bool ClipCache::save()
+{
+    QMutexLocker lock(&mMutex);
+    if (!mDirty || mFilePath.isEmpty())
+        return true;
+
+    // Forget clips that have gone away once the cache gets large
+    if (mEntries.size() > maxEntries)
+    {
+        QHash<QString, Entry>::iterator it = mEntries.begin();
+        while (it != mEntries.end())
+        {
+            if (QFileInfo::exists(it.key()))
+                ++it;
+            else
+                it = mEntries.erase(it);
+        }
+    }
+
+    QDir().mkpath(QFileInfo(mFilePath).absolutePath());
+    QSaveFile file(mFilePath);
+    if (!file.open(QIODevice::WriteOnly))
+    {
+        qWarning() << "Failed to write clip cache" << mFilePath;
+        return false;
+    }
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_12);
+    stream << cacheMagic << cacheVersion << quint32(mEntries.size());
+    for (QHash<QString, Entry>::const_iterator it = mEntries.constBegin(); it != mEntries.constEnd(); ++it)
+    {
+        const ClipInfo& info = it->info;
+        stream
+            << it.key() << it->size << it->mtime
+            << info.duration << info.infoString << info.udta
+            << info.gpsScanned << info.gpsValid << info.gpsStartMs << info.gpsEndMs
+            << info.minLatitude << info.maxLatitude << info.minLongitude << info.maxLongitude;
+    }
+
+    if (stream.status() != QDataStream::Ok || !file.commit())
+    {
+        qWarning() << "Failed to write clip cache" << mFilePath;
+        return false;
+    }
+
+    mDirty = false;
+    return true;
+}
+
+
+ClipCache::ClipCache():
+    mFilePath(),
+    mMutex(),
+    mEntries(),
+    mLoaded(false),
+    mDirty(false)
+{
+    const QString dir = QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+    if (!dir.isEmpty())
+        mFilePath = dir + QLatin1String("/clipcache.bin");
+}
+
+bool ClipCache::stat(const QString& path, qint64* size, qint64* mtime)
+{
+    QFileInfo fileInfo(path);
+    if (!fileInfo.isFile())
+        return false;
+    *size = fileInfo.size();
+    *mtime = fileInfo.lastModified().toMSecsSinceEpoch();
+    return true;
+}
@@ -0,0 +1,63 @@
+/* Copyright 2021-2023 Silas Parker.
+ *
+ * This file is part of NB Dashcam Tools.
+ *
+ * NB Dashcam Tools is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * NB Dashcam Tools is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NB Dashcam Tools. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CLIPCACHE_HPP
+#define CLIPCACHE_HPP
+
+#include <QHash>
+#include <QMutex>
+#include <QString>
+
+#include "clipprobe.hpp"
+
+// Remembers the probe results of clips between runs, entries are dropped as
+// soon as the size or modification time of the clip changes
+class ClipCache
+{
+public:
+    // Created on the main thread at startup, probes call this from the
+    // thread pool
+    static ClipCache* instance();
+    static void destroy();
+
+    bool find(const QString& path, ClipInfo* info);
+    void insert(const ClipInfo& info);
+
+    bool save();
+
+private:
+    struct Entry
+    {
+        qint64 size;
+        qint64 mtime;
+        ClipInfo info;
+    };
+
+    ClipCache();
+    bool load();
+    static bool stat(const QString& path, qint64* size, qint64* mtime);
+    static ClipCache* mInstance;
+
+    QString mFilePath;
+    QMutex mMutex;
+    QHash<QString, Entry> mEntries;
+    bool mLoaded;
+    bool mDirty;
+};
+
+#endif // CLIPCACHE_HPP
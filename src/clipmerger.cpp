@@ -0,0 +1,796 @@
+/* Copyright 2021-2023 Silas Parker.
+ *
+ * This file is part of NB Dashcam Tools.
+ *
+ * NB Dashcam Tools is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * NB Dashcam Tools is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NB Dashcam Tools. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "clipmerger.hpp"
+
+#include <QDebug>
+#include <QDir>
+#include <QFileInfo>
+#include <QTemporaryDir>
+#include <QTemporaryFile>
+#include <QTextStream>
+#include <QThread>
+
+#include "avmerge.hpp"
+#include "clipprobe.hpp"
+#include "mp4concat.hpp"
+#include "mp4file.hpp"
+#include "toollocator.hpp"
+
+
+ClipMerger::ClipMerger(QObject* parent) :
+    QObject(parent),
+    mInputs(),
+    mOutput(),
+    mEncode(VideoEncodeCopy),
+    mQuality(30),
+    mIncludeGps(true),
+    mThreads(0),
+    mSegments(1),
+    mProber(new ClipProber(this)),
+    mConcat(nullptr),
+    mFFmpegProc(nullptr),
+    mFFmpegProgress(),
+    mAvMerge(nullptr),
+    mMergeTimer(),
+    mUdtaData(),
+    mSegmentList(),
+    mSegmentDir(nullptr),
+    mSegmentsRunning(0),
+    mSegmentFailed(false),
+    mJoiningSegments(false),
+    mDuration(0.0f),
+    mStage(StageProbe),
+    mRunning(false),
+    mCancelled(false),
+    mError()
+{
+    connect(
+        mProber,
+        &ClipProber::progress,
+        this,
+        &ClipMerger::probeProgress);
+
+    connect(
+        mProber,
+        &ClipProber::finished,
+        this,
+        &ClipMerger::probeFinished);
+}
+
+ClipMerger::~ClipMerger()
+{
+    if (mConcat)
+    {
+        mConcat->requestInterruption();
+        mConcat->wait();
+    }
+    if (mFFmpegProc)
+    {
+        mFFmpegProc->disconnect(this);
+        mFFmpegProc->kill();
+        mFFmpegProc->waitForFinished();
+    }
+    if (mAvMerge)
+    {
+        mAvMerge->requestInterruption();
+        mAvMerge->wait();
+    }
+    stopSegments();
+    delete mSegmentDir;
+}
+
+void ClipMerger::start()
+{
+    if (mRunning)
+        return;
+
+    mRunning = true;
+    mCancelled = false;
+    mError.clear();
+    mUdtaData.clear();
+    mDuration = 0.0f;
+    mStage = StageProbe;
+
+    // Always finish from the event loop, callers can wait on finished()
+    // even when the inputs are rejected straight away
+    QMetaObject::invokeMethod(this, &ClipMerger::startProbe, Qt::QueuedConnection);
+}
+
+void ClipMerger::cancel()
+{
+    if (!mRunning)
+        return;
+
+    mCancelled = true;
+    mProber->cancel();
+    if (mConcat)
+    {
+        mConcat->requestInterruption();
+    }
+    if (mFFmpegProc)
+    {
+        mFFmpegProc->terminate();
+    }
+    if (mAvMerge)
+    {
+        mAvMerge->requestInterruption();
+    }
+    for (Segment& segment : mSegmentList)
+    {
+        if (segment.proc)
+            segment.proc->terminate();
+    }
+}
+
+void ClipMerger::startProbe()
+{
+    if (mCancelled)
+    {
+        complete(false);
+        return;
+    }
+    if (mInputs.isEmpty())
+    {
+        complete(false, tr("No files selected"));
+        return;
+    }
+    if (mOutput.isEmpty())
+    {
+        complete(false, tr("Output file not set"));
+        return;
+    }
+
+    // Clips are probed in the background, the merge continues in
+    // probeFinished once every clip has been read
+    emit progress(0, mInputs.size(), tr("Preparing for merge"));
+    mProber->start(mInputs);
+}
+
+void ClipMerger::probeProgress(int done, int total)
+{
+    emit progress(done, total, tr("Preparing for merge: %1 / %2").arg(done).arg(total));
+}
+
+void ClipMerger::probeFinished()
+{
+    if (mProber->isCancelled() || mCancelled)
+    {
+        complete(false);
+        return;
+    }
+
+    const QVector<ClipInfo>& results = mProber->results();
+    QStringList errors;
+    float duration = 0.0f;
+    for (const ClipInfo& info : results)
+    {
+        if (!info.isValid())
+        {
+            errors << tr("%1: %2").arg(QDir::toNativeSeparators(info.path), info.errMsg);
+            continue;
+        }
+        qDebug() << info.path << info.duration;
+        duration += info.duration;
+    }
+
+    if (mIncludeGps && errors.isEmpty() && !results.isEmpty())
+    {
+        mUdtaData = results.first().udta;
+        if (mUdtaData.isEmpty())
+        {
+            errors << tr("%1: %2").arg(
+                QDir::toNativeSeparators(results.first().path), tr("Failed to read camera info"));
+        }
+    }
+
+    if (!errors.isEmpty())
+    {
+        const int maxShown = 10;
+        QString msg = QStringList(errors.mid(0, maxShown)).join('\n');
+        if (errors.size() > maxShown)
+            msg += tr("\n... and %1 more").arg(errors.size() - maxShown);
+        complete(false, msg);
+        return;
+    }
+
+    mDuration = duration;
+    mStage = StageMerge;
+
+    if (mEncode == VideoEncodeCopy)
+    {
+        // Join the clips directly, ffmpeg is only used if they can't be
+        mConcat = new Mp4Concat(this);
+        mConcat->setInputs(mInputs);
+        mConcat->setOutput(mOutput);
+        mConcat->setIncludeSubtitles(mIncludeGps);
+
+        connect(
+            mConcat,
+            &Mp4Concat::progress,
+            this,
+            &ClipMerger::concatProgress);
+
+        connect(
+            mConcat,
+            &QThread::finished,
+            this,
+            &ClipMerger::concatFinished);
+
+        emit progress(0, 1000, tr("Merging"));
+        mConcat->start();
+        return;
+    }
+
+    if (mEncode == VideoEncodeSoftware && mSegments != 1 && mInputs.size() > 1)
+    {
+        startSegmentEncode(results);
+        return;
+    }
+
+    startMerge(mInputs, mEncode);
+}
+
+void ClipMerger::concatProgress(qint64 written, qint64 total)
+{
+    if (total <= 0)
+        return;
+    emit progress(
+        int((written * 1000) / total), 1000,
+        tr("Merging: %1 / %2 MB").arg(written / (1024 * 1024)).arg(total / (1024 * 1024)));
+}
+
+void ClipMerger::concatFinished()
+{
+    Mp4Concat* concat = mConcat;
+    mConcat = nullptr;
+    concat->deleteLater();
+
+    // Clips that can't be joined directly are merged by ffmpeg instead
+    if (!concat->succeeded() && !concat->prepared() && !concat->isInterruptionRequested())
+    {
+        qDebug() << "Can not join clips directly, using ffmpeg:" << concat->errorString();
+        startMerge(mInputs, mEncode);
+        return;
+    }
+
+    if (!concat->succeeded() && !concat->isInterruptionRequested())
+    {
+        complete(false, concat->errorString());
+        return;
+    }
+
+    complete(concat->succeeded());
+}
+
+QTemporaryFile* ClipMerger::writeConcatFile(const QStringList& inputs, QObject* parent)
+{
+    QString tmpFormat(QDir(QDir::tempPath()).absoluteFilePath("nbtools.XXXXXX"));
+    QTemporaryFile* concatFile = new QTemporaryFile(tmpFormat, parent);
+    if (!concatFile->open())
+    {
+        delete concatFile;
+        return nullptr;
+    }
+
+    { // Scope for stream
+        QTextStream concatStream(concatFile);
+        for (const QString& file : inputs)
+        {
+            concatStream << "file '" << QDir::toNativeSeparators(file) << "'\n";
+        }
+    }
+    concatFile->close();
+    return concatFile;
+}
+
+QStringList ClipMerger::videoCodecArgs(VideoEncode encode, int quality, int threads)
+{
+    QStringList args;
+    QString crfStr(QString::number(quality));
+
+    switch (encode)
+    {
+    case VideoEncodeCopy:
+        args << "-c:v" << "copy";
+        break;
+    case VideoEncodeSoftware:
+        args << "-c:v" << "libx264" << "-crf" << crfStr;
+        if (threads > 0)
+            args << "-threads" << QString::number(threads);
+        break;
+    case VideoEncodeNVidia:
+        args << "-c:v" << "h264_nvenc" << "-rc" << "vbr" << "-cq" << crfStr;
+        break;
+    case VideoEncodeQsv:
+        args << "-c:v" << "h264_qsv" << "-global_quality" << crfStr;
+        break;
+    }
+    return args;
+}
+
+QStringList ClipMerger::encodeArgs(VideoEncode encode, int threads) const
+{
+    QStringList args = videoCodecArgs(encode, mQuality, threads);
+
+    // Subtitle track is GPS data
+    if (mIncludeGps)
+    {
+        args << "-c:s" << "copy"; // Copy subtitles
+    }
+    else
+    {
+        args << "-map" << "0:v" << "-map" << "0:a"; // Only merge video & audio
+    }
+    return args;
+}
+
+QString ClipMerger::throughputText(double pos, qint64 bytes) const
+{
+    // Rates over the whole merge so far, steadier than the per report ones
+    const qint64 elapsed = mMergeTimer.elapsed();
+    if (elapsed <= 0 || pos <= 0.0)
+        return tr("starting");
+
+    const double speed = (pos * 1000.0) / elapsed;
+    const double mbPerSec = (bytes * 1000.0) / (elapsed * 1024.0 * 1024.0);
+    const int eta = int(qMax(0.0, (mDuration - pos) / speed));
+    return tr("%1x, %2 MB/s, ETA %3:%4")
+        .arg(speed, 0, 'f', 1)
+        .arg(mbPerSec, 0, 'f', 1)
+        .arg(eta / 60)
+        .arg(eta % 60, 2, 10, QLatin1Char('0'));
+}
+
+void ClipMerger::startMerge(const QStringList& inputs, VideoEncode encode)
+{
+    // The hardware encoders are left to ffmpeg, their setup differs per
+    // platform and driver
+    const bool inProcess = AvMerge::isAvailable() &&
+        (encode == VideoEncodeCopy || (encode == VideoEncodeSoftware && AvMerge::hasEncoder("libx264")));
+    if (inProcess)
+        startAvMerge(inputs, encode);
+    else
+        startFFmpegMerge(inputs, encode);
+}
+
+void ClipMerger::startAvMerge(const QStringList& inputs, VideoEncode encode)
+{
+    mAvMerge = new AvMerge(this);
+    mAvMerge->setInputs(inputs);
+    mAvMerge->setOutput(mOutput);
+    mAvMerge->setIncludeSubtitles(mIncludeGps);
+    mAvMerge->setEncoder(encode == VideoEncodeSoftware ? QStringLiteral("libx264") : QString());
+    mAvMerge->setQuality(mQuality);
+    mAvMerge->setThreads(mThreads);
+    mAvMerge->setDuration(mDuration);
+    qDebug() << "Merging in process" << inputs << (encode == VideoEncodeSoftware ? "libx264" : "copy");
+
+    emit progress(0, 1000, tr("Merging"));
+
+    connect(
+        mAvMerge,
+        &AvMerge::progress,
+        this,
+        &ClipMerger::avMergeProgress);
+
+    connect(
+        mAvMerge,
+        &AvMerge::finished,
+        this,
+        &ClipMerger::avMergeFinished);
+
+    mMergeTimer.start();
+    mAvMerge->start();
+}
+
+void ClipMerger::startFFmpegMerge(const QStringList& inputs, VideoEncode encode)
+{
+    mFFmpegProc = new QProcess(this);
+    QTemporaryFile* concatFile = writeConcatFile(inputs, mFFmpegProc);
+    if (!concatFile)
+    {
+        mFFmpegProc->deleteLater();
+        mFFmpegProc = nullptr;
+        complete(false, tr("Failed to create temp concat file"));
+        return;
+    }
+
+    QStringList args;
+    args << "-hide_banner" << "-y" << "-nostdin" << "-loglevel" << "error"; // Global args
+    args << FFmpegProgress::args();
+
+    // Use nvdec
+    if (encode == VideoEncodeNVidia)
+    {
+        args << "-hwaccel" << "cuda" << "-hwaccel_output_format" << "cuda";
+    }
+
+    // Input args
+    args << "-f" << "concat" << "-safe" << "0" << "-i" << QDir::toNativeSeparators(concatFile->fileName());
+    args << encodeArgs(encode, mThreads);
+    if (mJoiningSegments)
+        args << "-c:a" << "copy"; // Audio was encoded with the parts
+    args << QDir::toNativeSeparators(mOutput);
+    qDebug() << ToolLocator::instance()->ffmpeg() << args;
+
+    // Progress comes as key=value blocks on stdout, only errors are logged
+    mFFmpegProc->setProgram(ToolLocator::instance()->ffmpeg());
+    mFFmpegProc->setArguments(args);
+    mFFmpegProc->setStandardInputFile(QProcess::nullDevice());
+    mFFmpegProc->setProcessChannelMode(QProcess::ForwardedErrorChannel);
+    mFFmpegProgress.reset();
+
+    emit progress(0, 1000, tr("Merging"));
+
+    connect(
+        mFFmpegProc,
+        &QProcess::readyReadStandardOutput,
+        this,
+        &ClipMerger::ffmpegStdout);
+
+    connect(
+        mFFmpegProc,
+        QOverload<int,QProcess::ExitStatus>::of(&QProcess::finished),
+        this,
+        &ClipMerger::ffmpegFinished);
+
+    connect(
+        mFFmpegProc,
+        &QProcess::errorOccurred,
+        this,
+        &ClipMerger::ffmpegError);
+
+    mMergeTimer.start();
+    mFFmpegProc->start();
+}
+
+void ClipMerger::startSegmentEncode(const QVector<ClipInfo>& results)
+{
+    // Separate processes with a few threads each scale better than one
+    // libx264 encode across every core
+    const int threads = mThreads > 0 ? mThreads : QThread::idealThreadCount();
+    const int count = qMin(mSegments > 1 ? mSegments : qMax(1, threads / 4), results.size());
+    if (count < 2)
+    {
+        startMerge(mInputs, mEncode);
+        return;
+    }
+    const int segmentThreads = qMax(1, threads / count);
+
+    // Parts go next to the output, together they are as large as it
+    mSegmentDir = new QTemporaryDir(QFileInfo(mOutput).absoluteDir().filePath(".nbtools-XXXXXX"));
+    if (!mSegmentDir->isValid())
+    {
+        complete(false, tr("Failed to create temp directory"));
+        return;
+    }
+
+    // Runs of whole clips, each about the same duration
+    int clip = 0;
+    float assigned = 0.0f;
+    for (int s = 0; s < count; ++s)
+    {
+        Segment segment;
+        segment.duration = 0.0f;
+        segment.pos = 0.0f;
+        segment.bytes = 0;
+        segment.output = mSegmentDir->filePath(QStringLiteral("part%1.mp4").arg(s, 3, 10, QLatin1Char('0')));
+        segment.proc = nullptr;
+
+        const float target = (mDuration * (s + 1)) / count;
+        const bool last = (s == count - 1);
+        while (clip < results.size())
+        {
+            const float clipDuration = float(results.at(clip).duration);
+            if (!segment.inputs.isEmpty() && !last &&
+                ((results.size() - clip) <= (count - s - 1) || assigned + (clipDuration / 2) > target))
+            {
+                break;
+            }
+            segment.inputs << mInputs.at(clip);
+            segment.duration += clipDuration;
+            assigned += clipDuration;
+            ++clip;
+        }
+        mSegmentList.append(segment);
+    }
+
+    for (int i = 0; i < mSegmentList.size(); ++i)
+    {
+        Segment& segment = mSegmentList[i];
+        segment.proc = new QProcess(this);
+        QTemporaryFile* concatFile = writeConcatFile(segment.inputs, segment.proc);
+        if (!concatFile)
+        {
+            complete(false, tr("Failed to create temp concat file"));
+            return;
+        }
+
+        QStringList args;
+        args << "-hide_banner" << "-y" << "-nostdin" << "-loglevel" << "error";
+        args << FFmpegProgress::args();
+        args << "-f" << "concat" << "-safe" << "0" << "-i" << QDir::toNativeSeparators(concatFile->fileName());
+        args << encodeArgs(VideoEncodeSoftware, segmentThreads);
+        args << QDir::toNativeSeparators(segment.output);
+        qDebug() << ToolLocator::instance()->ffmpeg() << args;
+
+        segment.proc->setProgram(ToolLocator::instance()->ffmpeg());
+        segment.proc->setArguments(args);
+        segment.proc->setStandardInputFile(QProcess::nullDevice());
+        segment.proc->setProcessChannelMode(QProcess::ForwardedErrorChannel);
+
+        connect(segment.proc, &QProcess::readyReadStandardOutput, this, [this, i]()
+        {
+            segmentOutput(i);
+        });
+        connect(
+            segment.proc, QOverload<int,QProcess::ExitStatus>::of(&QProcess::finished),
+            this, [this, i](int exitCode, QProcess::ExitStatus exitStatus)
+        {
+            segmentFinished(i, exitStatus == QProcess::NormalExit && exitCode == 0);
+        });
+        connect(segment.proc, &QProcess::errorOccurred, this, [this, i](QProcess::ProcessError error)
+        {
+            // No finished signal follows if the process never ran
+            if (error == QProcess::FailedToStart)
+                segmentFinished(i, false);
+        });
+    }
+
+    emit progress(0, 1000, tr("Encoding %1 parts").arg(mSegmentList.size()));
+
+    mSegmentsRunning = mSegmentList.size();
+    mSegmentFailed = false;
+    mMergeTimer.start();
+    for (int i = 0; i < mSegmentList.size(); ++i)
+    {
+        // Parts after a failure are not started, they finish straight away
+        if (mSegmentFailed || mCancelled)
+            segmentFinished(i, false);
+        else
+            mSegmentList.at(i).proc->start();
+    }
+}
+
+void ClipMerger::segmentOutput(int index)
+{
+    Segment& segment = mSegmentList[index];
+    if (!segment.ffmpegProgress.addData(segment.proc->readAllStandardOutput()) || mDuration <= 0.0f)
+        return;
+
+    segment.pos = qMin(segment.ffmpegProgress.outTimeUs() / 1000000.0f, segment.duration);
+    segment.bytes = segment.ffmpegProgress.totalSize();
+    qDebug() << "Part" << index << "frame" << segment.ffmpegProgress.frame()
+             << "fps" << segment.ffmpegProgress.fps() << "speed" << segment.ffmpegProgress.speed();
+
+    float total = 0.0f;
+    qint64 bytes = 0;
+    for (const Segment& s : mSegmentList)
+    {
+        total += s.pos;
+        bytes += s.bytes;
+    }
+    emit progress(
+        qMin(950, int((total * 950) / mDuration)), 1000,
+        tr("Encoding %1 parts: %2 / %3 (%4)")
+            .arg(mSegmentList.size()).arg(total, 0, 'f', 1).arg(int(mDuration)).arg(throughputText(total, bytes)));
+}
+
+void ClipMerger::segmentFinished(int index, bool ok)
+{
+    Segment& segment = mSegmentList[index];
+    qDebug() << "Part" << index << "finished" << ok;
+    if (segment.proc)
+    {
+        segment.proc->deleteLater();
+        segment.proc = nullptr;
+    }
+    --mSegmentsRunning;
+
+    if (ok)
+    {
+        segment.pos = segment.duration;
+    }
+    else if (!mSegmentFailed)
+    {
+        // One failed part fails the route, stop the others
+        mSegmentFailed = true;
+        for (Segment& other : mSegmentList)
+        {
+            if (other.proc)
+                other.proc->kill();
+        }
+    }
+
+    if (mSegmentsRunning > 0)
+        return;
+
+    if (mCancelled)
+        complete(false);
+    else if (mSegmentFailed)
+        complete(false, tr("Failed to encode files"));
+    else
+        joinSegments();
+}
+
+void ClipMerger::joinSegments()
+{
+    // Each part has its own bitrate fields in the sample entry and its own
+    // edit list for the encoder delay and audio priming, the concat demuxer
+    // takes both into account where a direct join would not
+    QStringList parts;
+    for (const Segment& segment : mSegmentList)
+        parts << segment.output;
+
+    mJoiningSegments = true;
+    emit progress(950, 1000, tr("Joining parts"));
+    startFFmpegMerge(parts, VideoEncodeCopy);
+}
+
+bool ClipMerger::appendCameraData(QString* errMsg)
+{
+    Mp4File outFile(mOutput);
+    if (!outFile.open(QFile::ReadWrite | QFile::ExistingOnly))
+    {
+        *errMsg = tr("Failed to open output file to add GPS data.");
+        return false;
+    }
+    if (!outFile.appendUdta(mUdtaData, errMsg))
+        return false;
+    outFile.close();
+    return true;
+}
+
+void ClipMerger::stopSegments()
+{
+    for (Segment& segment : mSegmentList)
+    {
+        if (!segment.proc)
+            continue;
+        segment.proc->disconnect(this);
+        segment.proc->kill();
+        segment.proc->waitForFinished();
+        segment.proc->deleteLater();
+        segment.proc = nullptr;
+    }
+}
+
+void ClipMerger::ffmpegStdout()
+{
+    if (!mFFmpegProgress.addData(mFFmpegProc->readAllStandardOutput()))
+        return;
+
+    const double pos = mFFmpegProgress.outTimeUs() / 1000000.0;
+    const QString rates = throughputText(pos, mFFmpegProgress.totalSize());
+    qDebug() << "FFmpeg frame" << mFFmpegProgress.frame() << "fps" << mFFmpegProgress.fps()
+             << "bitrate" << mFFmpegProgress.bitrate() << "speed" << mFFmpegProgress.speed() << rates;
+    if (mDuration <= 0.0f)
+        return;
+    if (mJoiningSegments)
+    {
+        emit progress(
+            950 + qMin(50, int((pos * 50) / mDuration)), 1000,
+            tr("Joining parts: %1 / %2").arg(pos, 0, 'f', 1).arg(int(mDuration)));
+        return;
+    }
+    emit progress(
+        qMin(1000, int((pos * 1000) / mDuration)), 1000,
+        tr("Merging: %1 / %2 (%3)").arg(pos, 0, 'f', 1).arg(int(mDuration)).arg(rates));
+}
+
+void ClipMerger::ffmpegFinished(int exitCode, QProcess::ExitStatus exitStatus)
+{
+    qDebug() << "FFmpeg finished" << exitCode << exitStatus;
+    mFFmpegProc->deleteLater();
+    mFFmpegProc = nullptr;
+
+    if (mCancelled)
+    {
+        complete(false);
+        return;
+    }
+
+    if (exitStatus != QProcess::NormalExit || exitCode != 0)
+    {
+        complete(false, tr("Failed to merge files"));
+        return;
+    }
+
+    // If not adding GPS data, don't copy camera info
+    if (!mIncludeGps)
+    {
+        complete(true);
+        return;
+    }
+
+    QString err;
+    if (!appendCameraData(&err))
+    {
+        complete(false, err);
+        return;
+    }
+    complete(true);
+}
+
+void ClipMerger::ffmpegError(QProcess::ProcessError error)
+{
+    // No finished signal follows if the process never ran
+    if (error != QProcess::FailedToStart)
+        return;
+    qDebug() << "FFmpeg failed to start" << mFFmpegProc->errorString();
+    mFFmpegProc->deleteLater();
+    mFFmpegProc = nullptr;
+    complete(false, tr("Failed to start ffmpeg"));
+}
+
+void ClipMerger::avMergeProgress(qint64 positionUs, qint64 durationUs, qint64 bytesWritten)
+{
+    if (durationUs <= 0)
+        return;
+
+    const double pos = positionUs / 1000000.0;
+    emit progress(
+        int((positionUs * 1000) / durationUs), 1000,
+        tr("Merging: %1 / %2 (%3)").arg(pos, 0, 'f', 1).arg(int(durationUs / 1000000)).arg(throughputText(pos, bytesWritten)));
+}
+
+void ClipMerger::avMergeFinished()
+{
+    AvMerge* merge = mAvMerge;
+    mAvMerge = nullptr;
+    merge->deleteLater();
+    qDebug() << "In process merge finished" << merge->succeeded() << mMergeTimer.elapsed() << "ms";
+
+    if (mCancelled)
+    {
+        complete(false);
+        return;
+    }
+
+    if (!merge->succeeded())
+    {
+        complete(false, merge->errorString());
+        return;
+    }
+
+    // As with ffmpeg the output only has a bare udta
+    QString err;
+    if (mIncludeGps && !appendCameraData(&err))
+    {
+        complete(false, err);
+        return;
+    }
+    complete(true);
+}
+
+void ClipMerger::complete(bool ok, const QString& errMsg)
+{
+    // Anything left of a split encode, the parts are removed with the
+    // directory
+    stopSegments();
+    mSegmentList.clear();
+    delete mSegmentDir;
+    mSegmentDir = nullptr;
+    mJoiningSegments = false;
+
+    mRunning = false;
+    mError = errMsg;
+    mUdtaData.clear();
+    emit finished(ok);
+}
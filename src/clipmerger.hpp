@@ -0,0 +1,153 @@
+/* Copyright 2021-2023 Silas Parker.
+ *
+ * This file is part of NB Dashcam Tools.
+ *
+ * NB Dashcam Tools is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * NB Dashcam Tools is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NB Dashcam Tools. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CLIPMERGER_HPP
+#define CLIPMERGER_HPP
+
+#include <QElapsedTimer>
+#include <QObject>
+#include <QProcess>
+#include <QStringList>
+#include <QVector>
+
+#include "ffmpegprogress.hpp"
+
+class AvMerge;
+class ClipProber;
+class Mp4Concat;
+class QTemporaryDir;
+class QTemporaryFile;
+struct ClipInfo;
+
+// Merges a list of clips into one file without any UI. The clips are
+// probed first, then joined directly or through ffmpeg when re-encoding or
+// when they can not be joined as is. When built with the FFmpeg libraries
+// copies and software encodes run inside the process instead. Software
+// encodes can be split at clip boundaries, which are keyframes, with the
+// parts encoded side by side and joined by ffmpeg's concat demuxer without
+// re-encoding.
+class ClipMerger : public QObject
+{
+    Q_OBJECT
+
+public:
+    enum VideoEncode
+    {
+        VideoEncodeCopy = 0,
+        VideoEncodeSoftware,
+        VideoEncodeNVidia,
+        VideoEncodeQsv
+    };
+
+    enum Stage
+    {
+        StageProbe = 0,
+        StageMerge
+    };
+
+    explicit ClipMerger(QObject* parent = nullptr);
+    ~ClipMerger();
+
+    void setInputs(const QStringList& inputs) {mInputs = inputs;}
+    void setOutput(const QString& output) {mOutput = output;}
+    void setVideoEncode(VideoEncode encode) {mEncode = encode;}
+    void setQuality(int quality) {mQuality = quality;}
+    void setIncludeGps(bool include) {mIncludeGps = include;}
+    void setThreads(int threads) {mThreads = threads;}
+    void setSegments(int segments) {mSegments = segments;} // 0 picks from the threads
+
+    // Codec arguments for the video stream, shared with the encoder benchmark
+    static QStringList videoCodecArgs(VideoEncode encode, int quality, int threads = 0);
+
+    void start();
+    void cancel();
+    bool isRunning() const {return mRunning;}
+    bool wasCancelled() const {return mCancelled;}
+    Stage stage() const {return mStage;}
+    const QString& errorString() const {return mError;}
+
+signals:
+    void progress(int value, int maximum, const QString& status);
+    void finished(bool ok);
+
+private slots:
+    void startProbe();
+    void probeProgress(int done, int total);
+    void probeFinished();
+    void concatProgress(qint64 written, qint64 total);
+    void concatFinished();
+    void ffmpegStdout();
+    void ffmpegFinished(int exitCode, QProcess::ExitStatus exitStatus);
+    void ffmpegError(QProcess::ProcessError error);
+    void avMergeProgress(qint64 positionUs, qint64 durationUs, qint64 bytesWritten);
+    void avMergeFinished();
+
+private:
+    struct Segment
+    {
+        QStringList inputs;
+        float duration;
+        float pos;
+        qint64 bytes;
+        QString output;
+        QProcess* proc;
+        FFmpegProgress ffmpegProgress;
+    };
+
+    QTemporaryFile* writeConcatFile(const QStringList& inputs, QObject* parent);
+    QStringList encodeArgs(VideoEncode encode, int threads) const;
+    QString throughputText(double pos, qint64 bytes) const;
+    void startMerge(const QStringList& inputs, VideoEncode encode);
+    void startAvMerge(const QStringList& inputs, VideoEncode encode);
+    void startFFmpegMerge(const QStringList& inputs, VideoEncode encode);
+    void startSegmentEncode(const QVector<ClipInfo>& results);
+    void segmentOutput(int index);
+    void segmentFinished(int index, bool ok);
+    void joinSegments();
+    bool appendCameraData(QString* errMsg);
+    void stopSegments();
+    void complete(bool ok, const QString& errMsg = QString());
+
+    QStringList mInputs;
+    QString mOutput;
+    VideoEncode mEncode;
+    int mQuality;
+    bool mIncludeGps;
+    int mThreads;
+    int mSegments;
+
+    ClipProber* mProber;
+    Mp4Concat* mConcat;
+    QProcess* mFFmpegProc;
+    FFmpegProgress mFFmpegProgress;
+    AvMerge* mAvMerge;
+    QElapsedTimer mMergeTimer;
+    QByteArray mUdtaData;
+    QVector<Segment> mSegmentList;
+    QTemporaryDir* mSegmentDir;
+    int mSegmentsRunning;
+    bool mSegmentFailed;
+    bool mJoiningSegments;
+    float mDuration;
+    Stage mStage;
+    bool mRunning;
+    bool mCancelled;
+    QString mError;
+};
+
+#endif // CLIPMERGER_HPP
@@ -21,35 +21,31 @@
 
 #include <QFileDialog>
 #include <QMessageBox>
-#include <QProcess>
-#include <QTemporaryFile>
 #include <QComboBox>
 #include <QSpinBox>
 #include <QDebug>
 #include <QtGlobal>
-#include <QDateTime>
+#include <QFileInfo>
 #include <QSettings>
-#include <QLibrary>
 
-#include "mp4file.hpp"
-#include "toollocator.hpp"
+#include "clipmerger.hpp"
+#include "encoderbenchmark.hpp"
+#include "encoderprobe.hpp"
+#include "jobqueue.hpp"
+#include "routedetector.hpp"
 
 
 ClipMergeWidget::ClipMergeWidget(QWidget *parent) :
     QWidget(parent),
     ui(new Ui::ClipMergeWidget),
     mInputFileModel(new QFileSystemModel(this)),
-    mInputFileList(),
-    mOutputFile(),
-    mFFmpegProc(nullptr),
-    mFFmpegStream(),
     mProgDlg(new QProgressDialog(this)),
-    mFFmpegRegex("time=(\\d\\d):(\\d\\d):(\\d\\d.\\d\\d)"),
-    mHaveNvenc(false),
-    mHaveQsv(false),
-    mUdtaData()
+    mEncoderProbe(new EncoderProbe(this)),
+    mBenchmark(new EncoderBenchmark(this)),
+    mMerger(new ClipMerger(this)),
+    mQueue(new JobQueue(this)),
+    mQueueErrors()
 {
-    Q_ASSERT(mFFmpegRegex.isValid());
     ui->setupUi(this);
 
     mInputFileModel->setFilter(QDir::Files | QDir::Readable);
@@ -69,11 +65,20 @@ ClipMergeWidget::ClipMergeWidget(QWidget *parent) :
     mProgDlg->reset();
 
     QComboBox* videoEncodeComboBox = findChild<QComboBox*>("videoEncodeComboBox");
-    videoEncodeComboBox->addItem(tr("Copy Video (fast)"), QVariant(int(VideoEncodeCopy)));
-    videoEncodeComboBox->addItem(tr("Re-encode Video (slow)"), QVariant(int(VideoEncodeSoftware)));
+    videoEncodeComboBox->addItem(tr("Copy Video (fast)"), QVariant(int(ClipMerger::VideoEncodeCopy)));
     videoEncodeComboBox->setCurrentIndex(0);
 
-    QMetaObject::invokeMethod(this, &ClipMergeWidget::nvencCheckStart, Qt::QueuedConnection);
+    // Test encodes are only needed when ffmpeg has changed since the last run
+    connect(
+        mEncoderProbe,
+        &EncoderProbe::finished,
+        this,
+        &ClipMergeWidget::encodersDetected);
+
+    if (mEncoderProbe->loadCached())
+        QMetaObject::invokeMethod(this, &ClipMergeWidget::encodersDetected, Qt::QueuedConnection);
+    else
+        mEncoderProbe->start();
 
     connect(
         findChild<QPushButton*>("inputDirButton"),
@@ -105,6 +110,72 @@ ClipMergeWidget::ClipMergeWidget(QWidget *parent) :
         this,
         &ClipMergeWidget::startMerge);
 
+    connect(
+        findChild<QPushButton*>("benchmarkButton"),
+        &QPushButton::released,
+        this,
+        &ClipMergeWidget::startBenchmark);
+
+    connect(
+        mBenchmark,
+        &EncoderBenchmark::progress,
+        this,
+        &ClipMergeWidget::mergeProgress);
+
+    connect(
+        mBenchmark,
+        &EncoderBenchmark::finished,
+        this,
+        &ClipMergeWidget::benchmarkFinished);
+
+    connect(
+        findChild<QPushButton*>("queueButton"),
+        &QPushButton::released,
+        this,
+        &ClipMergeWidget::queueMerge);
+
+    connect(
+        findChild<QPushButton*>("queueRoutesButton"),
+        &QPushButton::released,
+        this,
+        &ClipMergeWidget::queueRoutes);
+
+    connect(
+        findChild<QPushButton*>("cancelQueueButton"),
+        &QPushButton::released,
+        mQueue,
+        &JobQueue::cancelAll);
+
+    connect(
+        mQueue,
+        &JobQueue::progress,
+        this,
+        &ClipMergeWidget::queueProgress);
+
+    connect(
+        mQueue,
+        &JobQueue::jobFinished,
+        this,
+        &ClipMergeWidget::queueJobFinished);
+
+    connect(
+        mQueue,
+        &JobQueue::idle,
+        this,
+        &ClipMergeWidget::queueIdle);
+
+    connect(
+        mMerger,
+        &ClipMerger::progress,
+        this,
+        &ClipMergeWidget::mergeProgress);
+
+    connect(
+        mMerger,
+        &ClipMerger::finished,
+        this,
+        &ClipMergeWidget::mergeFinished);
+
     connect(
         mProgDlg,
         &QProgressDialog::canceled,
@@ -122,9 +193,9 @@ ClipMergeWidget::ClipMergeWidget(QWidget *parent) :
     settings.beginGroup("clipmerge");
     findChild<QLineEdit*>("inputDirEdit")->setText(settings.value("inputDirEdit").toString());
     findChild<QLineEdit*>("outputFileEdit")->setText(settings.value("outputFileEdit").toString());
-    videoEncodeComboBox->setCurrentIndex(settings.value("videoEncodeComboBox", 0).toInt());
     findChild<QSpinBox*>("compFactorSpinBox")->setValue(settings.value("compFactorSpinBox", 30).toInt());
     findChild<QCheckBox*>("includeGpsCheckBox")->setChecked(settings.value("includeGpsCheckBox", true).toBool());
+    findChild<QCheckBox*>("splitEncodeCheckBox")->setChecked(settings.value("splitEncodeCheckBox", true).toBool());
 }
 
 ClipMergeWidget::~ClipMergeWidget()
@@ -191,406 +262,360 @@ void ClipMergeWidget::selectFilesInRoute()
         return;
     }
 
-    QRegularExpression filenameRegex(
-                "^(\\d{6}_\\d{6})_(\\d{3})_([BFR][HL])\\.MP4$",
-                QRegularExpression::CaseInsensitiveOption);
-    filenameRegex.optimize();
-
-    const QString dtPattern("yyyyMMdd_HHmmss");
-
     QModelIndex idx = inputFileView->selectionModel()->selectedRows().at(0);
-    //qDebug() << "idx" << idx;
-    QString startFilename = mInputFileModel->data(idx, QFileSystemModel::FileNameRole).toString();
-    //qDebug() << "startFilename" << startFilename;
+    const QFileInfo startInfo(mInputFileModel->data(idx, QFileSystemModel::FilePathRole).toString());
+    const QString startPath = startInfo.absoluteFilePath();
 
-    QRegularExpressionMatch match = filenameRegex.match(startFilename);
-    if (!match.hasMatch())
+    qint64 secs = 0;
+    int sequence = 0;
+    QString channel;
+    if (!RouteDetector::parseFileName(startInfo.fileName(), &secs, &sequence, &channel))
     {
         QMessageBox::information(this, selectionButton->text(), tr("Filename not in expected format"));
         return;
     }
 
-
-    QDateTime lastDT(QDateTime::fromString(QLatin1String("20") + match.captured(1), dtPattern));
-    //qDebug() << "match" << match << "lastDT" << lastDT;
-    //int lastCount = match.captured(2).toInt();
-    QString quality = match.captured(3);
-
-    int rowCount = mInputFileModel->rowCount(inputFileView->rootIndex());
-    for (int row = idx.row() + 1; row < rowCount; ++row)
+    // Select the rest of the route from the chosen file on
+    const QVector<ClipRoute> routes = RouteDetector::detectDirectory(startInfo.absolutePath());
+    for (const ClipRoute& route : routes)
     {
-        idx = mInputFileModel->index(row, 0, inputFileView->rootIndex());
-        //qDebug() << "idx" << idx;
-        QString filepath = mInputFileModel->data(idx, QFileSystemModel::FileNameRole).toString();
-        match = filenameRegex.match(filepath);
-        if (!match.hasMatch())
-            continue;
-        //qDebug() << "filepath" << filepath << match.captured(3);
-        if (match.captured(3) != quality)
+        const int start = route.files.indexOf(startPath);
+        if (start < 0)
             continue;
 
-        QDateTime dt(QDateTime::fromString(QLatin1String("20") + match.captured(1), dtPattern));
-        //qDebug() << "match" << match << "dt" << dt;
-        qint64 timeDiff = lastDT.secsTo(dt);
-        //qDebug() << "timeDiff" << timeDiff;
-        if (timeDiff == 0 || timeDiff > 300)
-            break;
-
-        qDebug() << "filepath" << filepath;
-        lastDT = dt;
-
-        inputFileView->selectionModel()->select(idx, QItemSelectionModel::Select | QItemSelectionModel::Rows);
+        for (int i = start + 1; i < route.files.size(); ++i)
+        {
+            qDebug() << "filepath" << route.files.at(i);
+            idx = mInputFileModel->index(route.files.at(i));
+            inputFileView->selectionModel()->select(idx, QItemSelectionModel::Select | QItemSelectionModel::Rows);
+        }
+        break;
     }
 
     inputFileView->setFocus();
 }
 
 
-void ClipMergeWidget::startMerge()
+bool ClipMergeWidget::readMergeInputs(QStringList* inputs, QString* output)
 {
-    QPushButton* mergeButton = findChild<QPushButton*>("mergeButton");
     QTableView* inputFileView = findChild<QTableView*>("inputFileView");
-    QLineEdit* outputFileEdit = findChild<QLineEdit*>("outputFileEdit");
-    const bool includeGpsData = findChild<QCheckBox*>("includeGpsCheckBox")->isChecked();
 
     QModelIndexList selectionList = inputFileView->selectionModel()->selectedRows();
-    mInputFileList.clear();
-
     if (selectionList.isEmpty())
     {
         QMessageBox::warning(this, tr("Merge"), tr("No files selected"));
-        return;
+        return false;
     }
 
-    mProgDlg->setMaximum(selectionList.size());
-    mProgDlg->setLabelText(tr("Preparing for merge"));
-    mProgDlg->setCancelButtonText(QString());
+    *output = QDir::fromNativeSeparators(findChild<QLineEdit*>("outputFileEdit")->text());
+    if (output->isEmpty())
+    {
+        QMessageBox::warning(this, tr("Merge"), tr("Output file not set"));
+        return false;
+    }
 
+    inputs->clear();
     for (const QModelIndex& idx: selectionList)
     {
-        mInputFileList << mInputFileModel->data(idx, QFileSystemModel::FilePathRole).toString();
+        *inputs << mInputFileModel->data(idx, QFileSystemModel::FilePathRole).toString();
     }
+    inputs->sort();
 
-    mInputFileList.sort();
-    mUdtaData.clear();
+    QSettings settings;
+    settings.beginGroup("clipmerge");
+    settings.setValue("inputDirEdit", findChild<QLineEdit*>("inputDirEdit")->text());
+    settings.setValue("outputFileEdit", findChild<QLineEdit*>("outputFileEdit")->text());
+    settings.setValue("videoEncodeComboBox", findChild<QComboBox*>("videoEncodeComboBox")->currentIndex());
+    settings.setValue("compFactorSpinBox", findChild<QSpinBox*>("compFactorSpinBox")->value());
+    settings.setValue("includeGpsCheckBox", findChild<QCheckBox*>("includeGpsCheckBox")->isChecked());
+    settings.setValue("splitEncodeCheckBox", findChild<QCheckBox*>("splitEncodeCheckBox")->isChecked());
+    settings.endGroup();
+    return true;
+}
 
-    float duration = 0.0f;
-    for (int i = 0; i < mInputFileList.size(); ++i)
-    {
-        const QString& filepath = mInputFileList[i];
-        mProgDlg->setValue(i);
+void ClipMergeWidget::startMerge()
+{
+    QPushButton* mergeButton = findChild<QPushButton*>("mergeButton");
 
-        Mp4File probeFile(filepath);
-        if (!probeFile.open(QIODevice::ReadOnly))
-        {
-            mProgDlg->reset();
-            QMessageBox::warning(this, tr("Merge"), tr("Input file not found:\n%1").arg(filepath));
-            return;
-        }
-        QString errmsg;
-        double probeDuration = probeFile.readDuration(&errmsg);
+    QStringList inputFileList;
+    QString outputFile;
+    if (!readMergeInputs(&inputFileList, &outputFile))
+        return;
 
-        if (includeGpsData && (i == 0))
-        {
-            mUdtaData = probeFile.readUdta(&errmsg);
-            if (mUdtaData.isEmpty())
-            {
-                if (errmsg.isEmpty())
-                    errmsg = tr("Failed to read camera info");
-                QMessageBox::warning(this, tr("Merge"), errmsg);
-                return;
-            }
-        }
+    mProgDlg->reset();
+    mProgDlg->setValue(0);
+    mProgDlg->setMaximum(inputFileList.size());
+    mProgDlg->setLabelText(tr("Preparing for merge"));
+    mProgDlg->setCancelButtonText(tr("Cancel"));
 
-        probeFile.close();
-        if (qIsNaN(probeDuration))
-        {
-          mProgDlg->reset();
-          QMessageBox::warning(this, tr("Merge"), errmsg);
-          return;
-        }
+    mMerger->setInputs(inputFileList);
+    mMerger->setOutput(outputFile);
+    mMerger->setVideoEncode(
+        ClipMerger::VideoEncode(findChild<QComboBox*>("videoEncodeComboBox")->currentData().toInt()));
+    mMerger->setQuality(findChild<QSpinBox*>("compFactorSpinBox")->value());
+    mMerger->setIncludeGps(findChild<QCheckBox*>("includeGpsCheckBox")->isChecked());
+    mMerger->setSegments(findChild<QCheckBox*>("splitEncodeCheckBox")->isChecked() ? 0 : 1);
 
-        qDebug() << filepath << probeDuration;
-        duration += probeDuration;
-    }
+    mergeButton->setDisabled(true);
+    mMerger->start();
+}
 
-    mOutputFile = QDir::fromNativeSeparators(outputFileEdit->text());
-    if (mOutputFile.isEmpty())
-    {
-        mProgDlg->reset();
-        QMessageBox::warning(this, tr("Merge"), tr("Output file not set"));
+void ClipMergeWidget::mergeProgress(int value, int maximum, const QString& status)
+{
+    if (mProgDlg->wasCanceled())
         return;
-    }
+    mProgDlg->setMaximum(maximum);
+    mProgDlg->setValue(value);
+    mProgDlg->setLabelText(status);
+}
 
-    mFFmpegProc = new QProcess(this);
-    QString tmpFormat(QDir(QDir::tempPath()).absoluteFilePath("nbtools.XXXXXX"));
-    QTemporaryFile* concatFile = new QTemporaryFile(tmpFormat, mFFmpegProc);
-    if (!concatFile->open())
-    {
-        mProgDlg->reset();
-        QMessageBox::warning(this, tr("Merge"), tr("Failed to create temp concat file"));
-        return;
-    }
+void ClipMergeWidget::mergeFinished(bool ok)
+{
+    mProgDlg->reset();
+    findChild<QPushButton*>("mergeButton")->setDisabled(false);
 
-    { // Scope for stream
-        QTextStream concatStream(concatFile);
-        for (const QString& file : mInputFileList)
-        {
-            concatStream << "file '" << QDir::toNativeSeparators(file) << "'\n";
-        }
-    }
-    concatFile->close();
+    if (!ok && !mMerger->wasCancelled() && !mMerger->errorString().isEmpty())
+        QMessageBox::warning(this, tr("Merge"), mMerger->errorString());
+}
 
-    QComboBox* videoEncodeComboBox = findChild<QComboBox*>("videoEncodeComboBox");
-    VideoEncode encode = VideoEncode(videoEncodeComboBox->currentData().toInt());
+void ClipMergeWidget::cancelMerge()
+{
+    mMerger->cancel();
+    mBenchmark->cancel();
+}
 
-    QStringList args;
-    args << "-hide_banner" << "-y" << "-nostdin"; // Global args
+void ClipMergeWidget::queueMerge()
+{
+    QStringList inputFileList;
+    QString outputFile;
+    if (!readMergeInputs(&inputFileList, &outputFile))
+        return;
 
-    // Use nvdec
-    if (encode == VideoEncodeNVidia)
+    if (mQueue->hasPendingOutput(outputFile))
     {
-        args << "-hwaccel" << "cuda" << "-hwaccel_output_format" << "cuda";
+        QMessageBox::warning(this, tr("Merge"), tr("Output file is already in the queue"));
+        return;
     }
 
-    // Input args
-    args << "-f" << "concat" << "-safe" << "0" << "-i" << QDir::toNativeSeparators(concatFile->fileName());
+    mQueue->addMerge(
+        inputFileList,
+        outputFile,
+        ClipMerger::VideoEncode(findChild<QComboBox*>("videoEncodeComboBox")->currentData().toInt()),
+        findChild<QSpinBox*>("compFactorSpinBox")->value(),
+        findChild<QCheckBox*>("includeGpsCheckBox")->isChecked(),
+        findChild<QCheckBox*>("splitEncodeCheckBox")->isChecked());
 
-    QSpinBox* compFactorSpinBox = findChild<QSpinBox*>("compFactorSpinBox");
-    QString crfStr(QString::number(compFactorSpinBox->value()));
+    findChild<QPushButton*>("cancelQueueButton")->setEnabled(true);
+}
 
-    switch (encode)
+void ClipMergeWidget::queueRoutes()
+{
+    QPushButton* queueRoutesButton = findChild<QPushButton*>("queueRoutesButton");
+    const QString inputDir = QDir::fromNativeSeparators(findChild<QLineEdit*>("inputDirEdit")->text());
+    const QString outputFile = QDir::fromNativeSeparators(findChild<QLineEdit*>("outputFileEdit")->text());
+    if (inputDir.isEmpty() || !QDir(inputDir).exists())
     {
-    case VideoEncodeCopy:
-        args << "-c:v" << "copy";
-        break;
-    case VideoEncodeSoftware:
-        args << "-c:v" << "libx264" << "-crf" << crfStr;
-        break;
-    case VideoEncodeNVidia:
-        args << "-c:v" << "h264_nvenc" << "-rc" << "vbr" << "-cq" << crfStr;
-        break;
-    case VideoEncodeQsv:
-        args << "-c:v" << "h264_qsv" << "-global_quality" << crfStr;
-        break;
+        QMessageBox::warning(this, queueRoutesButton->text(), tr("Input directory not found"));
+        return;
     }
-
-    // Subtitle track is GPS data
-    if (includeGpsData)
+    if (outputFile.isEmpty())
     {
-        args << "-c:s" << "copy"; // Copy subtitles
+        QMessageBox::warning(this, queueRoutesButton->text(), tr("Output file not set"));
+        return;
     }
-    else
+
+    const QVector<ClipRoute> routes = RouteDetector::detectDirectory(inputDir);
+    if (routes.isEmpty())
     {
-        args << "-map" << "0:v" << "-map" << "0:a"; // Only merge video & audio
+        QMessageBox::information(this, queueRoutesButton->text(), tr("No routes found"));
+        return;
     }
 
-    args << QDir::toNativeSeparators(mOutputFile);
-    qDebug() << ToolLocator::instance()->ffmpeg() << args;
-
+    // Each route is written next to the output file, named after its start
+    // time and channel
+    const ClipMerger::VideoEncode encode =
+        ClipMerger::VideoEncode(findChild<QComboBox*>("videoEncodeComboBox")->currentData().toInt());
+    const int quality = findChild<QSpinBox*>("compFactorSpinBox")->value();
+    const bool includeGpsData = findChild<QCheckBox*>("includeGpsCheckBox")->isChecked();
+    const bool splitEncode = findChild<QCheckBox*>("splitEncodeCheckBox")->isChecked();
+    int queued = 0;
+    for (const ClipRoute& route : routes)
+    {
+        const QString routeOutput = RouteDetector::outputPath(outputFile, route);
+        if (mQueue->hasPendingOutput(routeOutput))
+            continue;
+        mQueue->addMerge(route.files, routeOutput, encode, quality, includeGpsData, splitEncode);
+        ++queued;
+    }
 
     QSettings settings;
     settings.beginGroup("clipmerge");
     settings.setValue("inputDirEdit", findChild<QLineEdit*>("inputDirEdit")->text());
     settings.setValue("outputFileEdit", findChild<QLineEdit*>("outputFileEdit")->text());
-    settings.setValue("videoEncodeComboBox", videoEncodeComboBox->currentIndex());
-    settings.setValue("compFactorSpinBox", compFactorSpinBox->value());
-    settings.setValue("includeGpsCheckBox", findChild<QCheckBox*>("includeGpsCheckBox")->isChecked());
     settings.endGroup();
 
-    mFFmpegProc->setProgram(ToolLocator::instance()->ffmpeg());
-    mFFmpegProc->setArguments(args);
-    mFFmpegProc->setStandardInputFile(QProcess::nullDevice());
-    mFFmpegProc->setProcessChannelMode(QProcess::MergedChannels);
-    mFFmpegStream.setDevice(mFFmpegProc);
-
-    mProgDlg->reset();
-    mProgDlg->setValue(0);
-    mProgDlg->setMaximum(duration);
-    mProgDlg->setCancelButtonText(tr("Cancel"));
-
-    connect(
-        mFFmpegProc,
-        &QProcess::readyRead,
-        this,
-        &ClipMergeWidget::ffmpegStdout);
-
-    connect(
-        mFFmpegProc,
-        QOverload<int,QProcess::ExitStatus>::of(&QProcess::finished),
-        this,
-        &ClipMergeWidget::ffmpegFinished);
-
-    mFFmpegProc->start();
-    mergeButton->setDisabled(true);
-
+    if (queued > 0)
+        findChild<QPushButton*>("cancelQueueButton")->setEnabled(true);
+    QMessageBox::information(
+        this, queueRoutesButton->text(), tr("Queued %1 of %2 routes").arg(queued).arg(routes.size()));
 }
 
-void ClipMergeWidget::ffmpegStdout()
+void ClipMergeWidget::queueProgress(int value, int maximum)
 {
-    if (mProgDlg->wasCanceled())
-        return;
-
-    QString line;
-    while (mFFmpegStream.readLineInto(&line))
+    QProgressBar* queueProgressBar = findChild<QProgressBar*>("queueProgressBar");
+    queueProgressBar->setMaximum(qMax(1, maximum));
+    queueProgressBar->setValue(value);
+    if (!mQueue->isIdle())
     {
-        //qDebug() << "FFMPEG: " << line;
-        QRegularExpressionMatch match = mFFmpegRegex.match(line);
-        if (match.hasMatch())
-        {
-            float pos = (match.captured(1).toInt() * 3600) + (match.captured(2).toInt() * 60) + match.captured(3).toFloat();
-            mProgDlg->setValue(pos);
-            mProgDlg->setLabelText(tr("Merging: %1 / %2").arg(pos, 0, 'f', 1).arg(mProgDlg->maximum()));
-        }
+        findChild<QLabel*>("queueLabel")->setText(
+            tr("Queue: %1 running, %2 waiting").arg(mQueue->runningCount()).arg(mQueue->queuedCount()));
     }
 }
 
-void ClipMergeWidget::ffmpegFinished(int exitCode, QProcess::ExitStatus exitStatus)
+void ClipMergeWidget::queueJobFinished(int id, bool ok)
 {
-    qDebug() << "FFmpeg finished" << exitCode << exitStatus;
-    mFFmpegProc->deleteLater();
-    mFFmpegProc = nullptr;
-    mProgDlg->reset();
-    findChild<QPushButton*>("mergeButton")->setDisabled(false);
-
-    if (exitStatus != QProcess::NormalExit || exitCode != 0)
+    if (!ok && mQueue->state(id) == JobQueue::JobFailed)
     {
-        QMessageBox::warning(this, tr("Merge"), tr("Failed to merge files"));
-        return;
+        mQueueErrors << tr("%1: %2").arg(
+            QDir::toNativeSeparators(mQueue->output(id)), mQueue->errorString(id));
     }
+}
 
-    // If not adding GPS data, don't copy camera info
-    if (!findChild<QCheckBox*>("includeGpsCheckBox")->isChecked())
-        return;
+void ClipMergeWidget::queueIdle()
+{
+    findChild<QLabel*>("queueLabel")->setText(tr("Queue finished"));
+    findChild<QPushButton*>("cancelQueueButton")->setEnabled(false);
 
-    Mp4File outFile(mOutputFile);
-    if (!outFile.open(QFile::ReadWrite | QFile::ExistingOnly))
-    {
-        QMessageBox::warning(this, tr("Merge"), tr("Failed to open output file to add GPS data."));
-        return;
-    }
-    QString err;
-    if (!outFile.appendUdta(mUdtaData, &err))
-    {
-        QMessageBox::warning(this, tr("Merge"), err);
+    if (mQueueErrors.isEmpty())
         return;
-    }
-    outFile.close();
 
+    const int maxShown = 10;
+    QString msg = QStringList(mQueueErrors.mid(0, maxShown)).join('\n');
+    if (mQueueErrors.size() > maxShown)
+        msg += tr("\n... and %1 more").arg(mQueueErrors.size() - maxShown);
+    mQueueErrors.clear();
+    QMessageBox::warning(this, tr("Merge"), msg);
 }
 
-void ClipMergeWidget::cancelMerge()
+void ClipMergeWidget::encodersDetected()
 {
-    if (mFFmpegProc)
-    {
-        mFFmpegProc->terminate();
-    }
+    QComboBox* videoEncodeComboBox = findChild<QComboBox*>("videoEncodeComboBox");
+    if (mEncoderProbe->haveLibx264())
+        videoEncodeComboBox->addItem(tr("Re-encode Video (slow)"), QVariant(int(ClipMerger::VideoEncodeSoftware)));
+    if (mEncoderProbe->haveNvenc())
+        videoEncodeComboBox->addItem(tr("Re-encode Video Using NVidia"), QVariant(int(ClipMerger::VideoEncodeNVidia)));
+    if (mEncoderProbe->haveQsv())
+        videoEncodeComboBox->addItem(tr("Re-encode Video Using Intel QSV"), QVariant(int(ClipMerger::VideoEncodeQsv)));
+
+    // The saved choice is only restored once every item is in place
+    QSettings settings;
+    const int index = settings.value("clipmerge/videoEncodeComboBox", 0).toInt();
+    if (index < videoEncodeComboBox->count())
+        videoEncodeComboBox->setCurrentIndex(index);
+
+    // A re-encode uses whichever encoder measured fastest on this machine
+    if (videoEncodeComboBox->currentData().toInt() != int(ClipMerger::VideoEncodeCopy))
+        selectFastestEncoder();
+    findChild<QPushButton*>("benchmarkButton")->setEnabled(true);
 }
 
-void ClipMergeWidget::nvencCheckStart()
+void ClipMergeWidget::startBenchmark()
 {
-#ifdef Q_OS_LINUX
-    QLibrary libcuda("cuda");
-    if (!libcuda.load())
+    QComboBox* videoEncodeComboBox = findChild<QComboBox*>("videoEncodeComboBox");
+    QVector<ClipMerger::VideoEncode> encoders;
+    for (int i = 0; i < videoEncodeComboBox->count(); ++i)
     {
-        qDebug() << "Failed to locate libcuda, skipping ffmpeg check: " << libcuda.errorString();
-        QMetaObject::invokeMethod(this, &ClipMergeWidget::qsvCheckStart, Qt::QueuedConnection);
-        return;
+        const ClipMerger::VideoEncode encode = ClipMerger::VideoEncode(videoEncodeComboBox->itemData(i).toInt());
+        if (encode != ClipMerger::VideoEncodeCopy)
+            encoders << encode;
     }
-    libcuda.unload();
-#endif
-    QStringList nvencCheckArgs;
-    nvencCheckArgs
-        << "-hide_banner"<< "-nostdin"
-        << "-f" << "lavfi" << "-i" << "nullsrc=s=256x256:d=5"
-        << "-c:v" << "hevc_nvenc"
-        << "-gpu" << "list"
-        << "-f" << "null" << QProcess::nullDevice();
-
-    mFFmpegProc = new QProcess(this);
-    mFFmpegProc->setProgram(ToolLocator::instance()->ffmpeg());
-    mFFmpegProc->setArguments(nvencCheckArgs);
-    mFFmpegProc->setStandardInputFile(QProcess::nullDevice());
 
-    connect(
-        mFFmpegProc,
-        QOverload<int,QProcess::ExitStatus>::of(&QProcess::finished),
-        this,
-        &ClipMergeWidget::nvencCheckFinished);
+    // A selected clip is closer to real footage than the test pattern
+    QString sample;
+    QModelIndexList selectionList = findChild<QTableView*>("inputFileView")->selectionModel()->selectedRows();
+    if (!selectionList.isEmpty())
+        sample = mInputFileModel->data(selectionList.first(), QFileSystemModel::FilePathRole).toString();
+
+    mProgDlg->reset();
+    mProgDlg->setValue(0);
+    mProgDlg->setMaximum(encoders.size() * 2);
+    mProgDlg->setLabelText(tr("Preparing benchmark"));
+    mProgDlg->setCancelButtonText(tr("Cancel"));
+
+    mBenchmark->setEncoders(encoders);
+    mBenchmark->setQuality(findChild<QSpinBox*>("compFactorSpinBox")->value());
+    mBenchmark->setSample(sample);
 
-    mFFmpegProc->start();
+    findChild<QPushButton*>("benchmarkButton")->setDisabled(true);
+    findChild<QPushButton*>("mergeButton")->setDisabled(true);
+    mBenchmark->start();
 }
 
-void ClipMergeWidget::nvencCheckFinished(int, QProcess::ExitStatus exitStatus)
+void ClipMergeWidget::benchmarkFinished(bool ok)
 {
-    if (exitStatus == QProcess::NormalExit)
+    QPushButton* benchmarkButton = findChild<QPushButton*>("benchmarkButton");
+    const bool cancelled = mProgDlg->wasCanceled();
+    mProgDlg->reset();
+    benchmarkButton->setDisabled(false);
+    findChild<QPushButton*>("mergeButton")->setDisabled(false);
+
+    if (!ok)
+    {
+        if (!cancelled)
+            QMessageBox::warning(this, benchmarkButton->text(), tr("Benchmark failed"));
+        return;
+    }
+
+    QComboBox* videoEncodeComboBox = findChild<QComboBox*>("videoEncodeComboBox");
+    QStringList lines;
+    for (const EncoderBenchmark::Result& result : mBenchmark->results())
     {
-        QTextStream stream(mFFmpegProc->readAllStandardError());
-        QString line;
-        while (stream.readLineInto(&line))
+        const QString name = videoEncodeComboBox->itemText(videoEncodeComboBox->findData(int(result.encode)));
+        if (result.ok)
+        {
+            lines << tr("%1: %2 fps, %3 MB, SSIM %4")
+                .arg(name)
+                .arg(result.fps, 0, 'f', 0)
+                .arg(result.size / (1024.0 * 1024.0), 0, 'f', 1)
+                .arg(result.ssim, 0, 'f', 3);
+        }
+        else
         {
-            //qDebug() << "NVENC PROBE: " << line;
-            if (line.startsWith("[hevc_nvenc") && line.contains("Compute SM"))
-            {
-                mHaveNvenc = true;
-                QComboBox* videoEncodeComboBox = findChild<QComboBox*>("videoEncodeComboBox");
-                videoEncodeComboBox->addItem(tr("Re-encode Video Using NVidia"), QVariant(int(VideoEncodeNVidia)));
-
-                QSettings settings;
-                videoEncodeComboBox->setCurrentIndex(settings.value("clipmerge/videoEncodeComboBox", 0).toInt());
-            }
+            lines << tr("%1: failed").arg(name);
         }
     }
-    mFFmpegProc->deleteLater();
-    mFFmpegProc = nullptr;
-    QMetaObject::invokeMethod(this, &ClipMergeWidget::qsvCheckStart, Qt::QueuedConnection);
-}
-
-void ClipMergeWidget::qsvCheckStart()
-{
-    QStringList nvencCheckArgs;
-    nvencCheckArgs
-        << "-hide_banner" << "-nostdin"
-        << "-f" << "lavfi" << "-i" << "nullsrc=s=256x256:d=5"
-        << "-c:v" << "hevc_qsv"
-        << "-f" << "null" << QProcess::nullDevice();
-
-    mFFmpegProc = new QProcess(this);
-    mFFmpegProc->setProgram(ToolLocator::instance()->ffmpeg());
-    mFFmpegProc->setArguments(nvencCheckArgs);
-    mFFmpegProc->setStandardInputFile(QProcess::nullDevice());
-
-    connect(
-        mFFmpegProc,
-        QOverload<int,QProcess::ExitStatus>::of(&QProcess::finished),
-        this,
-        &ClipMergeWidget::qsvCheckFinished);
 
-    mFFmpegProc->start();
+    selectFastestEncoder();
+    lines << QString() << tr("Selected: %1").arg(videoEncodeComboBox->currentText());
+    QMessageBox::information(this, benchmarkButton->text(), lines.join('\n'));
 }
 
-void ClipMergeWidget::qsvCheckFinished(int, QProcess::ExitStatus exitStatus)
+void ClipMergeWidget::selectFastestEncoder()
 {
-    if (exitStatus == QProcess::NormalExit)
-    {
-        mHaveNvenc = true;
-        QComboBox* videoEncodeComboBox = findChild<QComboBox*>("videoEncodeComboBox");
-        videoEncodeComboBox->addItem(tr("Re-encode Video Using Intel QSV"), QVariant(int(VideoEncodeQsv)));
+    QVector<EncoderBenchmark::Result> results;
+    if (!EncoderBenchmark::loadResults(&results))
+        return;
 
-        QSettings settings;
-        videoEncodeComboBox->setCurrentIndex(settings.value("clipmerge/videoEncodeComboBox", 0).toInt());
-    }
-    mFFmpegProc->deleteLater();
-    mFFmpegProc = nullptr;
+    // Below this the loss is visible on number plates and signs
+    const double minSsim = 0.95;
+    const int fastest = EncoderBenchmark::fastest(results, minSsim);
+    if (fastest < 0)
+        return;
+
+    QComboBox* videoEncodeComboBox = findChild<QComboBox*>("videoEncodeComboBox");
+    const int index = videoEncodeComboBox->findData(int(results.at(fastest).encode));
+    if (index >= 0)
+        videoEncodeComboBox->setCurrentIndex(index);
 }
 
 void ClipMergeWidget::encodeChanged()
 {
-    VideoEncode encode = VideoEncode(findChild<QComboBox*>("videoEncodeComboBox")->currentData().toInt());
+    ClipMerger::VideoEncode encode = ClipMerger::VideoEncode(findChild<QComboBox*>("videoEncodeComboBox")->currentData().toInt());
     QLabel* compressionLabel = findChild<QLabel*>("compressionLabel");
     QSpinBox* compFactorSpinBox = findChild<QSpinBox*>("compFactorSpinBox");
-    compressionLabel->setEnabled(encode != VideoEncodeCopy);
-    compFactorSpinBox->setEnabled(encode != VideoEncodeCopy);
+    compressionLabel->setEnabled(encode != ClipMerger::VideoEncodeCopy);
+    compFactorSpinBox->setEnabled(encode != ClipMerger::VideoEncodeCopy);
+    findChild<QCheckBox*>("splitEncodeCheckBox")->setEnabled(encode == ClipMerger::VideoEncodeSoftware);
 }
 
 
@@ -22,15 +22,17 @@
 #include <QWidget>
 
 #include <QFileSystemModel>
-#include <QProcess>
 #include <QProgressDialog>
-#include <QRegularExpression>
-#include <QTextStream>
 
 namespace Ui {
 class ClipMergeWidget;
 }
 
+class ClipMerger;
+class EncoderBenchmark;
+class EncoderProbe;
+class JobQueue;
+
 class ClipMergeWidget : public QWidget
 {
     Q_OBJECT
@@ -45,36 +47,31 @@ private slots:
     void inputDirChanged();
     void selectFilesInRoute();
     void startMerge();
-    void ffmpegStdout();
-    void ffmpegFinished(int exitCode, QProcess::ExitStatus exitStatus);
+    void mergeProgress(int value, int maximum, const QString& status);
+    void mergeFinished(bool ok);
     void cancelMerge();
-    void nvencCheckStart();
-    void nvencCheckFinished(int exitCode, QProcess::ExitStatus exitStatus);
-    void qsvCheckStart();
-    void qsvCheckFinished(int exitCode, QProcess::ExitStatus exitStatus);
+    void queueMerge();
+    void queueRoutes();
+    void queueProgress(int value, int maximum);
+    void queueJobFinished(int id, bool ok);
+    void queueIdle();
+    void encodersDetected();
+    void startBenchmark();
+    void benchmarkFinished(bool ok);
     void encodeChanged();
 
 private:
+    bool readMergeInputs(QStringList* inputs, QString* output);
+    void selectFastestEncoder();
+
     Ui::ClipMergeWidget *ui;
     QFileSystemModel* mInputFileModel;
-    QStringList mInputFileList;
-    QString mOutputFile;
-    QProcess* mFFmpegProc;
-    QTextStream mFFmpegStream;
     QProgressDialog* mProgDlg;
-    QRegularExpression mFFmpegRegex;
-    bool mHaveNvenc;
-    bool mHaveQsv;
-    QByteArray mUdtaData;
-
-    enum VideoEncode
-    {
-        VideoEncodeCopy = 0,
-        VideoEncodeSoftware,
-        VideoEncodeNVidia,
-        VideoEncodeQsv
-    };
-
+    EncoderProbe* mEncoderProbe;
+    EncoderBenchmark* mBenchmark;
+    ClipMerger* mMerger;
+    JobQueue* mQueue;
+    QStringList mQueueErrors;
 };
 
 #endif // CLIPMERGEWIDGET_H
@@ -0,0 +1,206 @@
+/* Copyright 2021-2023 Silas Parker.
+ *
+ * This file is part of NB Dashcam Tools.
+ *
+ * NB Dashcam Tools is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * NB Dashcam Tools is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NB Dashcam Tools. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "clipprobe.hpp"
+
+#include <QDebug>
+#include <QRunnable>
+#include <QThread>
+
+#include <limits>
+
+#include "clipcache.hpp"
+#include "gpssampleparser.hpp"
+#include "gpstrack.hpp"
+#include "mp4file.hpp"
+
+
+class ClipProber::Task : public QRunnable
+{
+public:
+    Task(ClipProber* prober, ClipInfo* result) :
+        mProber(prober),
+        mResult(result)
+    {}
+
+    void run() override
+    {
+        if (!mProber->isCancelled())
+            *mResult = ClipProber::probe(mResult->path, mProber->mScanGps);
+        QMetaObject::invokeMethod(mProber, "probeDone", Qt::QueuedConnection);
+    }
+
+private:
+    ClipProber* mProber;
+    ClipInfo* mResult;
+};
+
+
+ClipInfo::ClipInfo() :
+    path(),
+    duration(qQNaN()),
+    infoString(),
+    udta(),
+    errMsg(),
+    gpsScanned(false),
+    gpsValid(false),
+    gpsStartMs(0),
+    gpsEndMs(0),
+    minLatitude(0.0),
+    maxLatitude(0.0),
+    minLongitude(0.0),
+    maxLongitude(0.0)
+{}
+
+
+static void scanGpsSamples(Mp4File& file, ClipInfo* info)
+{
+    info->gpsScanned = true;
+
+    const QString camera = Mp4File::cameraModel(info->infoString);
+    if (!GpsSampleParser::isCameraSupported(camera))
+        return;
+
+    GpsTrack track;
+    GpsSampleParser::parseBuffer(file.readSubtitleData(), camera, &track);
+
+    // Fixed point columns, only converted to degrees at the end
+    const quint8 wanted = GpsTrack::TimeValid | GpsTrack::GpsValid;
+    const quint8* flags = track.flagColumn().constData();
+    const qint64* times = track.timeColumn().constData();
+    const qint32* lats = track.latitudeColumn().constData();
+    const qint32* lons = track.longitudeColumn().constData();
+    qint64 start = std::numeric_limits<qint64>::max();
+    qint64 end = std::numeric_limits<qint64>::min();
+    qint32 minLat = std::numeric_limits<qint32>::max();
+    qint32 maxLat = std::numeric_limits<qint32>::min();
+    qint32 minLon = std::numeric_limits<qint32>::max();
+    qint32 maxLon = std::numeric_limits<qint32>::min();
+    for (int i = 0; i < track.size(); ++i)
+    {
+        if ((flags[i] & wanted) != wanted)
+            continue;
+        start = qMin(start, times[i]);
+        end = qMax(end, times[i]);
+        minLat = qMin(minLat, lats[i]);
+        maxLat = qMax(maxLat, lats[i]);
+        minLon = qMin(minLon, lons[i]);
+        maxLon = qMax(maxLon, lons[i]);
+    }
+
+    if (start > end)
+        return;
+    info->gpsValid = true;
+    info->gpsStartMs = start;
+    info->gpsEndMs = end;
+    info->minLatitude = minLat / GpsTrack::coordScale;
+    info->maxLatitude = maxLat / GpsTrack::coordScale;
+    info->minLongitude = minLon / GpsTrack::coordScale;
+    info->maxLongitude = maxLon / GpsTrack::coordScale;
+}
+
+
+ClipProber::ClipProber(QObject* parent) :
+    QObject(parent),
+    mPool(),
+    mResults(),
+    mDone(0),
+    mScanGps(false),
+    mCancelled(0)
+{
+    // Probing is mostly waiting on I/O, a few requests in flight hide the
+    // latency of card readers and network shares without thrashing them
+    mPool.setMaxThreadCount(qBound(2, QThread::idealThreadCount(), 8));
+}
+
+ClipProber::~ClipProber()
+{
+    cancel();
+    mPool.waitForDone();
+}
+
+ClipInfo ClipProber::probe(const QString& path, bool scanGps)
+{
+    ClipCache* cache = ClipCache::instance();
+    ClipInfo info;
+    if (cache->find(path, &info) && (info.gpsScanned || !scanGps))
+        return info;
+
+    info = ClipInfo();
+    info.path = path;
+
+    Mp4File file(path);
+    if (!file.open(QIODevice::ReadOnly, true))
+    {
+        info.errMsg = tr("Input file not found");
+        return info;
+    }
+
+    info.duration = file.readDuration(&info.errMsg);
+    if (qIsNaN(info.duration))
+    {
+        if (info.errMsg.isEmpty())
+            info.errMsg = tr("Failed to read duration");
+        return info;
+    }
+    info.errMsg.clear();
+
+    // Camera data is optional, callers check for it if they need it
+    info.infoString = file.readInfoString();
+    info.udta = file.readUdta();
+    if (scanGps)
+        scanGpsSamples(file, &info);
+
+    cache->insert(info);
+    return info;
+}
+
+void ClipProber::start(const QStringList& files, bool scanGps)
+{
+    Q_ASSERT(mDone == mResults.size());
+    mCancelled.storeRelease(0);
+    mDone = 0;
+    mScanGps = scanGps;
+    mResults.clear();
+    mResults.resize(files.size());
+
+    // Slots are written by the workers, so the vector must not detach or
+    // reallocate until all tasks are done
+    ClipInfo* results = mResults.data();
+    for (int i = 0; i < files.size(); ++i)
+    {
+        results[i].path = files.at(i);
+        mPool.start(new Task(this, &results[i]));
+    }
+
+    if (files.isEmpty())
+        QMetaObject::invokeMethod(this, "finished", Qt::QueuedConnection);
+}
+
+void ClipProber::cancel()
+{
+    mCancelled.storeRelease(1);
+}
+
+void ClipProber::probeDone()
+{
+    ++mDone;
+    emit progress(mDone, mResults.size());
+    if (mDone == mResults.size())
+        emit finished();
+}
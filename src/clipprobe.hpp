@@ -0,0 +1,84 @@
+/* Copyright 2021-2023 Silas Parker.
+ *
+ * This file is part of NB Dashcam Tools.
+ *
+ * NB Dashcam Tools is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * NB Dashcam Tools is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NB Dashcam Tools. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CLIPPROBE_HPP
+#define CLIPPROBE_HPP
+
+#include <QObject>
+#include <QStringList>
+#include <QThreadPool>
+#include <QVector>
+#include <QAtomicInt>
+
+struct ClipInfo
+{
+    QString path;
+    double duration;
+    QString infoString;
+    QByteArray udta;
+    QString errMsg;
+
+    // GPS summary, only filled in if the samples were scanned
+    bool gpsScanned;
+    bool gpsValid;
+    qint64 gpsStartMs; // Milliseconds since epoch, UTC
+    qint64 gpsEndMs;
+    double minLatitude;
+    double maxLatitude;
+    double minLongitude;
+    double maxLongitude;
+
+    ClipInfo();
+    bool isValid() const {return errMsg.isEmpty();}
+};
+
+// Probes clips on a bounded pool of worker threads, results are kept in the
+// same order as the input files
+class ClipProber : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit ClipProber(QObject* parent = nullptr);
+    ~ClipProber();
+
+    static ClipInfo probe(const QString& path, bool scanGps = false);
+
+    void start(const QStringList& files, bool scanGps = false);
+    void cancel();
+    bool isCancelled() const {return mCancelled.loadAcquire() != 0;}
+    const QVector<ClipInfo>& results() const {return mResults;}
+
+signals:
+    void progress(int done, int total);
+    void finished();
+
+private slots:
+    void probeDone();
+
+private:
+    class Task;
+
+    QThreadPool mPool;
+    QVector<ClipInfo> mResults;
+    int mDone;
+    bool mScanGps;
+    QAtomicInt mCancelled;
+};
+
+#endif // CLIPPROBE_HPP
@@ -0,0 +1,516 @@
+/* Copyright 2021-2023 Silas Parker.
+ *
+ * This file is part of NB Dashcam Tools.
+ *
+ * NB Dashcam Tools is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * NB Dashcam Tools is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NB Dashcam Tools. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "commandline.hpp"
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QDir>
+#include <QEventLoop>
+#include <QFileInfo>
+#include <QLoggingCategory>
+#include <QTextStream>
+
+#include <cstring>
+
+#include "clipmerger.hpp"
+#include "clipprobe.hpp"
+#include "gpsexportjob.hpp"
+#include "gzipdevice.hpp"
+#include "jobqueue.hpp"
+#include "mp4concat.hpp"
+#include "mp4file.hpp"
+#include "routedetector.hpp"
+#include "toollocator.hpp"
+
+static QTextStream& outStream()
+{
+    static QTextStream stream(stdout);
+    return stream;
+}
+
+static QTextStream& errStream()
+{
+    static QTextStream stream(stderr);
+    return stream;
+}
+
+// Options shared by every command, the command name is the first
+// positional argument
+static void setupParser(QCommandLineParser* parser, const QString& command, const QString& description)
+{
+    parser->setApplicationDescription(description);
+    parser->addHelpOption();
+    parser->addOption(QCommandLineOption(QStringList() << "v" << "verbose", QObject::tr("Show debug output.")));
+    parser->addPositionalArgument(command, description, command);
+    parser->addPositionalArgument("clips", QObject::tr("Input clips."), QObject::tr("clips..."));
+}
+
+// Returns the input clips, exits with the usage text if there are none
+static QStringList processArguments(QCommandLineParser* parser, const QStringList& arguments)
+{
+    parser->process(arguments);
+    if (!parser->isSet("verbose"))
+        QLoggingCategory::setFilterRules(QStringLiteral("*.debug=false"));
+
+    QStringList files = parser->positionalArguments().mid(1);
+    if (files.isEmpty())
+        parser->showHelp(1);
+    for (QString& file : files)
+    {
+        file = QDir::fromNativeSeparators(file);
+    }
+    return files;
+}
+
+// ffmpeg is only needed when a clip can not be handled directly, so a
+// missing install is not fatal here
+static void locateTools()
+{
+    ToolLocator* tools = ToolLocator::instance();
+    tools->addSearchPath(QCoreApplication::applicationDirPath());
+    if (!tools->locate())
+    {
+        errStream() << QObject::tr("Failed to find ffmpeg tools, only direct merges and exports are available.") << '\n';
+        errStream().flush();
+    }
+}
+
+
+// Seconds, minutes:seconds or hours:minutes:seconds, seconds may have a
+// fraction
+static bool parseTime(const QString& text, double* secs)
+{
+    const QStringList parts = text.split(':');
+    if (parts.size() > 3)
+        return false;
+
+    double total = 0.0;
+    for (int i = 0; i < parts.size(); ++i)
+    {
+        bool ok = false;
+        const double value = (i == parts.size() - 1) ? parts.at(i).toDouble(&ok) : parts.at(i).toInt(&ok);
+        if (!ok || value < 0.0)
+            return false;
+        total = (total * 60.0) + value;
+    }
+    *secs = total;
+    return true;
+}
+
+
+bool CommandLine::isCommand(int argc, char* argv[])
+{
+    if (argc < 2)
+        return false;
+    for (const char* command : {"probe", "export", "merge", "extract"})
+    {
+        if (std::strcmp(argv[1], command) == 0)
+            return true;
+    }
+    return false;
+}
+
+int CommandLine::run(QCoreApplication& app)
+{
+    const QStringList arguments = app.arguments();
+    const QString command = arguments.value(1);
+    if (command == QLatin1String("probe"))
+        return probe(arguments);
+    if (command == QLatin1String("export"))
+        return exportGps(arguments);
+    if (command == QLatin1String("merge"))
+        return merge(arguments);
+    if (command == QLatin1String("extract"))
+        return extract(arguments);
+    return 1;
+}
+
+int CommandLine::probe(const QStringList& arguments)
+{
+    QCommandLineParser parser;
+    setupParser(&parser, "probe", QObject::tr("Print the duration, camera and GPS coverage of clips."));
+    QCommandLineOption gpsOption("gps", QObject::tr("Scan the GPS samples for the time and area covered."));
+    parser.addOption(gpsOption);
+    const QStringList files = processArguments(&parser, arguments);
+
+    ClipProber prober;
+    QEventLoop loop;
+    QObject::connect(&prober, &ClipProber::finished, &loop, &QEventLoop::quit);
+    prober.start(files, parser.isSet(gpsOption));
+    loop.exec();
+
+    QTextStream& out = outStream();
+    out << "file\tduration\tcamera\tgps_start\tgps_end\tmin_lat\tmax_lat\tmin_lon\tmax_lon\n";
+
+    int failed = 0;
+    for (const ClipInfo& info : prober.results())
+    {
+        if (!info.isValid())
+        {
+            errStream() << QDir::toNativeSeparators(info.path) << ": " << info.errMsg << '\n';
+            ++failed;
+            continue;
+        }
+
+        out << QDir::toNativeSeparators(info.path)
+            << '\t' << QString::number(info.duration, 'f', 3)
+            << '\t' << Mp4File::cameraModel(info.infoString);
+        if (info.gpsScanned && info.gpsValid)
+        {
+            out << '\t' << QDateTime::fromMSecsSinceEpoch(info.gpsStartMs).toUTC().toString(Qt::ISODate)
+                << '\t' << QDateTime::fromMSecsSinceEpoch(info.gpsEndMs).toUTC().toString(Qt::ISODate)
+                << '\t' << QString::number(info.minLatitude, 'f', 7)
+                << '\t' << QString::number(info.maxLatitude, 'f', 7)
+                << '\t' << QString::number(info.minLongitude, 'f', 7)
+                << '\t' << QString::number(info.maxLongitude, 'f', 7);
+        }
+        else
+        {
+            out << "\t\t\t\t\t\t";
+        }
+        out << '\n';
+    }
+    out.flush();
+    errStream().flush();
+    return failed == 0 ? 0 : 1;
+}
+
+int CommandLine::exportGps(const QStringList& arguments)
+{
+    QCommandLineParser parser;
+    setupParser(&parser, "export", QObject::tr("Export the GPS track of each clip."));
+    QCommandLineOption formatOption(
+        QStringList() << "f" << "format", QObject::tr("Comma separated output formats, gpx or csv."),
+        QObject::tr("formats"), "gpx");
+    QCommandLineOption outputDirOption(
+        QStringList() << "d" << "output-dir", QObject::tr("Write the tracks to this directory, default is next to each clip."),
+        QObject::tr("dir"));
+    QCommandLineOption compactOption("compact", QObject::tr("Write GPX without indentation."));
+    QCommandLineOption gzipOption(QStringList() << "z" << "gzip", QObject::tr("Compress the output with gzip."));
+    QCommandLineOption levelOption("level", QObject::tr("Compression level, 1 to 9."), QObject::tr("level"), "6");
+    QCommandLineOption simplifyOption(
+        "simplify", QObject::tr("Drop GPX points within this distance in metres of the simplified track."),
+        QObject::tr("metres"), "0");
+    QCommandLineOption jobsOption(
+        QStringList() << "j" << "jobs", QObject::tr("Number of clips to export at once."), QObject::tr("jobs"));
+    parser.addOption(formatOption);
+    parser.addOption(outputDirOption);
+    parser.addOption(compactOption);
+    parser.addOption(gzipOption);
+    parser.addOption(levelOption);
+    parser.addOption(simplifyOption);
+    parser.addOption(jobsOption);
+    const QStringList files = processArguments(&parser, arguments);
+
+    QVector<GpsExportFormat> formats;
+    for (const QString& name : parser.value(formatOption).toLower().split(','))
+    {
+        GpsExportFormat format = GpsExportFormat::Invalid;
+        if (name == QLatin1String("gpx"))
+            format = GpsExportFormat::GPX;
+        else if (name == QLatin1String("csv"))
+            format = GpsExportFormat::CSV;
+        else if (!name.isEmpty())
+        {
+            errStream() << QObject::tr("Unknown format: %1").arg(name) << '\n';
+            return 1;
+        }
+        if (format != GpsExportFormat::Invalid && !formats.contains(format))
+            formats << format;
+    }
+    if (formats.isEmpty())
+    {
+        errStream() << QObject::tr("Export format invalid") << '\n';
+        return 1;
+    }
+
+    GpsExportOptions options;
+    options.compact = parser.isSet(compactOption);
+    options.compress = parser.isSet(gzipOption);
+    options.compressionLevel = qBound(1, parser.value(levelOption).toInt(), 9);
+    options.simplifyTolerance = qMax(0.0, parser.value(simplifyOption).toDouble());
+    if (options.compress && !GzipDevice::isAvailable())
+    {
+        errStream() << QObject::tr("Compression is not available in this build") << '\n';
+        return 1;
+    }
+
+    const QString outputDir = QDir::fromNativeSeparators(parser.value(outputDirOption));
+    if (!outputDir.isEmpty() && !QDir().mkpath(outputDir))
+    {
+        errStream() << QObject::tr("Failed to create output directory") << '\n';
+        return 1;
+    }
+
+    locateTools();
+
+    JobQueue queue;
+    if (parser.isSet(jobsOption))
+        queue.setMaxJobs(JobQueue::ResourceDisk, parser.value(jobsOption).toInt());
+
+    for (const QString& file : files)
+    {
+        // Output is named after the clip, with the suffix of the format
+        const QFileInfo info(file);
+        const QDir dir(outputDir.isEmpty() ? info.absolutePath() : outputDir);
+        queue.addExport(
+            file, GpsExportJob::targetPath(dir.filePath(info.fileName()), formats.first(), true), formats, options);
+    }
+
+    int failed = 0;
+    QObject::connect(&queue, &JobQueue::jobFinished, [&queue, &files, &failed](int id, bool ok)
+    {
+        if (ok)
+            return;
+        errStream() << QDir::toNativeSeparators(files.at(id)) << ": " << queue.errorString(id) << '\n';
+        errStream().flush();
+        ++failed;
+    });
+
+    QEventLoop loop;
+    QObject::connect(&queue, &JobQueue::idle, &loop, &QEventLoop::quit);
+    loop.exec();
+
+    errStream() << QObject::tr("Exported %1 of %2 clips").arg(files.size() - failed).arg(files.size()) << '\n';
+    errStream().flush();
+    return failed == 0 ? 0 : 1;
+}
+
+int CommandLine::merge(const QStringList& arguments)
+{
+    QCommandLineParser parser;
+    setupParser(&parser, "merge", QObject::tr("Merge clips, in the order given, into one file."));
+    QCommandLineOption outputOption(
+        QStringList() << "o" << "output", QObject::tr("Merged output file."), QObject::tr("file"));
+    QCommandLineOption encodeOption(
+        QStringList() << "e" << "encode", QObject::tr("Video encode, copy, x264, nvenc or qsv."),
+        QObject::tr("encode"), "copy");
+    QCommandLineOption qualityOption(
+        QStringList() << "q" << "quality", QObject::tr("Compression factor when re-encoding."),
+        QObject::tr("factor"), "30");
+    QCommandLineOption noGpsOption("no-gps", QObject::tr("Leave out the GPS data and camera info."));
+    QCommandLineOption splitOption(
+        "split", QObject::tr("Encode runs of clips side by side with x264 and join the results."));
+    QCommandLineOption routesOption(
+        "routes", QObject::tr("Split the clips, or the clips in each directory given, into routes and merge "
+                              "each to its own file named after the output."));
+    parser.addOption(outputOption);
+    parser.addOption(encodeOption);
+    parser.addOption(qualityOption);
+    parser.addOption(noGpsOption);
+    parser.addOption(splitOption);
+    parser.addOption(routesOption);
+    const QStringList files = processArguments(&parser, arguments);
+
+    const QString output = QDir::fromNativeSeparators(parser.value(outputOption));
+    if (output.isEmpty())
+    {
+        errStream() << QObject::tr("Output file not set") << '\n';
+        return 1;
+    }
+
+    const QString encodeName = parser.value(encodeOption).toLower();
+    ClipMerger::VideoEncode encode;
+    if (encodeName == QLatin1String("copy"))
+        encode = ClipMerger::VideoEncodeCopy;
+    else if (encodeName == QLatin1String("x264"))
+        encode = ClipMerger::VideoEncodeSoftware;
+    else if (encodeName == QLatin1String("nvenc"))
+        encode = ClipMerger::VideoEncodeNVidia;
+    else if (encodeName == QLatin1String("qsv"))
+        encode = ClipMerger::VideoEncodeQsv;
+    else
+    {
+        errStream() << QObject::tr("Unknown encode: %1").arg(encodeName) << '\n';
+        return 1;
+    }
+
+    locateTools();
+
+    if (parser.isSet(routesOption))
+    {
+        return mergeRoutes(
+            files, output, encode, parser.value(qualityOption).toInt(),
+            !parser.isSet(noGpsOption), parser.isSet(splitOption));
+    }
+
+    ClipMerger merger;
+    merger.setInputs(files);
+    merger.setOutput(output);
+    merger.setVideoEncode(encode);
+    merger.setQuality(parser.value(qualityOption).toInt());
+    merger.setIncludeGps(!parser.isSet(noGpsOption));
+    merger.setSegments(parser.isSet(splitOption) ? 0 : 1);
+
+    // Only print when the percentage moves on, ffmpeg reports many times a
+    // second
+    int lastPercent = -1;
+    QObject::connect(&merger, &ClipMerger::progress, [&lastPercent](int value, int maximum, const QString& status)
+    {
+        const int percent = maximum > 0 ? int((qint64(value) * 100) / maximum) : 0;
+        if (percent == lastPercent)
+            return;
+        lastPercent = percent;
+        errStream() << status << '\n';
+        errStream().flush();
+    });
+
+    QEventLoop loop;
+    bool succeeded = false;
+    QObject::connect(&merger, &ClipMerger::finished, &loop, [&loop, &succeeded](bool ok)
+    {
+        succeeded = ok;
+        loop.quit();
+    });
+    merger.start();
+    loop.exec();
+
+    if (!succeeded)
+    {
+        errStream() << merger.errorString() << '\n';
+        errStream().flush();
+        return 1;
+    }
+    return 0;
+}
+
+int CommandLine::extract(const QStringList& arguments)
+{
+    QCommandLineParser parser;
+    setupParser(
+        &parser, "extract",
+        QObject::tr("Copy a time range out of clips, in the order given, cut at the keyframes around it."));
+    QCommandLineOption outputOption(
+        QStringList() << "o" << "output", QObject::tr("Extracted output file."), QObject::tr("file"));
+    QCommandLineOption startOption(
+        QStringList() << "s" << "start", QObject::tr("Start, from the start of the first clip."),
+        QObject::tr("[[hh:]mm:]ss"), "0");
+    QCommandLineOption endOption(
+        QStringList() << "e" << "end", QObject::tr("End, from the start of the first clip."),
+        QObject::tr("[[hh:]mm:]ss"));
+    QCommandLineOption noGpsOption("no-gps", QObject::tr("Leave out the GPS data and camera info."));
+    parser.addOption(outputOption);
+    parser.addOption(startOption);
+    parser.addOption(endOption);
+    parser.addOption(noGpsOption);
+    const QStringList files = processArguments(&parser, arguments);
+
+    const QString output = QDir::fromNativeSeparators(parser.value(outputOption));
+    if (output.isEmpty())
+    {
+        errStream() << QObject::tr("Output file not set") << '\n';
+        return 1;
+    }
+
+    double start = 0.0;
+    double end = 0.0;
+    if (!parseTime(parser.value(startOption), &start) || !parseTime(parser.value(endOption), &end) || end <= start)
+    {
+        errStream() << QObject::tr("Invalid range, the end must be after the start") << '\n';
+        return 1;
+    }
+
+    // Only the sample tables and the samples in the range are read, so
+    // this runs here rather than on a thread
+    Mp4Concat concat;
+    concat.setInputs(files);
+    concat.setOutput(output);
+    concat.setIncludeSubtitles(!parser.isSet(noGpsOption));
+    concat.setRange(start, end);
+
+    QString err;
+    if (!concat.prepare(&err) || !concat.write(&err))
+    {
+        errStream() << err << '\n';
+        errStream().flush();
+        return 1;
+    }
+
+    errStream() << QObject::tr("Extracted %1 s from %2 s").arg(concat.duration(), 0, 'f', 2).arg(concat.cutStart(), 0, 'f', 2)
+                << '\n';
+    errStream().flush();
+    return 0;
+}
+
+int CommandLine::mergeRoutes(
+    const QStringList& inputs, const QString& output, int encode, int quality, bool includeGps, bool splitEncode)
+{
+    QStringList files;
+    for (const QString& input : inputs)
+    {
+        const QFileInfo info(input);
+        if (!info.isDir())
+        {
+            files << input;
+            continue;
+        }
+        const QDir dir(input);
+        for (const QString& name : dir.entryList(QStringList("*.mp4"), QDir::Files | QDir::Readable))
+        {
+            files << dir.filePath(name);
+        }
+    }
+
+    const QVector<ClipRoute> routes = RouteDetector::detect(files);
+    if (routes.isEmpty())
+    {
+        errStream() << QObject::tr("No routes found") << '\n';
+        return 1;
+    }
+
+    JobQueue queue;
+    for (const ClipRoute& route : routes)
+    {
+        const QString routeOutput = RouteDetector::outputPath(output, route);
+        errStream() << QObject::tr("Route %1: %2 clips -> %3")
+            .arg(route.channel).arg(route.files.size()).arg(QDir::toNativeSeparators(routeOutput)) << '\n';
+        queue.addMerge(route.files, routeOutput, ClipMerger::VideoEncode(encode), quality, includeGps, splitEncode);
+    }
+    errStream().flush();
+
+    int lastPercent = -1;
+    QObject::connect(&queue, &JobQueue::progress, [&lastPercent](int value, int maximum)
+    {
+        const int percent = maximum > 0 ? int((qint64(value) * 100) / maximum) : 0;
+        if (percent == lastPercent)
+            return;
+        lastPercent = percent;
+        errStream() << QObject::tr("Merging routes: %1%").arg(percent) << '\n';
+        errStream().flush();
+    });
+
+    int failed = 0;
+    QObject::connect(&queue, &JobQueue::jobFinished, [&queue, &failed](int id, bool ok)
+    {
+        if (ok)
+            return;
+        errStream() << QDir::toNativeSeparators(queue.output(id)) << ": " << queue.errorString(id) << '\n';
+        errStream().flush();
+        ++failed;
+    });
+
+    QEventLoop loop;
+    QObject::connect(&queue, &JobQueue::idle, &loop, &QEventLoop::quit);
+    loop.exec();
+
+    errStream() << QObject::tr("Merged %1 of %2 routes").arg(routes.size() - failed).arg(routes.size()) << '\n';
+    errStream().flush();
+    return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,49 @@
+/* Copyright 2021-2023 Silas Parker.
+ *
+ * This file is part of NB Dashcam Tools.
+ *
+ * NB Dashcam Tools is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * NB Dashcam Tools is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NB Dashcam Tools. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef COMMANDLINE_HPP
+#define COMMANDLINE_HPP
+
+#include <QStringList>
+
+class QCoreApplication;
+
+// Runs the merge, export and probe pipelines without the GUI. Used when the
+// first argument names a command, e.g.
+//   nb-dashcam-tools probe [--gps] <clips...>
+//   nb-dashcam-tools export [--format gpx,csv] [--output-dir dir] <clips...>
+//   nb-dashcam-tools merge --output out.mp4 [--encode copy] <clips...>
+//   nb-dashcam-tools merge --routes --output trip.mp4 <dirs or clips...>
+//   nb-dashcam-tools extract --start 1:30 --end 2:00 --output out.mp4 <clips...>
+class CommandLine
+{
+public:
+    static bool isCommand(int argc, char* argv[]);
+    static int run(QCoreApplication& app);
+
+private:
+    static int probe(const QStringList& arguments);
+    static int exportGps(const QStringList& arguments);
+    static int merge(const QStringList& arguments);
+    static int extract(const QStringList& arguments);
+    static int mergeRoutes(
+        const QStringList& inputs, const QString& output, int encode, int quality, bool includeGps,
+        bool splitEncode);
+};
+
+#endif // COMMANDLINE_HPP
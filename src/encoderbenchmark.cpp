@@ -0,0 +1,359 @@
+/* Copyright 2021-2023 Silas Parker.
+ *
+ * This file is part of NB Dashcam Tools.
+ *
+ * NB Dashcam Tools is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * NB Dashcam Tools is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NB Dashcam Tools. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "encoderbenchmark.hpp"
+
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QRegularExpression>
+#include <QSettings>
+#include <QTemporaryDir>
+
+#include "encoderprobe.hpp"
+#include "toollocator.hpp"
+
+
+static QString encodeName(ClipMerger::VideoEncode encode)
+{
+    switch (encode)
+    {
+    case ClipMerger::VideoEncodeCopy: return EncoderBenchmark::tr("Copy");
+    case ClipMerger::VideoEncodeSoftware: return EncoderBenchmark::tr("Software");
+    case ClipMerger::VideoEncodeNVidia: return EncoderBenchmark::tr("NVidia");
+    case ClipMerger::VideoEncodeQsv: return EncoderBenchmark::tr("Intel QSV");
+    }
+    return QString();
+}
+
+EncoderBenchmark::EncoderBenchmark(QObject* parent) :
+    QObject(parent),
+    mEncoders(),
+    mQuality(28),
+    mSample(),
+    mDuration(10),
+    mProc(nullptr),
+    mProgress(),
+    mTimer(),
+    mDir(nullptr),
+    mResults(),
+    mIndex(0),
+    mStage(StageEncode),
+    mRunning(false),
+    mCancelled(false)
+{
+}
+
+EncoderBenchmark::~EncoderBenchmark()
+{
+    if (mProc)
+    {
+        mProc->disconnect(this);
+        mProc->kill();
+        mProc->waitForFinished();
+    }
+    delete mDir;
+}
+
+void EncoderBenchmark::start()
+{
+    if (mRunning)
+        return;
+
+    mRunning = true;
+    mCancelled = false;
+    mResults.clear();
+    mIndex = 0;
+
+    delete mDir;
+    mDir = new QTemporaryDir();
+
+    // Always finish from the event loop, callers can wait on finished()
+    QMetaObject::invokeMethod(this, &EncoderBenchmark::runNext, Qt::QueuedConnection);
+}
+
+void EncoderBenchmark::cancel()
+{
+    if (!mRunning)
+        return;
+
+    mCancelled = true;
+    if (mProc)
+    {
+        mProc->kill();
+    }
+}
+
+int EncoderBenchmark::fastest(const QVector<Result>& results, double minSsim)
+{
+    int best = -1;
+    for (int i = 0; i < results.size(); ++i)
+    {
+        const Result& result = results.at(i);
+        if (!result.ok || result.ssim < minSsim)
+            continue;
+        if (best < 0 || result.fps > results.at(best).fps)
+            best = i;
+    }
+    return best;
+}
+
+bool EncoderBenchmark::loadResults(QVector<Result>* results, int* quality)
+{
+    const QString key = EncoderProbe::cacheKey();
+    if (key.isEmpty())
+        return false;
+
+    QSettings settings;
+    settings.beginGroup("encoderbenchmark");
+    if (settings.value("key").toString() != key)
+        return false;
+
+    if (quality)
+        *quality = settings.value("quality", 0).toInt();
+    results->clear();
+    const int count = settings.beginReadArray("results");
+    for (int i = 0; i < count; ++i)
+    {
+        settings.setArrayIndex(i);
+        Result result;
+        result.encode = ClipMerger::VideoEncode(settings.value("encode", 0).toInt());
+        result.ok = settings.value("ok", false).toBool();
+        result.fps = settings.value("fps", 0.0).toDouble();
+        result.size = settings.value("size", 0).toLongLong();
+        result.ssim = settings.value("ssim", 0.0).toDouble();
+        results->append(result);
+    }
+    settings.endArray();
+    settings.endGroup();
+    return !results->isEmpty();
+}
+
+void EncoderBenchmark::runNext()
+{
+    if (mCancelled)
+    {
+        complete(false);
+        return;
+    }
+
+    if (!mDir->isValid())
+    {
+        qDebug() << "Failed to create benchmark directory";
+        complete(false);
+        return;
+    }
+
+    if (mIndex >= mEncoders.size())
+    {
+        saveResults();
+        complete(true);
+        return;
+    }
+
+    Result result;
+    result.encode = mEncoders.at(mIndex);
+    result.ok = false;
+    result.fps = 0.0;
+    result.size = 0;
+    result.ssim = 0.0;
+    mResults.append(result);
+
+    // Video only, the same arguments a merge would use
+    QStringList args;
+    args << "-hide_banner" << "-y" << "-nostdin" << "-loglevel" << "error";
+    args << FFmpegProgress::args();
+    args << sampleArgs();
+    args << "-map" << "0:v:0" << "-an" << "-sn";
+    args << ClipMerger::videoCodecArgs(result.encode, mQuality);
+    args << "-f" << "mp4" << encodedPath(mIndex);
+
+    mStage = StageEncode;
+    mProgress.reset();
+    emit progress(mIndex * 2, mEncoders.size() * 2, tr("Encoding with %1").arg(encodeName(result.encode)));
+    startFFmpeg(args);
+}
+
+QStringList EncoderBenchmark::sampleArgs() const
+{
+    QStringList args;
+    const QString duration = QString::number(mDuration);
+    if (mSample.isEmpty())
+    {
+        // Detailed and moving, closer to road footage than a flat source
+        args << "-f" << "lavfi" << "-i" << QStringLiteral("testsrc2=s=1920x1080:r=30:d=%1").arg(duration);
+    }
+    else
+    {
+        args << "-t" << duration << "-i" << QDir::toNativeSeparators(mSample);
+    }
+    return args;
+}
+
+QString EncoderBenchmark::encodedPath(int index) const
+{
+    return QDir::toNativeSeparators(mDir->filePath(QStringLiteral("bench%1.mp4").arg(index)));
+}
+
+void EncoderBenchmark::startFFmpeg(const QStringList& args)
+{
+    qDebug() << ToolLocator::instance()->ffmpeg() << args;
+
+    mProc = new QProcess(this);
+    mProc->setProgram(ToolLocator::instance()->ffmpeg());
+    mProc->setArguments(args);
+    mProc->setStandardInputFile(QProcess::nullDevice());
+
+    connect(
+        mProc,
+        &QProcess::readyReadStandardOutput,
+        this,
+        &EncoderBenchmark::ffmpegStdout);
+
+    connect(
+        mProc,
+        QOverload<int,QProcess::ExitStatus>::of(&QProcess::finished),
+        this,
+        &EncoderBenchmark::ffmpegFinished);
+
+    connect(
+        mProc,
+        &QProcess::errorOccurred,
+        this,
+        &EncoderBenchmark::ffmpegError);
+
+    mTimer.start();
+    mProc->start();
+}
+
+void EncoderBenchmark::ffmpegStdout()
+{
+    const QByteArray data = mProc->readAllStandardOutput();
+    if (mStage != StageEncode || !mProgress.addData(data))
+        return;
+
+    emit progress(
+        mIndex * 2, mEncoders.size() * 2,
+        tr("Encoding with %1: %2 fps").arg(encodeName(mResults.last().encode)).arg(mProgress.fps(), 0, 'f', 0));
+}
+
+void EncoderBenchmark::ffmpegFinished(int exitCode, QProcess::ExitStatus exitStatus)
+{
+    stepFinished(exitStatus == QProcess::NormalExit && exitCode == 0);
+}
+
+void EncoderBenchmark::ffmpegError(QProcess::ProcessError error)
+{
+    // No finished signal follows if the process never ran
+    if (error != QProcess::FailedToStart)
+        return;
+    qDebug() << "FFmpeg failed to start" << mProc->errorString();
+    stepFinished(false);
+}
+
+void EncoderBenchmark::stepFinished(bool ok)
+{
+    QProcess* proc = mProc;
+    mProc = nullptr;
+    proc->deleteLater();
+
+    if (mCancelled)
+    {
+        complete(false);
+        return;
+    }
+
+    Result& result = mResults.last();
+    if (mStage == StageEncode && ok)
+    {
+        // ffmpeg reports the rate over the whole encode, the timer is only
+        // a fallback for builds that leave it out
+        const qint64 elapsed = mTimer.elapsed();
+        result.fps = mProgress.fps();
+        if (result.fps <= 0.0 && elapsed > 0)
+            result.fps = (mProgress.frame() * 1000.0) / elapsed;
+        result.size = QFileInfo(encodedPath(mIndex)).size();
+
+        QStringList args;
+        args << "-hide_banner" << "-nostdin" << "-nostats";
+        args << "-i" << encodedPath(mIndex);
+        args << sampleArgs();
+        args << "-lavfi" << "[0:v][1:v]ssim" << "-f" << "null" << "-";
+
+        mStage = StageCompare;
+        emit progress(mIndex * 2 + 1, mEncoders.size() * 2, tr("Comparing %1").arg(encodeName(result.encode)));
+        startFFmpeg(args);
+        return;
+    }
+
+    if (mStage == StageCompare && ok)
+    {
+        // The summary is the last line, "SSIM Y:0.98 ... All:0.97 (15.2)"
+        static const QRegularExpression ssimRegex("All:([0-9.]+)");
+        QRegularExpressionMatchIterator it = ssimRegex.globalMatch(QString::fromLocal8Bit(proc->readAllStandardError()));
+        QRegularExpressionMatch match;
+        while (it.hasNext())
+            match = it.next();
+        if (match.hasMatch())
+        {
+            result.ssim = match.captured(1).toDouble();
+            result.ok = true;
+        }
+    }
+
+    qDebug() << "Benchmark" << encodeName(result.encode) << result.ok << result.fps << "fps"
+             << result.size << "bytes" << "SSIM" << result.ssim;
+    QFile::remove(encodedPath(mIndex));
+    ++mIndex;
+    QMetaObject::invokeMethod(this, &EncoderBenchmark::runNext, Qt::QueuedConnection);
+}
+
+void EncoderBenchmark::saveResults() const
+{
+    const QString key = EncoderProbe::cacheKey();
+    if (key.isEmpty())
+        return;
+
+    QSettings settings;
+    settings.beginGroup("encoderbenchmark");
+    settings.remove("");
+    settings.setValue("key", key);
+    settings.setValue("quality", mQuality);
+    settings.beginWriteArray("results", mResults.size());
+    for (int i = 0; i < mResults.size(); ++i)
+    {
+        const Result& result = mResults.at(i);
+        settings.setArrayIndex(i);
+        settings.setValue("encode", int(result.encode));
+        settings.setValue("ok", result.ok);
+        settings.setValue("fps", result.fps);
+        settings.setValue("size", result.size);
+        settings.setValue("ssim", result.ssim);
+    }
+    settings.endArray();
+    settings.endGroup();
+}
+
+void EncoderBenchmark::complete(bool ok)
+{
+    delete mDir;
+    mDir = nullptr;
+    mRunning = false;
+    emit finished(ok);
+}
@@ -0,0 +1,107 @@
+/* Copyright 2021-2023 Silas Parker.
+ *
+ * This file is part of NB Dashcam Tools.
+ *
+ * NB Dashcam Tools is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * NB Dashcam Tools is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NB Dashcam Tools. If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef ENCODERBENCHMARK_HPP
+#define ENCODERBENCHMARK_HPP
+
+#include <QElapsedTimer>
+#include <QObject>
+#include <QProcess>
+#include <QVector>
+
+#include "clipmerger.hpp"
+#include "ffmpegprogress.hpp"
+
+class QTemporaryDir;
+
+// Encodes the same short sample with each encoder, then compares every
+// result against the sample for SSIM. Results are kept in the settings for
+// the ffmpeg binary they were measured with.
+class EncoderBenchmark : public QObject
+{
+    Q_OBJECT
+
+public:
+    struct Result
+    {
+        ClipMerger::VideoEncode encode;
+        bool ok;
+        double fps;
+        qint64 size; // Bytes
+        double ssim; // 0 to 1
+    };
+
+    explicit EncoderBenchmark(QObject* parent = nullptr);
+    ~EncoderBenchmark();
+
+    void setEncoders(const QVector<ClipMerger::VideoEncode>& encoders) {mEncoders = encoders;}
+    void setQuality(int quality) {mQuality = quality;}
+    void setSample(const QString& sample) {mSample = sample;} // Empty uses a generated pattern
+    void setDuration(int seconds) {mDuration = seconds;}
+
+    void start();
+    void cancel();
+    bool isRunning() const {return mRunning;}
+    const QVector<Result>& results() const {return mResults;}
+
+    // Index of the fastest result at or above the SSIM target, -1 if none is
+    static int fastest(const QVector<Result>& results, double minSsim);
+
+    // Results saved for the current ffmpeg, false if there are none
+    static bool loadResults(QVector<Result>* results, int* quality = nullptr);
+
+signals:
+    void progress(int value, int maximum, const QString& status);
+    void finished(bool ok);
+
+private slots:
+    void runNext();
+    void ffmpegStdout();
+    void ffmpegFinished(int exitCode, QProcess::ExitStatus exitStatus);
+    void ffmpegError(QProcess::ProcessError error);
+
+private:
+    enum Stage
+    {
+        StageEncode = 0,
+        StageCompare
+    };
+
+    QStringList sampleArgs() const;
+    QString encodedPath(int index) const;
+    void startFFmpeg(const QStringList& args);
+    void stepFinished(bool ok);
+    void saveResults() const;
+    void complete(bool ok);
+
+    QVector<ClipMerger::VideoEncode> mEncoders;
+    int mQuality;
+    QString mSample;
+    int mDuration;
+
+    QProcess* mProc;
+    FFmpegProgress mProgress;
+    QElapsedTimer mTimer;
+    QTemporaryDir* mDir;
+    QVector<Result> mResults;
+    int mIndex;
+    Stage mStage;
+    bool mRunning;
+    bool mCancelled;
+};
+
+#endif // ENCODERBENCHMARK_HPP
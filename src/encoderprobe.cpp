@@ -0,0 +1,259 @@
+/* Copyright 2021-2023 Silas Parker.
+ *
+ * This file is part of NB Dashcam Tools.
+ *
+ * NB Dashcam Tools is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * NB Dashcam Tools is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NB Dashcam Tools. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "encoderprobe.hpp"
+
+#include <QDateTime>
+#include <QDebug>
+#include <QFileInfo>
+#include <QLibrary>
+#include <QSettings>
+#include <QTextStream>
+
+#include "toollocator.hpp"
+
+
+// Bump when the checks change so older results are not trusted
+static const int ProbeVersion = 2;
+
+EncoderProbe::EncoderProbe(QObject* parent) :
+    QObject(parent),
+    mProcs(),
+    mKey(),
+    mHaveLibx264(false),
+    mHaveNvenc(false),
+    mHaveQsv(false),
+    mVersion(),
+    mConfiguration(),
+    mRunning(false)
+{
+}
+
+EncoderProbe::~EncoderProbe()
+{
+    for (QProcess* proc : mProcs)
+    {
+        proc->disconnect(this);
+        proc->kill();
+        proc->waitForFinished();
+    }
+}
+
+QString EncoderProbe::cacheKey()
+{
+    const QString& ffmpeg = ToolLocator::instance()->ffmpeg();
+    if (ffmpeg.isEmpty())
+        return QString();
+
+    QFileInfo info(ffmpeg);
+    if (!info.exists())
+        return QString();
+    return QStringLiteral("%1|%2|%3|%4")
+        .arg(ProbeVersion)
+        .arg(info.absoluteFilePath())
+        .arg(info.size())
+        .arg(info.lastModified().toMSecsSinceEpoch());
+}
+
+bool EncoderProbe::loadCached()
+{
+    const QString key = cacheKey();
+    if (key.isEmpty())
+        return false;
+
+    QSettings settings;
+    settings.beginGroup("encoderprobe");
+    if (settings.value("key").toString() != key)
+        return false;
+
+    mHaveLibx264 = settings.value("libx264", false).toBool();
+    mHaveNvenc = settings.value("nvenc", false).toBool();
+    mHaveQsv = settings.value("qsv", false).toBool();
+    mVersion = settings.value("version").toString();
+    mConfiguration = settings.value("configuration").toString();
+    settings.endGroup();
+    qDebug() << "Using cached encoder probe" << mVersion << mHaveLibx264 << mHaveNvenc << mHaveQsv;
+    return true;
+}
+
+void EncoderProbe::start()
+{
+    if (mRunning)
+        return;
+
+    mRunning = true;
+    mHaveLibx264 = false;
+    mHaveNvenc = false;
+    mHaveQsv = false;
+    mVersion.clear();
+    mConfiguration.clear();
+    mKey = cacheKey();
+    if (mKey.isEmpty())
+    {
+        QMetaObject::invokeMethod(this, &EncoderProbe::complete, Qt::QueuedConnection);
+        return;
+    }
+
+    // Both are cheap, the hardware checks wait for the encoder list so
+    // encoders that are not built in are never tried
+    runCheck(CheckVersion, QStringList() << "-hide_banner" << "-version");
+    runCheck(CheckEncoders, QStringList() << "-hide_banner" << "-encoders");
+}
+
+void EncoderProbe::runCheck(Check check, const QStringList& args)
+{
+    QProcess* proc = new QProcess(this);
+    proc->setProgram(ToolLocator::instance()->ffmpeg());
+    proc->setArguments(args);
+    proc->setStandardInputFile(QProcess::nullDevice());
+    mProcs.append(proc);
+
+    connect(
+        proc, QOverload<int,QProcess::ExitStatus>::of(&QProcess::finished),
+        this, [this, check, proc](int exitCode, QProcess::ExitStatus exitStatus)
+    {
+        // Listing the GPUs ends the nvenc check with an error exit code,
+        // its output is read whenever ffmpeg exits normally
+        const bool ok = (exitStatus == QProcess::NormalExit) && (exitCode == 0 || check == CheckNvenc);
+        checkFinished(check, proc, ok);
+    });
+    connect(proc, &QProcess::errorOccurred, this, [this, check, proc](QProcess::ProcessError error)
+    {
+        // No finished signal follows if the process never ran
+        if (error == QProcess::FailedToStart)
+            checkFinished(check, proc, false);
+    });
+
+    proc->start();
+}
+
+void EncoderProbe::checkFinished(Check check, QProcess* proc, bool ok)
+{
+    mProcs.removeOne(proc);
+    proc->deleteLater();
+    qDebug() << "Encoder check" << check << "finished" << ok;
+
+    switch (check)
+    {
+    case CheckVersion:
+        if (ok)
+        {
+            QTextStream stream(proc->readAllStandardOutput());
+            QString line;
+            while (stream.readLineInto(&line))
+            {
+                if (line.startsWith("ffmpeg version "))
+                    mVersion = line.mid(15).section(' ', 0, 0);
+                else if (line.startsWith("configuration:"))
+                    mConfiguration = line.mid(14).trimmed();
+            }
+        }
+        break;
+    case CheckEncoders:
+        if (ok)
+            startHardwareChecks(QString::fromLocal8Bit(proc->readAllStandardOutput()));
+        break;
+    case CheckNvenc:
+        if (ok)
+        {
+            QTextStream stream(proc->readAllStandardError());
+            QString line;
+            while (stream.readLineInto(&line))
+            {
+                if (line.startsWith("[hevc_nvenc") && line.contains("Compute SM"))
+                    mHaveNvenc = true;
+            }
+        }
+        break;
+    case CheckQsv:
+        mHaveQsv = ok;
+        break;
+    }
+
+    if (mProcs.isEmpty())
+        complete();
+}
+
+void EncoderProbe::startHardwareChecks(const QString& encoders)
+{
+    // Lines read " V....D libx264              libx264 H.264 ..."
+    QStringList names;
+    for (const QString& line : encoders.split('\n'))
+    {
+        const QString name = line.trimmed().section(' ', 1, 1);
+        if (!name.isEmpty())
+            names << name;
+    }
+    mHaveLibx264 = names.contains("libx264");
+
+    bool tryNvenc = names.contains("hevc_nvenc");
+#ifdef Q_OS_LINUX
+    if (tryNvenc)
+    {
+        QLibrary libcuda("cuda");
+        if (libcuda.load())
+        {
+            libcuda.unload();
+        }
+        else
+        {
+            qDebug() << "Failed to locate libcuda, skipping ffmpeg check: " << libcuda.errorString();
+            tryNvenc = false;
+        }
+    }
+#endif
+    if (tryNvenc)
+    {
+        runCheck(CheckNvenc, QStringList()
+            << "-hide_banner" << "-nostdin"
+            << "-f" << "lavfi" << "-i" << "nullsrc=s=256x256:d=5"
+            << "-c:v" << "hevc_nvenc"
+            << "-gpu" << "list"
+            << "-f" << "null" << QProcess::nullDevice());
+    }
+
+    if (names.contains("hevc_qsv"))
+    {
+        runCheck(CheckQsv, QStringList()
+            << "-hide_banner" << "-nostdin"
+            << "-f" << "lavfi" << "-i" << "nullsrc=s=256x256:d=5"
+            << "-c:v" << "hevc_qsv"
+            << "-f" << "null" << QProcess::nullDevice());
+    }
+}
+
+void EncoderProbe::complete()
+{
+    mRunning = false;
+    qDebug() << "Encoder probe" << mVersion << mHaveLibx264 << mHaveNvenc << mHaveQsv;
+
+    // Nothing is kept if ffmpeg did not run at all
+    if (!mKey.isEmpty() && !mVersion.isEmpty())
+    {
+        QSettings settings;
+        settings.beginGroup("encoderprobe");
+        settings.setValue("key", mKey);
+        settings.setValue("libx264", mHaveLibx264);
+        settings.setValue("nvenc", mHaveNvenc);
+        settings.setValue("qsv", mHaveQsv);
+        settings.setValue("version", mVersion);
+        settings.setValue("configuration", mConfiguration);
+        settings.endGroup();
+    }
+    emit finished();
+}
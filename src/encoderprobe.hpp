@@ -0,0 +1,81 @@
+/* Copyright 2021-2023 Silas Parker.
+ *
+ * This file is part of NB Dashcam Tools.
+ *
+ * NB Dashcam Tools is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * NB Dashcam Tools is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NB Dashcam Tools. If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef ENCODERPROBE_HPP
+#define ENCODERPROBE_HPP
+
+#include <QObject>
+#include <QProcess>
+#include <QVector>
+
+// Finds which video encoders the located ffmpeg can use. The hardware
+// encoders are only known to work after a short test encode, so results
+// are kept in the settings against the ffmpeg binary and only probed again
+// when the binary changes.
+class EncoderProbe : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit EncoderProbe(QObject* parent = nullptr);
+    ~EncoderProbe();
+
+    // Identifies the located ffmpeg binary, empty if there is none
+    static QString cacheKey();
+
+    // Returns true if the settings hold results for the current ffmpeg
+    bool loadCached();
+
+    // Probes in the background, finished() is always emitted from the
+    // event loop
+    void start();
+    bool isRunning() const {return mRunning;}
+
+    bool haveLibx264() const {return mHaveLibx264;}
+    bool haveNvenc() const {return mHaveNvenc;}
+    bool haveQsv() const {return mHaveQsv;}
+    const QString& version() const {return mVersion;}
+    const QString& configuration() const {return mConfiguration;}
+
+signals:
+    void finished();
+
+private:
+    enum Check
+    {
+        CheckVersion = 0,
+        CheckEncoders,
+        CheckNvenc,
+        CheckQsv
+    };
+
+    void runCheck(Check check, const QStringList& args);
+    void checkFinished(Check check, QProcess* proc, bool ok);
+    void startHardwareChecks(const QString& encoders);
+    void complete();
+
+    QVector<QProcess*> mProcs;
+    QString mKey;
+    bool mHaveLibx264;
+    bool mHaveNvenc;
+    bool mHaveQsv;
+    QString mVersion;
+    QString mConfiguration;
+    bool mRunning;
+};
+
+#endif // ENCODERPROBE_HPP
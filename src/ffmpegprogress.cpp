@@ -0,0 +1,118 @@
+/* Copyright 2021-2023 Silas Parker.
+ *
+ * This file is part of NB Dashcam Tools.
+ *
+ * NB Dashcam Tools is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * NB Dashcam Tools is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NB Dashcam Tools. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "ffmpegprogress.hpp"
+
+#include <cstring>
+
+
+FFmpegProgress::FFmpegProgress() :
+    mBuffer(),
+    mFrame(0),
+    mFps(0.0),
+    mBitrate(0.0),
+    mTotalSize(0),
+    mOutTimeUs(0),
+    mSpeed(0.0),
+    mEnd(false),
+    mBlockDone(false)
+{
+}
+
+QStringList FFmpegProgress::args()
+{
+    return QStringList() << "-progress" << "pipe:1" << "-nostats";
+}
+
+void FFmpegProgress::reset()
+{
+    *this = FFmpegProgress();
+}
+
+bool FFmpegProgress::addData(const QByteArray& data)
+{
+    mBuffer.append(data);
+    mBlockDone = false;
+
+    int start = 0;
+    int end = 0;
+    while ((end = mBuffer.indexOf('\n', start)) >= 0)
+    {
+        parseLine(mBuffer.constData() + start, end - start);
+        start = end + 1;
+    }
+    mBuffer.remove(0, start);
+    return mBlockDone;
+}
+
+void FFmpegProgress::parseLine(const char* line, int length)
+{
+    if (length > 0 && line[length - 1] == '\r')
+        --length;
+    const char* eq = static_cast<const char*>(memchr(line, '=', size_t(length)));
+    if (!eq)
+        return;
+
+    const QByteArray key = QByteArray::fromRawData(line, int(eq - line));
+    const QByteArray value = QByteArray(eq + 1, length - int(eq - line) - 1).trimmed();
+
+    // Values not known yet are written as N/A, those keep the last value
+    bool ok = false;
+    if (key == "frame")
+    {
+        const qint64 v = value.toLongLong(&ok);
+        if (ok)
+            mFrame = v;
+    }
+    else if (key == "fps")
+    {
+        const double v = value.toDouble(&ok);
+        if (ok)
+            mFps = v;
+    }
+    else if (key == "bitrate")
+    {
+        const int unit = value.indexOf("kbits/s");
+        const double v = value.left(unit >= 0 ? unit : value.size()).toDouble(&ok);
+        if (ok)
+            mBitrate = v;
+    }
+    else if (key == "total_size")
+    {
+        const qint64 v = value.toLongLong(&ok);
+        if (ok)
+            mTotalSize = v;
+    }
+    else if (key == "out_time_us")
+    {
+        const qint64 v = value.toLongLong(&ok);
+        if (ok && v >= 0)
+            mOutTimeUs = v;
+    }
+    else if (key == "speed")
+    {
+        const double v = value.left(value.endsWith('x') ? value.size() - 1 : value.size()).toDouble(&ok);
+        if (ok)
+            mSpeed = v;
+    }
+    else if (key == "progress")
+    {
+        mEnd = (value == "end");
+        mBlockDone = true;
+    }
+}
@@ -0,0 +1,61 @@
+/* Copyright 2021-2023 Silas Parker.
+ *
+ * This file is part of NB Dashcam Tools.
+ *
+ * NB Dashcam Tools is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * NB Dashcam Tools is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NB Dashcam Tools. If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef FFMPEGPROGRESS_HPP
+#define FFMPEGPROGRESS_HPP
+
+#include <QByteArray>
+#include <QStringList>
+
+// Parses the key=value blocks ffmpeg writes with -progress. A block ends
+// with a progress= line, the values then hold the latest report.
+class FFmpegProgress
+{
+public:
+    FFmpegProgress();
+
+    // Arguments that send the progress to stdout in place of the stats line
+    static QStringList args();
+
+    void reset();
+
+    // Returns true if the data completed at least one block
+    bool addData(const QByteArray& data);
+
+    qint64 frame() const {return mFrame;}
+    double fps() const {return mFps;}
+    double bitrate() const {return mBitrate;} // kbit/s, 0 if not known yet
+    qint64 totalSize() const {return mTotalSize;} // Bytes written
+    qint64 outTimeUs() const {return mOutTimeUs;}
+    double speed() const {return mSpeed;} // Realtime factor, 0 if not known yet
+    bool isEnd() const {return mEnd;}
+
+private:
+    void parseLine(const char* line, int length);
+
+    QByteArray mBuffer;
+    qint64 mFrame;
+    double mFps;
+    double mBitrate;
+    qint64 mTotalSize;
+    qint64 mOutTimeUs;
+    double mSpeed;
+    bool mEnd;
+    bool mBlockDone;
+};
+
+#endif // FFMPEGPROGRESS_HPP
@@ -0,0 +1,291 @@
+/* Copyright 2021-2023 Silas Parker.
+ *
+ * This file is part of NB Dashcam Tools.
+ *
+ * NB Dashcam Tools is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * NB Dashcam Tools is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NB Dashcam Tools. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "gpsclipexporter.hpp"
+
+#include <QDebug>
+#include <QDir>
+
+#include "avmerge.hpp"
+#include "gpsexportjob.hpp"
+#include "gpssampleparser.hpp"
+#include "gpstrack.hpp"
+#include "mp4file.hpp"
+#include "toollocator.hpp"
+
+
+GpsClipExporter::GpsClipExporter(QObject* parent) :
+    QObject(parent),
+    mInput(),
+    mOutput(),
+    mFormats(),
+    mOptions(),
+    mFFmpegProc(nullptr),
+    mParser(nullptr),
+    mExportJob(nullptr),
+    mSampleFailed(false),
+    mRunning(false),
+    mCancelled(false),
+    mCamera(),
+    mError()
+{
+}
+
+GpsClipExporter::~GpsClipExporter()
+{
+    if (mFFmpegProc)
+    {
+        mFFmpegProc->disconnect(this);
+        mFFmpegProc->kill();
+        mFFmpegProc->waitForFinished();
+    }
+    endExport();
+}
+
+void GpsClipExporter::start()
+{
+    if (mRunning)
+        return;
+
+    mRunning = true;
+    mCancelled = false;
+    mError.clear();
+    mCamera.clear();
+
+    // Always finish from the event loop, callers can wait on finished()
+    // even when the input is rejected straight away
+    QMetaObject::invokeMethod(this, &GpsClipExporter::run, Qt::QueuedConnection);
+}
+
+void GpsClipExporter::cancel()
+{
+    if (!mRunning)
+        return;
+
+    mCancelled = true;
+    if (mFFmpegProc)
+    {
+        mFFmpegProc->kill();
+    }
+}
+
+void GpsClipExporter::run()
+{
+    if (mCancelled)
+    {
+        complete(false);
+        return;
+    }
+
+    if (mOutput.isEmpty())
+    {
+        complete(false, tr("Output file not set"));
+        return;
+    }
+
+    if (mFormats.isEmpty())
+    {
+        complete(false, tr("Export format invalid"));
+        return;
+    }
+
+    Mp4File mp4(mInput);
+    if (!mp4.open(QIODevice::ReadOnly, true))
+    {
+        complete(false, tr("Input file not found"));
+        return;
+    }
+
+    QString infoStr = mp4.readInfoString();
+    if (infoStr.isEmpty())
+    {
+        complete(false, tr("Can not read file"));
+        return;
+    }
+
+    mCamera = Mp4File::cameraModel(infoStr);
+    if (!GpsSampleParser::isCameraSupported(mCamera))
+    {
+        complete(false, tr("Camera not supported"));
+        return;
+    }
+
+    // Read the subtitle samples directly, only fall back to the FFmpeg
+    // libraries or ffmpeg if the track can not be resolved
+    QString errmsg;
+    QByteArray subsData = mp4.readSubtitleData(&errmsg);
+    mp4.close();
+    if (subsData.isEmpty() && AvMerge::isAvailable())
+    {
+        // The FFmpeg libraries read the track without starting a process
+        qDebug() << "Failed to read subtitle track, using FFmpeg libraries:" << errmsg;
+        errmsg.clear();
+        subsData = AvMerge::readSubtitleData(mInput, &errmsg);
+    }
+    if (!subsData.isEmpty())
+    {
+        qDebug() << "Extracted data, " << subsData.size() << "bytes";
+
+        // The whole stream is in memory, decode it across all cores up front
+        GpsTrack track;
+        GpsSampleParser::parseBuffer(subsData, mCamera, &track);
+        subsData.clear();
+
+        if (!beginExport(&errmsg) || !mExportJob->addTrack(track, &errmsg) || !mExportJob->finish(&errmsg))
+        {
+            complete(false, errmsg);
+            return;
+        }
+        complete(true);
+        return;
+    }
+    qDebug() << "Failed to read subtitle track, using ffmpeg:" << errmsg;
+
+    // Samples are parsed and written out as ffmpeg produces them
+    if (!beginExport(&errmsg))
+    {
+        complete(false, errmsg);
+        return;
+    }
+    mParser = new GpsSampleParser(mCamera);
+    mSampleFailed = false;
+
+    QStringList args;
+    args
+        << "-nostdin" << "-hide_banner"
+        << "-i" << QDir::toNativeSeparators(mInput)
+        << "-map" << "0:s" << "-c:s" << "copy"
+        << "-f" << "data" << "-";
+
+    qDebug() << ToolLocator::instance()->ffmpeg() << args;
+
+    mFFmpegProc = new QProcess(this);
+    mFFmpegProc->setProgram(ToolLocator::instance()->ffmpeg());
+    mFFmpegProc->setArguments(args);
+    mFFmpegProc->setStandardInputFile(QProcess::nullDevice());
+    mFFmpegProc->setProcessChannelMode(QProcess::ForwardedErrorChannel);
+
+    connect(
+        mFFmpegProc,
+        &QProcess::readyReadStandardOutput,
+        this,
+        &GpsClipExporter::ffmpegStdout);
+
+    connect(
+        mFFmpegProc,
+        QOverload<int,QProcess::ExitStatus>::of(&QProcess::finished),
+        this,
+        &GpsClipExporter::ffmpegFinished);
+
+    connect(
+        mFFmpegProc,
+        &QProcess::errorOccurred,
+        this,
+        &GpsClipExporter::ffmpegError);
+
+    mFFmpegProc->start();
+}
+
+void GpsClipExporter::ffmpegStdout()
+{
+    if (!(mFFmpegProc && mParser && mExportJob))
+        return;
+
+    const QByteArray chunk = mFFmpegProc->readAllStandardOutput();
+    if (mSampleFailed)
+        return;
+    mParser->addData(chunk.constData(), int(chunk.size()));
+
+    // Everything complete in this read goes to the exporter as one batch
+    GpsTrack track;
+    if (mParser->takeSamples(&track) && !mExportJob->addTrack(track))
+    {
+        qWarning() << "Failed to process sample";
+        mSampleFailed = true;
+        mFFmpegProc->kill();
+    }
+}
+
+void GpsClipExporter::ffmpegFinished(int exitCode, QProcess::ExitStatus exitStatus)
+{
+    // Pick up anything written just before exit
+    ffmpegStdout();
+
+    mFFmpegProc->deleteLater();
+    mFFmpegProc = nullptr;
+    if (mCancelled)
+    {
+        complete(false);
+        return;
+    }
+    if (mSampleFailed)
+    {
+        complete(false, tr("Failed to process sample"));
+        return;
+    }
+    if (exitStatus != QProcess::NormalExit || exitCode != 0)
+    {
+        complete(false, tr("Failed to extract GPS data from file"));
+        return;
+    }
+
+    QString errmsg;
+    const bool ok = mExportJob->finish(&errmsg);
+    complete(ok, errmsg);
+}
+
+void GpsClipExporter::ffmpegError(QProcess::ProcessError error)
+{
+    // No finished signal follows if the process never ran
+    if (error != QProcess::FailedToStart)
+        return;
+    qDebug() << "FFmpeg failed to start" << mFFmpegProc->errorString();
+    mFFmpegProc->deleteLater();
+    mFFmpegProc = nullptr;
+    complete(false, tr("Failed to start ffmpeg"));
+}
+
+bool GpsClipExporter::beginExport(QString* errMsg)
+{
+    endExport();
+
+    mExportJob = new GpsExportJob();
+    mExportJob->setOptions(mOptions);
+    for (GpsExportFormat format : mFormats)
+    {
+        mExportJob->addTarget(format, GpsExportJob::targetPath(mOutput, format, mFormats.size() > 1));
+    }
+    return mExportJob->begin(errMsg);
+}
+
+void GpsClipExporter::endExport()
+{
+    delete mExportJob;
+    mExportJob = nullptr;
+    delete mParser;
+    mParser = nullptr;
+}
+
+void GpsClipExporter::complete(bool ok, const QString& errMsg)
+{
+    // Anything not finished is aborted with the job
+    endExport();
+    mRunning = false;
+    mError = errMsg;
+    emit finished(ok);
+}
@@ -0,0 +1,83 @@
+/* Copyright 2021-2023 Silas Parker.
+ *
+ * This file is part of NB Dashcam Tools.
+ *
+ * NB Dashcam Tools is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * NB Dashcam Tools is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NB Dashcam Tools. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef GPSCLIPEXPORTER_HPP
+#define GPSCLIPEXPORTER_HPP
+
+#include <QObject>
+#include <QProcess>
+#include <QVector>
+
+#include "gpsexport.hpp"
+
+class GpsExportJob;
+class GpsSampleParser;
+
+// Exports the GPS track of one clip to the selected formats without any UI.
+// The subtitle track is read directly where possible, otherwise ffmpeg
+// extracts it and the samples are written out as they arrive.
+class GpsClipExporter : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit GpsClipExporter(QObject* parent = nullptr);
+    ~GpsClipExporter();
+
+    void setInput(const QString& input) {mInput = input;}
+    void setOutput(const QString& output) {mOutput = output;}
+    void setFormats(const QVector<GpsExportFormat>& formats) {mFormats = formats;}
+    void setOptions(const GpsExportOptions& options) {mOptions = options;}
+
+    void start();
+    void cancel();
+    bool isRunning() const {return mRunning;}
+    bool wasCancelled() const {return mCancelled;}
+    const QString& camera() const {return mCamera;}
+    const QString& errorString() const {return mError;}
+
+signals:
+    void finished(bool ok);
+
+private slots:
+    void run();
+    void ffmpegStdout();
+    void ffmpegFinished(int exitCode, QProcess::ExitStatus exitStatus);
+    void ffmpegError(QProcess::ProcessError error);
+
+private:
+    bool beginExport(QString* errMsg);
+    void endExport();
+    void complete(bool ok, const QString& errMsg = QString());
+
+    QString mInput;
+    QString mOutput;
+    QVector<GpsExportFormat> mFormats;
+    GpsExportOptions mOptions;
+
+    QProcess* mFFmpegProc;
+    GpsSampleParser* mParser;
+    GpsExportJob* mExportJob;
+    bool mSampleFailed;
+    bool mRunning;
+    bool mCancelled;
+    QString mCamera;
+    QString mError;
+};
+
+#endif // GPSCLIPEXPORTER_HPP
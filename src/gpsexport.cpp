@@ -19,154 +19,622 @@
 #include "gpsexport.hpp"
 
 #include <QCoreApplication>
+#include <QDebug>
 
-GpsExport* GpsExport::createExporter(GpsExportFormat format, QIODevice* output)
+#include <cmath>
+
+#include "gpstrack.hpp"
+#include "gzipdevice.hpp"
+
+static const int blockSize = 256 * 1024;
+static const double powersOf10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6};
+
+
+GpsExportOptions::GpsExportOptions() :
+    compact(false),
+    compress(false),
+    compressionLevel(6),
+    simplifyTolerance(0.0)
+{}
+
+
+GpsExport* GpsExport::createExporter(GpsExportFormat format, QIODevice* output, const GpsExportOptions& options)
 {
+    GzipDevice* compressor = nullptr;
+    if (options.compress)
+    {
+        compressor = new GzipDevice(output, options.compressionLevel);
+        if (!compressor->open(QIODevice::WriteOnly))
+        {
+            qWarning() << "Failed to start compressor";
+            delete compressor;
+            return nullptr;
+        }
+        output = compressor;
+    }
+
+    GpsExport* exporter = nullptr;
     switch (format)
     {
     case GpsExportFormat::Invalid:
-        return nullptr;
+        break;
     case GpsExportFormat::GPX:
-        return new GpsExportGpx(output);
+        exporter = new GpsExportGpx(output, options.compact);
+        if (options.simplifyTolerance > 0.0)
+        {
+            exporter->mCompressor = compressor;
+            compressor = nullptr;
+            exporter = new GpsExportSimplify(exporter, options.simplifyTolerance);
+        }
+        break;
     case GpsExportFormat::CSV:
-        return new GpsExportCsv(output);
+        exporter = new GpsExportCsv(output);
+        break;
     }
-    return nullptr;
+
+    if (exporter)
+        exporter->mCompressor = compressor;
+    else
+        delete compressor;
+    return exporter;
 }
 
 
 GpsExport::GpsExport(QIODevice* output) :
-    mOutput(output)
-{}
+    mOutput(output),
+    mBuffer(),
+    mCompressor(nullptr)
+{
+    // Room for a block plus a sample, so appending never reallocates
+    if (mOutput)
+        mBuffer.reserve(blockSize + 4096);
+}
 
 GpsExport::~GpsExport()
-{}
+{
+    delete mCompressor;
+}
 
 bool GpsExport::isValid() const
 {
     return mOutput && mOutput->isOpen() && mOutput->isWritable();
 }
 
-///////////////////////////////////////////////////////////////////////////////
+bool GpsExport::addSamples(const GpsSample* samples, int count)
+{
+    for (int i = 0; i < count; ++i)
+    {
+        if (!addSample(&samples[i]))
+            return false;
+    }
+    return true;
+}
 
-GpsExportGpx::GpsExportGpx(QIODevice* output) :
-    GpsExport(output),
-    mWriter(mOutput)
+bool GpsExport::addTrack(const GpsTrack& track)
 {
-    mWriter.setAutoFormatting(true);
+    GpsSample sample;
+    for (int i = 0; i < track.size(); ++i)
+    {
+        track.sample(i, &sample);
+        if (!addSample(&sample))
+            return false;
+    }
+    return true;
 }
 
-bool GpsExportGpx::start()
+// Fixed notation as QString::number writes it, exact ties round away from zero
+void GpsExport::appendFixed(double value, int precision)
 {
-    mWriter.writeStartDocument();
-    mWriter.writeStartElement("gpx");
-    mWriter.writeDefaultNamespace("http://www.topografix.com/GPX/1/1");
-    mWriter.writeNamespace("https://osmand.net", "osmand");
-    mWriter.writeAttribute("version", "1.1");
-    mWriter.writeAttribute("creator", QCoreApplication::instance()->applicationName());
+    Q_ASSERT(precision >= 0 && precision <= 6);
+    if (qIsNaN(value))
+    {
+        mBuffer.append("nan");
+        return;
+    }
+    if (qIsInf(value))
+    {
+        mBuffer.append(value < 0 ? "-inf" : "inf");
+        return;
+    }
 
-    mWriter.writeStartElement("trk");
+    const double scaled = std::round(qAbs(value) * powersOf10[precision]);
+    if (scaled >= 9e18)
+    {
+        // Far outside anything a sensor reports, not worth a fast path
+        mBuffer.append(QByteArray::number(value, 'f', precision));
+        return;
+    }
 
-    mWriter.writeStartElement("trkseg");
+    const quint64 units = quint64(powersOf10[precision]);
+    const quint64 fixed = quint64(scaled);
+    if (value < 0)
+        mBuffer.append('-');
+    appendInt(qint64(fixed / units));
+    if (precision == 0)
+        return;
+
+    char digits[8];
+    quint64 frac = fixed % units;
+    for (int i = precision; i > 0; --i)
+    {
+        digits[i] = char('0' + frac % 10);
+        frac /= 10;
+    }
+    digits[0] = '.';
+    mBuffer.append(digits, precision + 1);
+}
 
-    return (!mWriter.hasError());
+void GpsExport::appendInt(qint64 value)
+{
+    char digits[24];
+    int pos = sizeof(digits);
+    quint64 magnitude = (value < 0) ? (0 - quint64(value)) : quint64(value);
+    do
+    {
+        digits[--pos] = char('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude);
+    if (value < 0)
+        digits[--pos] = '-';
+    mBuffer.append(digits + pos, int(sizeof(digits)) - pos);
+}
+
+// yyyy-MM-dd HH:mm:ss.zzz with the given separator, for UTC times from
+// year 0 to 9999
+void GpsExport::appendDateTime(qint64 msecs, char separator)
+{
+    static const qint64 msecsPerDay = 24 * 60 * 60 * 1000;
+    qint64 days = msecs / msecsPerDay;
+    qint64 msOfDay = msecs % msecsPerDay;
+    if (msOfDay < 0)
+    {
+        msOfDay += msecsPerDay;
+        --days;
+    }
+
+    // Civil from days, years starting in March put the leap day last
+    const qint64 z = days + 719468;
+    const qint64 era = (z >= 0 ? z : z - 146096) / 146097;
+    const qint64 doe = z - era * 146097;
+    const qint64 yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    const qint64 doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    const qint64 mp = (5 * doy + 2) / 153;
+    const int day = int(doy - (153 * mp + 2) / 5 + 1);
+    const int month = int(mp < 10 ? mp + 3 : mp - 9);
+    const int year = int(yoe + era * 400 + (month <= 2 ? 1 : 0));
+
+    const int ms = int(msOfDay % 1000);
+    const int second = int((msOfDay / 1000) % 60);
+    const int minute = int((msOfDay / 60000) % 60);
+    const int hour = int(msOfDay / 3600000);
+
+    char text[23] = {
+        char('0' + (year / 1000) % 10), char('0' + (year / 100) % 10),
+        char('0' + (year / 10) % 10), char('0' + year % 10), '-',
+        char('0' + month / 10), char('0' + month % 10), '-',
+        char('0' + day / 10), char('0' + day % 10), separator,
+        char('0' + hour / 10), char('0' + hour % 10), ':',
+        char('0' + minute / 10), char('0' + minute % 10), ':',
+        char('0' + second / 10), char('0' + second % 10), '.',
+        char('0' + ms / 100), char('0' + (ms / 10) % 10), char('0' + ms % 10)
+    };
+    mBuffer.append(text, int(sizeof(text)));
+}
+
+bool GpsExport::flushBuffer()
+{
+    const qint64 size = mBuffer.size();
+    const bool ok = (mOutput->write(mBuffer.constData(), size) == size);
+    mBuffer.resize(0);
+    return ok;
+}
+
+// Writes out the buffer, and the gzip trailer when compressing
+bool GpsExport::finishOutput()
+{
+    bool ok = flushBuffer();
+    if (mCompressor)
+    {
+        mCompressor->close();
+        ok = ok && !mCompressor->hasError();
+    }
+    return ok;
+}
+
+bool GpsExport::flushIfFull()
+{
+    return (mBuffer.size() < blockSize) || flushBuffer();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+GpsExportGpx::GpsExportGpx(QIODevice* output, bool compact) :
+    GpsExport(output),
+    mCompact(compact)
+{}
+
+bool GpsExportGpx::start()
+{
+    QByteArray creator = QCoreApplication::instance()->applicationName().toUtf8();
+    creator.replace('&', "&amp;").replace('<', "&lt;").replace('>', "&gt;").replace('"', "&quot;");
+
+    mBuffer.append("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+    mBuffer.append(
+        "<gpx xmlns=\"http://www.topografix.com/GPX/1/1\" xmlns:osmand=\"https://osmand.net\" "
+        "version=\"1.1\" creator=\"");
+    mBuffer.append(creator);
+    mBuffer.append("\">");
+    openLine(1);
+    mBuffer.append("<trk>");
+    openLine(2);
+    mBuffer.append("<trkseg>");
+    return flushIfFull();
 }
 
 bool GpsExportGpx::finish()
 {
-    mWriter.writeEndDocument();
-    return (!mWriter.hasError());
+    openLine(2);
+    mBuffer.append("</trkseg>");
+    openLine(1);
+    mBuffer.append("</trk>");
+    mBuffer.append("\n</gpx>\n");
+    return finishOutput();
 }
 
 bool GpsExportGpx::addSample(const GpsSample* sample)
 {
     Q_ASSERT(sample);
+    appendPoint(GpsTrackPoint::fromSample(*sample));
+    return flushIfFull();
+}
+
+bool GpsExportGpx::addSamples(const GpsSample* samples, int count)
+{
+    for (int i = 0; i < count; ++i)
+    {
+        appendPoint(GpsTrackPoint::fromSample(samples[i]));
+        if (mBuffer.size() >= blockSize && !flushBuffer())
+            return false;
+    }
+    return true;
+}
+
+bool GpsExportGpx::addTrack(const GpsTrack& track)
+{
+    for (int i = 0; i < track.size(); ++i)
+    {
+        appendPoint(track.point(i));
+        if (mBuffer.size() >= blockSize && !flushBuffer())
+            return false;
+    }
+    return true;
+}
+
+void GpsExportGpx::appendPoint(const GpsTrackPoint& point)
+{
+    if (!(point.isTimeValid() && point.isGpsValid()))
+        return;
+
+    openLine(3);
+    mBuffer.append("<trkpt lat=\"");
+    appendFixed(point.latitude, 6); // 6 decimal places ~ 10cm precision
+    mBuffer.append("\" lon=\"");
+    appendFixed(point.longitude, 6);
+    mBuffer.append("\">");
+
+    openLine(4);
+    mBuffer.append("<time>");
+    appendDateTime(point.time, 'T');
+    mBuffer.append("Z</time>");
+
+    if (!qIsNaN(point.altitude))
+    {
+        openLine(4);
+        mBuffer.append("<ele>");
+        appendFixed(point.altitude, 1);
+        mBuffer.append("</ele>");
+    }
+    if (!qIsNaN(point.geoidHeight))
+    {
+        openLine(4);
+        mBuffer.append("<geoidheight>");
+        appendFixed(point.geoidHeight, 1);
+        mBuffer.append("</geoidheight>");
+    }
+    openLine(4);
+    mBuffer.append("<sat>");
+    appendInt(point.sats);
+    mBuffer.append("</sat>");
+    if (!qIsNaN(point.hdop))
+    {
+        openLine(4);
+        mBuffer.append("<hdop>");
+        appendFixed(point.hdop, 2);
+        mBuffer.append("</hdop>");
+    }
+
+    openLine(4);
+    if (qIsNaN(point.speed) && qIsNaN(point.bearing))
+    {
+        mBuffer.append("<extensions/>");
+    }
+    else
+    {
+        mBuffer.append("<extensions>");
+        if (!qIsNaN(point.speed))
+        {
+            openLine(5);
+            mBuffer.append("<osmand:speed>");
+            appendFixed(point.speed, 1);
+            mBuffer.append("</osmand:speed>");
+        }
+        if (!qIsNaN(point.bearing))
+        {
+            openLine(5);
+            mBuffer.append("<osmand:heading>");
+            appendInt(int(point.bearing));
+            mBuffer.append("</osmand:heading>");
+        }
+        openLine(4);
+        mBuffer.append("</extensions>");
+    }
+
+    openLine(3);
+    mBuffer.append("</trkpt>");
+}
+
+// Same layout as QXmlStreamWriter auto formatting, four spaces per level
+void GpsExportGpx::openLine(int depth)
+{
+    static const char indent[] = "                        ";
+    Q_ASSERT(depth * 4 < int(sizeof(indent)));
+    if (mCompact)
+        return;
+    mBuffer.append('\n');
+    mBuffer.append(indent, depth * 4);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+static const int simplifyWindow = 512;
+
+GpsExportSimplify::GpsExportSimplify(GpsExport* inner, double tolerance) :
+    GpsExport(nullptr),
+    mInner(inner),
+    mTolerance(tolerance),
+    mWindow(),
+    mKept(),
+    mKeep(),
+    mRanges()
+{
+    mWindow.reserve(simplifyWindow);
+    mKept.reserve(simplifyWindow);
+    mKeep.reserve(simplifyWindow);
+}
+
+GpsExportSimplify::~GpsExportSimplify()
+{
+    delete mInner;
+}
+
+bool GpsExportSimplify::isValid() const
+{
+    return mInner && mInner->isValid();
+}
+
+bool GpsExportSimplify::start()
+{
+    return mInner->start();
+}
+
+bool GpsExportSimplify::finish()
+{
+    const bool ok = flushWindow(true);
+    return mInner->finish() && ok;
+}
+
+bool GpsExportSimplify::addSample(const GpsSample* sample)
+{
+    Q_ASSERT(sample);
+    // Only points with a fix make it into a GPX track
     if (!(sample->datetime.isValid() && sample->gpsValid))
         return true;
 
-    mWriter.writeStartElement("trkpt");
-    mWriter.writeAttribute("lat", QString::number(sample->latitude, 'f', 6)); // 6 decimal places ~ 10cm precision
-    mWriter.writeAttribute("lon", QString::number(sample->longitude, 'f', 6));
-    mWriter.writeTextElement("time", sample->datetime.toString(Qt::ISODateWithMs));
+    mWindow.append(*sample);
+    if (mWindow.size() < simplifyWindow)
+        return true;
+    return flushWindow(false);
+}
+
+// Simplifies the window and passes the points on. The last point stays
+// behind as the start of the next window, unless this is the end.
+bool GpsExportSimplify::flushWindow(bool last)
+{
+    const int count = mWindow.size();
+    if (count == 0)
+        return true;
+
+    mKeep.fill(false, count);
+    mKeep[0] = true;
+    mKeep[count - 1] = true;
+
+    // Local flat projection around the start of the window, in metres
+    static const double earthRadius = 6371000.0;
+    const double degToRad = 3.14159265358979323846 / 180.0;
+    const double lat0 = mWindow.at(0).latitude;
+    const double lon0 = mWindow.at(0).longitude;
+    const double xScale = earthRadius * degToRad * std::cos(lat0 * degToRad);
+    const double yScale = earthRadius * degToRad;
+
+    mRanges.clear();
+    if (count > 2)
+        mRanges.append(qMakePair(0, count - 1));
+    while (!mRanges.isEmpty())
+    {
+        const QPair<int, int> range = mRanges.takeLast();
+        const GpsSample& a = mWindow.at(range.first);
+        const GpsSample& b = mWindow.at(range.second);
+        const double ax = (a.longitude - lon0) * xScale;
+        const double ay = (a.latitude - lat0) * yScale;
+        const double dx = (b.longitude - lon0) * xScale - ax;
+        const double dy = (b.latitude - lat0) * yScale - ay;
+        const double lengthSq = dx * dx + dy * dy;
+
+        int furthest = -1;
+        double furthestSq = mTolerance * mTolerance;
+        for (int i = range.first + 1; i < range.second; ++i)
+        {
+            const GpsSample& p = mWindow.at(i);
+            const double px = (p.longitude - lon0) * xScale - ax;
+            const double py = (p.latitude - lat0) * yScale - ay;
+            double distSq;
+            if (lengthSq > 0.0)
+            {
+                // Distance to the segment, not the infinite line
+                const double t = qBound(0.0, (px * dx + py * dy) / lengthSq, 1.0);
+                const double ex = px - t * dx;
+                const double ey = py - t * dy;
+                distSq = ex * ex + ey * ey;
+            }
+            else
+            {
+                distSq = px * px + py * py;
+            }
+            if (distSq > furthestSq)
+            {
+                furthestSq = distSq;
+                furthest = i;
+            }
+        }
+
+        if (furthest < 0)
+            continue;
+        mKeep[furthest] = true;
+        if (furthest - range.first > 1)
+            mRanges.append(qMakePair(range.first, furthest));
+        if (range.second - furthest > 1)
+            mRanges.append(qMakePair(furthest, range.second));
+    }
 
-    if (!qIsNaN(sample->altitude))
-        mWriter.writeTextElement("ele", QString::number(sample->altitude, 'f', 1));
-    if (!qIsNaN(sample->geoidheight))
-        mWriter.writeTextElement("geoidheight", QString::number(sample->geoidheight, 'f', 1));
-    mWriter.writeTextElement("sat", QString::number(sample->sats));
-    if (!qIsNaN(sample->hdop))
-        mWriter.writeTextElement("hdop", QString::number(sample->hdop, 'f', 2));
+    const int passOn = last ? count : count - 1;
+    mKept.clear();
+    for (int i = 0; i < passOn; ++i)
+    {
+        if (mKeep.at(i))
+            mKept.append(mWindow.at(i));
+    }
 
-    mWriter.writeStartElement("extensions");
-        if (!qIsNaN(sample->speed))
-            mWriter.writeTextElement("osmand:speed", QString::number(sample->speed, 'f', 1));
-        if (!qIsNaN(sample->bearing))
-            mWriter.writeTextElement("osmand:heading", QString::number(int(sample->bearing)));
-    mWriter.writeEndElement();
+    const GpsSample carry = mWindow.at(count - 1);
+    mWindow.clear();
+    if (!last)
+        mWindow.append(carry);
 
-    mWriter.writeEndElement();
-    return (!mWriter.hasError());
+    return mInner->addSamples(mKept.constData(), mKept.size());
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 
 GpsExportCsv::GpsExportCsv(QIODevice* output) :
-    GpsExport(output),
-    mStream(mOutput)
-{
-    mStream.setRealNumberNotation(QTextStream::FixedNotation);
-}
+    GpsExport(output)
+{}
 
 bool GpsExportCsv::start()
 {
-    mStream << "Date,Time,Latitude,Longitude,Elevation,GeoidHeight,Satellites,HDOP,Speed,Bearing,Xacc,Yacc,Zacc\n";
+    mBuffer.append("Date,Time,Latitude,Longitude,Elevation,GeoidHeight,Satellites,HDOP,Speed,Bearing,Xacc,Yacc,Zacc\n");
     return true;
 }
 
 bool GpsExportCsv::finish()
 {
-    mStream.flush();
-    return true;
+    return finishOutput();
 }
 
 bool GpsExportCsv::addSample(const GpsSample* sample)
 {
-    if (!sample->datetime.isValid())
-        return true;
+    Q_ASSERT(sample);
+    appendPoint(GpsTrackPoint::fromSample(*sample));
+    return flushIfFull();
+}
 
-    mStream << sample->datetime.date().toString(Qt::ISODate) << "," << sample->datetime.time().toString(Qt::ISODateWithMs) << ",";;
+bool GpsExportCsv::addSamples(const GpsSample* samples, int count)
+{
+    for (int i = 0; i < count; ++i)
+    {
+        appendPoint(GpsTrackPoint::fromSample(samples[i]));
+        if (mBuffer.size() >= blockSize && !flushBuffer())
+            return false;
+    }
+    return true;
+}
 
-    mStream.setRealNumberPrecision(6);
-    if (sample->gpsValid && !(qIsNaN(sample->latitude) || qIsNaN(sample->longitude)))
-        mStream << sample->latitude << "," << sample->longitude << ",";
-    else
-        mStream << ",,";
+bool GpsExportCsv::addTrack(const GpsTrack& track)
+{
+    for (int i = 0; i < track.size(); ++i)
+    {
+        appendPoint(track.point(i));
+        if (mBuffer.size() >= blockSize && !flushBuffer())
+            return false;
+    }
+    return true;
+}
 
-    mStream.setRealNumberPrecision(1);
+void GpsExportCsv::appendPoint(const GpsTrackPoint& point)
+{
+    if (!point.isTimeValid())
+        return;
 
-    if (sample->gpsValid && !(qIsNaN(sample->speed) || qIsNaN(sample->bearing)))
-        mStream << sample->speed << "," << sample->bearing << ",";
-    else
-        mStream << ",,";
+    appendDateTime(point.time, ',');
+    mBuffer.append(',');
 
-    if (sample->gpsValid && !(qIsNaN(sample->altitude) || qIsNaN(sample->geoidheight)))
-        mStream << sample->altitude << "," << sample->geoidheight << ",";
+    if (point.isGpsValid() && !(qIsNaN(point.latitude) || qIsNaN(point.longitude)))
+    {
+        appendFixed(point.latitude, 6);
+        mBuffer.append(',');
+        appendFixed(point.longitude, 6);
+        mBuffer.append(',');
+    }
     else
-        mStream << ",,";
+        mBuffer.append(",,");
 
-    if (sample->gpsValid)
-        mStream << sample->sats << "," << sample->hdop << ",";
+    if (point.isGpsValid() && !(qIsNaN(point.speed) || qIsNaN(point.bearing)))
+    {
+        appendFixed(point.speed, 1);
+        mBuffer.append(',');
+        appendFixed(point.bearing, 1);
+        mBuffer.append(',');
+    }
     else
-        mStream << ",,";
+        mBuffer.append(",,");
 
+    if (point.isGpsValid() && !(qIsNaN(point.altitude) || qIsNaN(point.geoidHeight)))
+    {
+        appendFixed(point.altitude, 1);
+        mBuffer.append(',');
+        appendFixed(point.geoidHeight, 1);
+        mBuffer.append(',');
+    }
+    else
+        mBuffer.append(",,");
 
-    mStream.setRealNumberPrecision(2);
-    if (!(qIsNaN(sample->xAcc) || qIsNaN(sample->yAcc) || qIsNaN(sample->zAcc)))
-        mStream << sample->xAcc << "," << sample->yAcc << "," << sample->zAcc << "\n";
+    if (point.isGpsValid())
+    {
+        appendInt(point.sats);
+        mBuffer.append(',');
+        appendFixed(point.hdop, 1);
+        mBuffer.append(',');
+    }
     else
-        mStream << ",,\n";
+        mBuffer.append(",,");
 
-    return true;
+    if (!(qIsNaN(point.xAcc) || qIsNaN(point.yAcc) || qIsNaN(point.zAcc)))
+    {
+        appendFixed(point.xAcc, 2);
+        mBuffer.append(',');
+        appendFixed(point.yAcc, 2);
+        mBuffer.append(',');
+        appendFixed(point.zAcc, 2);
+        mBuffer.append('\n');
+    }
+    else
+        mBuffer.append(",,\n");
 }
-
-
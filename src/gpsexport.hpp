@@ -19,11 +19,16 @@
 #ifndef GPSEXPORT_HPP
 #define GPSEXPORT_HPP
 
-#include <QXmlStreamWriter>
-#include <QTextStream>
+#include <QIODevice>
+#include <QPair>
+#include <QVector>
 
 #include "gpssampleparser.hpp"
 
+class GpsTrack;
+class GzipDevice;
+struct GpsTrackPoint;
+
 enum class GpsExportFormat : int
 {
     Invalid = 0,
@@ -32,6 +37,19 @@ enum class GpsExportFormat : int
 };
 
 
+struct GpsExportOptions
+{
+    bool compact; // GPX without indentation
+    bool compress; // gzip the output
+    int compressionLevel; // 1 fastest to 9 smallest
+    double simplifyTolerance; // GPX points within this many metres of the simplified line are dropped, 0 keeps all
+
+    GpsExportOptions();
+};
+
+
+// Exporters format into a byte buffer which is written out in large blocks,
+// there is no codec or locale involved
 class GpsExport
 {
 public:
@@ -41,24 +59,70 @@ public:
     virtual bool finish() = 0;
     virtual bool addSample(const GpsSample* sample) = 0;
 
-    static GpsExport* createExporter(GpsExportFormat format, QIODevice* output);
+    // Batches, the formats below handle these without a call per sample
+    virtual bool addSamples(const GpsSample* samples, int count);
+    virtual bool addTrack(const GpsTrack& track);
+
+    static GpsExport* createExporter(
+        GpsExportFormat format, QIODevice* output, const GpsExportOptions& options = GpsExportOptions());
 
 protected:
     GpsExport(QIODevice* output);
+
+    void appendFixed(double value, int precision);
+    void appendInt(qint64 value);
+    void appendDateTime(qint64 msecs, char separator);
+    bool flushBuffer();
+    bool flushIfFull();
+    bool finishOutput();
+
     QIODevice* mOutput;
+    QByteArray mBuffer;
+
+private:
+    GzipDevice* mCompressor;
 };
 
 
 class GpsExportGpx : public GpsExport
 {
 public:
-    GpsExportGpx(QIODevice* output);
+    GpsExportGpx(QIODevice* output, bool compact = false);
     bool start() override;
     bool finish() override;
     bool addSample(const GpsSample* sample) override;
+    bool addSamples(const GpsSample* samples, int count) override;
+    bool addTrack(const GpsTrack& track) override;
 
 private:
-    QXmlStreamWriter mWriter;
+    void appendPoint(const GpsTrackPoint& point);
+    void openLine(int depth);
+
+    bool mCompact;
+};
+
+// Passes on a simplified track, points closer than the tolerance to the line
+// through the points kept around them are dropped (Douglas-Peucker). Works
+// on a window of points at a time so memory does not grow with the track.
+class GpsExportSimplify : public GpsExport
+{
+public:
+    GpsExportSimplify(GpsExport* inner, double tolerance);
+    ~GpsExportSimplify();
+    bool isValid() const override;
+    bool start() override;
+    bool finish() override;
+    bool addSample(const GpsSample* sample) override;
+
+private:
+    bool flushWindow(bool last);
+
+    GpsExport* mInner;
+    double mTolerance;
+    QVector<GpsSample> mWindow;
+    QVector<GpsSample> mKept;
+    QVector<bool> mKeep;
+    QVector<QPair<int, int>> mRanges;
 };
 
 class GpsExportCsv : public GpsExport
@@ -68,9 +132,11 @@ public:
     bool start() override;
     bool finish() override;
     bool addSample(const GpsSample* sample) override;
+    bool addSamples(const GpsSample* samples, int count) override;
+    bool addTrack(const GpsTrack& track) override;
 
 private:
-    QTextStream mStream;
+    void appendPoint(const GpsTrackPoint& point);
 };
 
 
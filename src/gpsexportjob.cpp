@@ -0,0 +1,195 @@
+/* Copyright 2021-2023 Silas Parker.
+ *
+ * This file is part of NB Dashcam Tools.
+ *
+ * NB Dashcam Tools is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * NB Dashcam Tools is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NB Dashcam Tools. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "gpsexportjob.hpp"
+
+#include <QDebug>
+#include <QFileInfo>
+#include <QRunnable>
+#include <QSemaphore>
+#include <QThreadPool>
+
+#include "gpstrack.hpp"
+
+
+class GpsExportJob::WriteTask : public QRunnable
+{
+public:
+    WriteTask(GpsExport* exporter, const GpsTrack& track, bool* ok, QSemaphore* done) :
+        mExporter(exporter),
+        mTrack(track),
+        mOk(ok),
+        mDone(done)
+    {}
+
+    void run() override
+    {
+        *mOk = mExporter->addTrack(mTrack);
+        mDone->release();
+    }
+
+private:
+    GpsExport* mExporter;
+    const GpsTrack& mTrack;
+    bool* mOk;
+    QSemaphore* mDone;
+};
+
+
+GpsExportJob::GpsExportJob() :
+    mOptions(),
+    mTargets()
+{}
+
+GpsExportJob::~GpsExportJob()
+{
+    abort();
+}
+
+void GpsExportJob::setOptions(const GpsExportOptions& options)
+{
+    mOptions = options;
+}
+
+void GpsExportJob::addTarget(GpsExportFormat format, const QString& path)
+{
+    Target target;
+    target.format = format;
+    target.path = path;
+    target.file = nullptr;
+    target.exporter = nullptr;
+    mTargets.append(target);
+}
+
+bool GpsExportJob::begin(QString* errMsg)
+{
+    if (mTargets.isEmpty())
+    {
+        if (errMsg)
+            *errMsg = QObject::tr("Export format invalid");
+        return false;
+    }
+
+    for (Target& target : mTargets)
+    {
+        if (mOptions.compress && !target.path.endsWith(QLatin1String(".gz"), Qt::CaseInsensitive))
+            target.path += QLatin1String(".gz");
+
+        target.file = new QFile(target.path);
+        if (!target.file->open(QIODevice::WriteOnly | QIODevice::Truncate))
+        {
+            if (errMsg)
+                *errMsg = QObject::tr("Failed to open output file:\n%1").arg(target.path);
+            abort();
+            return false;
+        }
+
+        target.exporter = GpsExport::createExporter(target.format, target.file, mOptions);
+        if (!(target.exporter && target.exporter->isValid() && target.exporter->start()))
+        {
+            if (errMsg)
+                *errMsg = QObject::tr("Failed to create exporter");
+            abort();
+            return false;
+        }
+    }
+    return true;
+}
+
+bool GpsExportJob::addTrack(const GpsTrack& track, QString* errMsg)
+{
+    if (track.isEmpty() || mTargets.isEmpty())
+        return true;
+
+    // The first target runs on the calling thread, the rest on the pool
+    QVector<bool> ok(mTargets.size(), true);
+    QSemaphore done;
+    for (int i = 1; i < mTargets.size(); ++i)
+    {
+        QThreadPool::globalInstance()->start(
+            new WriteTask(mTargets.at(i).exporter, track, &ok[i], &done));
+    }
+    ok[0] = mTargets.at(0).exporter->addTrack(track);
+    done.acquire(mTargets.size() - 1);
+
+    for (int i = 0; i < mTargets.size(); ++i)
+    {
+        if (!ok.at(i))
+        {
+            if (errMsg)
+                *errMsg = QObject::tr("Failed to process sample");
+            qWarning() << "Export failed for" << mTargets.at(i).path;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool GpsExportJob::finish(QString* errMsg)
+{
+    bool ok = true;
+    for (const Target& target : mTargets)
+    {
+        if (!(target.exporter && target.exporter->finish() && target.file->flush()))
+        {
+            qWarning() << "Failed to finish" << target.path;
+            ok = false;
+        }
+    }
+    abort();
+    if (!ok && errMsg)
+        *errMsg = QObject::tr("Failed to finish exporter");
+    return ok;
+}
+
+void GpsExportJob::abort()
+{
+    for (Target& target : mTargets)
+    {
+        // The exporter writes to the file, so goes first
+        delete target.exporter;
+        target.exporter = nullptr;
+        delete target.file;
+        target.file = nullptr;
+    }
+}
+
+// With several targets each one gets the suffix of its format
+QString GpsExportJob::targetPath(const QString& path, GpsExportFormat format, bool multiple)
+{
+    if (!multiple)
+        return path;
+
+    QString suffix;
+    switch (format)
+    {
+    case GpsExportFormat::Invalid:
+        return path;
+    case GpsExportFormat::GPX:
+        suffix = QStringLiteral("gpx");
+        break;
+    case GpsExportFormat::CSV:
+        suffix = QStringLiteral("csv");
+        break;
+    }
+
+    const QFileInfo info(path);
+    if (info.suffix().isEmpty())
+        return path + QLatin1Char('.') + suffix;
+    return path.left(path.size() - info.suffix().size()) + suffix;
+}
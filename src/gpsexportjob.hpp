@@ -0,0 +1,65 @@
+/* Copyright 2021-2023 Silas Parker.
+ *
+ * This file is part of NB Dashcam Tools.
+ *
+ * NB Dashcam Tools is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * NB Dashcam Tools is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NB Dashcam Tools. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef GPSEXPORTJOB_HPP
+#define GPSEXPORTJOB_HPP
+
+#include <QFile>
+#include <QString>
+#include <QVector>
+
+#include "gpsexport.hpp"
+
+class GpsTrack;
+
+// Feeds one decoded sample stream to an exporter per output format. With
+// several targets each one formats and writes on its own pool thread.
+class GpsExportJob
+{
+public:
+    GpsExportJob();
+    ~GpsExportJob();
+
+    void setOptions(const GpsExportOptions& options);
+    void addTarget(GpsExportFormat format, const QString& path);
+    int targetCount() const {return mTargets.size();}
+
+    bool begin(QString* errMsg = nullptr);
+    bool addTrack(const GpsTrack& track, QString* errMsg = nullptr);
+    bool finish(QString* errMsg = nullptr);
+    void abort();
+
+    static QString targetPath(const QString& path, GpsExportFormat format, bool multiple);
+
+private:
+    Q_DISABLE_COPY(GpsExportJob)
+
+    struct Target
+    {
+        GpsExportFormat format;
+        QString path;
+        QFile* file;
+        GpsExport* exporter;
+    };
+    class WriteTask;
+
+    GpsExportOptions mOptions;
+    QVector<Target> mTargets;
+};
+
+#endif // GPSEXPORTJOB_HPP
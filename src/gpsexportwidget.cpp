@@ -24,27 +24,49 @@
 #include <QFileDialog>
 #include <QPushButton>
 #include <QComboBox>
+#include <QCheckBox>
+#include <QSpinBox>
+#include <QDoubleSpinBox>
 #include <QMessageBox>
 #include <QSettings>
 
-#include "toollocator.hpp"
 #include "mp4file.hpp"
+#include "clipprobe.hpp"
+#include "gpsclipexporter.hpp"
 #include "gpssampleparser.hpp"
 #include "gpsexport.hpp"
+#include "gzipdevice.hpp"
+
+// The format combo box holds a bit per format
+static int formatMask(GpsExportFormat format)
+{
+    return 1 << int(format);
+}
+
+static QVector<GpsExportFormat> formatsFromMask(int mask)
+{
+    QVector<GpsExportFormat> formats;
+    for (GpsExportFormat format : {GpsExportFormat::GPX, GpsExportFormat::CSV})
+    {
+        if (mask & formatMask(format))
+            formats << format;
+    }
+    return formats;
+}
+
 
 GpsExportWidget::GpsExportWidget(QWidget *parent) :
     QWidget(parent),
     ui(new Ui::GpsExportWidget),
-    mFFmpegProc(nullptr),
-    mSubsData(nullptr),
-    mOutputFile(),
-    mCamera()
+    mExporter(new GpsClipExporter(this))
 {
     ui->setupUi(this);
 
     QComboBox* outputFormatComboBox = findChild<QComboBox*>("outputFormatComboBox");
-    outputFormatComboBox->addItem(tr("GPX"), QVariant(int(GpsExportFormat::GPX)));
-    outputFormatComboBox->addItem(tr("CSV"), QVariant(int(GpsExportFormat::CSV)));
+    outputFormatComboBox->addItem(tr("GPX"), QVariant(formatMask(GpsExportFormat::GPX)));
+    outputFormatComboBox->addItem(tr("CSV"), QVariant(formatMask(GpsExportFormat::CSV)));
+    outputFormatComboBox->addItem(
+        tr("GPX + CSV"), QVariant(formatMask(GpsExportFormat::GPX) | formatMask(GpsExportFormat::CSV)));
 
     connect(
         findChild<QPushButton*>("inputFileButton"),
@@ -70,11 +92,28 @@ GpsExportWidget::GpsExportWidget(QWidget *parent) :
         this,
         &GpsExportWidget::inputFileSelected);
 
+    connect(
+        mExporter,
+        &GpsClipExporter::finished,
+        this,
+        &GpsExportWidget::exportFinished);
+
     QSettings settings;
     settings.beginGroup("gpsexport");
     findChild<QLineEdit*>("inputFileEdit")->setText(settings.value("inputFileEdit").toString());
     outputFormatComboBox->setCurrentIndex(settings.value("outputFormatComboBox", QVariant(int(0))).toInt());
     findChild<QLineEdit*>("outputFileEdit")->setText(settings.value("outputFileEdit").toString());
+    findChild<QCheckBox*>("compactGpxCheckBox")->setChecked(settings.value("compactGpxCheckBox", false).toBool());
+    findChild<QCheckBox*>("compressCheckBox")->setChecked(settings.value("compressCheckBox", false).toBool());
+    findChild<QSpinBox*>("compressionLevelSpinBox")->setValue(settings.value("compressionLevelSpinBox", 6).toInt());
+    findChild<QDoubleSpinBox*>("simplifyToleranceSpinBox")->setValue(settings.value("simplifyToleranceSpinBox", 0.0).toDouble());
+
+    if (!GzipDevice::isAvailable())
+    {
+        findChild<QCheckBox*>("compressCheckBox")->setChecked(false);
+        findChild<QCheckBox*>("compressCheckBox")->setEnabled(false);
+        findChild<QSpinBox*>("compressionLevelSpinBox")->setEnabled(false);
+    }
 }
 
 GpsExportWidget::~GpsExportWidget()
@@ -97,17 +136,27 @@ void GpsExportWidget::selectInputFile()
 void GpsExportWidget::selectOutputFile()
 {
     QLineEdit* outputFileEdit = findChild<QLineEdit*>("outputFileEdit");
-    GpsExportFormat format = GpsExportFormat(findChild<QComboBox*>("outputFormatComboBox")->currentData().toInt());
+    const QVector<GpsExportFormat> formats =
+        formatsFromMask(findChild<QComboBox*>("outputFormatComboBox")->currentData().toInt());
 
-    QString filter;
-    switch (format)
+    // With several formats the name picked is used for each, with the
+    // suffix of the format
+    QStringList filters;
+    for (GpsExportFormat format : formats)
+    {
+        switch (format)
+        {
+        case GpsExportFormat::Invalid: break;
+        case GpsExportFormat::GPX: filters << "GPX (*.gpx)"; break;
+        case GpsExportFormat::CSV: filters << "CSV (*.csv)"; break;
+        }
+    }
+    if (filters.isEmpty())
     {
-    case GpsExportFormat::GPX: filter = "GPX (*.gpx)"; break;
-    case GpsExportFormat::CSV: filter = "CSV (*.csv)"; break;
-    default:
         QMessageBox::warning(this, tr("Export"), tr("Export format invalid"));
         return;
     }
+    const QString filter = filters.join(";;");
 
     QString startDir = QDir::fromNativeSeparators(outputFileEdit->text());
     if (startDir.isEmpty())
@@ -132,8 +181,10 @@ void GpsExportWidget::inputFileSelected(const QString& text)
         return;
     }
 
-    Mp4File mp4(text);
-    if (!mp4.open(QIODevice::ReadOnly))
+    // Goes through the clip cache, browsing an archive again does not
+    // need to touch the files
+    const ClipInfo info = ClipProber::probe(text);
+    if (!info.isValid())
     {
         exportButton->setDisabled(true);
         cameraTypeLine->setText(tr("Can not open file"));
@@ -141,7 +192,7 @@ void GpsExportWidget::inputFileSelected(const QString& text)
         return;
     }
 
-    QString infoStr = mp4.readInfoString();
+    const QString& infoStr = info.infoString;
     if (infoStr.isEmpty())
     {
         exportButton->setDisabled(true);
@@ -169,164 +220,53 @@ void GpsExportWidget::inputFileSelected(const QString& text)
 void GpsExportWidget::startExport()
 {
     QString inputFileName = QDir::fromNativeSeparators(findChild<QLineEdit*>("inputFileEdit")->text());
-    mOutputFile = QDir::fromNativeSeparators(findChild<QLineEdit*>("outputFileEdit")->text());
+    QString outputFile = QDir::fromNativeSeparators(findChild<QLineEdit*>("outputFileEdit")->text());
     QComboBox* outputFormatComboBox = findChild<QComboBox*>("outputFormatComboBox");
-    mExportFormat = GpsExportFormat(outputFormatComboBox->currentData().toInt());
+    const QVector<GpsExportFormat> formats = formatsFromMask(outputFormatComboBox->currentData().toInt());
 
-    if (mOutputFile.isEmpty())
+    if (outputFile.isEmpty())
     {
         QMessageBox::warning(this, tr("Export"), tr("Output file not set"));
         return;
     }
 
-    if (mExportFormat == GpsExportFormat::Invalid)
+    if (formats.isEmpty())
     {
         QMessageBox::warning(this, tr("Export"), tr("Export format invalid"));
         return;
     }
 
-    Mp4File mp4(inputFileName);
-    if (!mp4.open(QIODevice::ReadOnly))
-    {
-        QMessageBox::warning(this, tr("Export"), tr("Input file not found"));
-        return;
-    }
-
-    QString infoStr = mp4.readInfoString();
-    if (infoStr.isEmpty())
-    {
-        QMessageBox::warning(this, tr("Export"), tr("Can not read file"));
-        return;
-    }
-
-    mCamera = Mp4File::cameraModel(infoStr);
-    bool supported = GpsSampleParser::isCameraSupported(mCamera);
-    if (!supported)
-    {
-        QMessageBox::warning(this, tr("Export"), tr("Camera not supported"));
-        return;
-    }
-
-    mSubsData = new QBuffer(this);
-    if (!mSubsData->open(QIODevice::ReadWrite))
-    {
-        QMessageBox::warning(this, tr("Export"), tr("Failed to create buffer"));
-        return;
-    }
+    GpsExportOptions options;
+    options.compact = findChild<QCheckBox*>("compactGpxCheckBox")->isChecked();
+    options.compress = findChild<QCheckBox*>("compressCheckBox")->isChecked();
+    options.compressionLevel = findChild<QSpinBox*>("compressionLevelSpinBox")->value();
+    options.simplifyTolerance = findChild<QDoubleSpinBox*>("simplifyToleranceSpinBox")->value();
 
     QSettings settings;
     settings.beginGroup("gpsexport");
     settings.setValue("inputFileEdit", QDir::toNativeSeparators(inputFileName));
     settings.setValue("outputFormatComboBox", outputFormatComboBox->currentIndex());
-    settings.setValue("outputFileEdit", mOutputFile);
+    settings.setValue("outputFileEdit", outputFile);
+    settings.setValue("compactGpxCheckBox", options.compact);
+    settings.setValue("compressCheckBox", options.compress);
+    settings.setValue("compressionLevelSpinBox", options.compressionLevel);
+    settings.setValue("simplifyToleranceSpinBox", options.simplifyTolerance);
     settings.endGroup();
 
-    QStringList args;
-    args
-        << "-nostdin" << "-hide_banner"
-        << "-i" << QDir::toNativeSeparators(inputFileName)
-        << "-map" << "0:s" << "-c:s" << "copy"
-        << "-f" << "data" << "-";
-
-    qDebug() << ToolLocator::instance()->ffmpeg() << args;
-    
-    mFFmpegProc = new QProcess(this);
-    mFFmpegProc->setProgram(ToolLocator::instance()->ffmpeg());
-    mFFmpegProc->setArguments(args);
-    mFFmpegProc->setStandardInputFile(QProcess::nullDevice());
-    mFFmpegProc->setProcessChannelMode(QProcess::ForwardedErrorChannel);
-
-    connect(
-        mFFmpegProc,
-        &QProcess::readyReadStandardOutput,
-        this,
-        &GpsExportWidget::ffmpegStdout);
-
-    connect(
-        mFFmpegProc,
-        QOverload<int,QProcess::ExitStatus>::of(&QProcess::finished),
-        this,
-        &GpsExportWidget::ffmpegFinished);
+    mExporter->setInput(inputFileName);
+    mExporter->setOutput(outputFile);
+    mExporter->setFormats(formats);
+    mExporter->setOptions(options);
 
     findChild<QPushButton*>("exportButton")->setDisabled(true);
-
-    mFFmpegProc->start();
+    mExporter->start();
 }
 
-void GpsExportWidget::ffmpegStdout()
+void GpsExportWidget::exportFinished(bool ok)
 {
-    if (mFFmpegProc)
-    {
-        while (mFFmpegProc->bytesAvailable())
-        {
-            QByteArray chunk = mFFmpegProc->readAllStandardOutput();
-            qint64 written = 0;
-            while (written < chunk.size())
-            {
-                qint64 wrote = mSubsData->write(chunk.data() + written, chunk.size() - written);
-                if (wrote < 0)
-                {
-                    qWarning() << "Failed to write to buffer";
-                }
-                written += wrote;
-            }
-        }
-    }
-}
-
-void GpsExportWidget::ffmpegFinished(int exitCode, QProcess::ExitStatus exitStatus)
-{
-    mFFmpegProc->deleteLater();
-    mFFmpegProc = nullptr;
     findChild<QPushButton*>("exportButton")->setDisabled(false);
-    if (exitStatus != QProcess::NormalExit || exitCode != 0)
-    {
-        QMessageBox::warning(this, tr("Export"), tr("Failed to extract GPS data from file"));
-        return;
-    }
-
-    qDebug() << "Extracted data, " << mSubsData->size() << "bytes";
-
-    mSubsData->seek(0);
-
-    GpsSampleParser parser(mSubsData, mCamera);
-    if (!parser.isValid())
-    {
-        QMessageBox::warning(this, tr("Export"), tr("Failed to create parser for GPS data"));
-        return;
-    }
-
-    QFile outputFile(mOutputFile);
-    if (!outputFile.open(QIODevice::WriteOnly | QIODevice::Truncate))
-    {
-        QMessageBox::warning(this, tr("Export"), tr("Failed to open output file"));
-        return;
-    }
-
-    QScopedPointer<GpsExport> exporter(GpsExport::createExporter(mExportFormat, &outputFile));
-    if (!(bool(exporter) && exporter->isValid() && exporter->start()))
+    if (!ok && !mExporter->errorString().isEmpty())
     {
-        QMessageBox::warning(this, tr("Export"), tr("Failed to create exporter"));
-        return;
+        QMessageBox::warning(this, tr("Export"), mExporter->errorString());
     }
-
-
-    GpsSample sample;
-    while (parser.nextSample(&sample))
-    {
-        if (!exporter->addSample(&sample))
-        {
-            QMessageBox::warning(this, tr("Export"), tr("Failed to process sample"));
-            return;
-        }
-    }
-
-    if (!(exporter->finish() && outputFile.flush()))
-    {
-        QMessageBox::warning(this, tr("Export"), tr("Failed to finish exporter"));
-        return;
-    }
-    outputFile.close();
 }
-
-
@@ -20,10 +20,8 @@
 #define GPSEXPORTWIDGET_H
 
 #include <QWidget>
-#include <QProcess>
-#include <QBuffer>
 
-#include "gpsexport.hpp"
+class GpsClipExporter;
 
 namespace Ui {
 class GpsExportWidget;
@@ -42,18 +40,13 @@ private slots:
     void selectOutputFile();
     void inputFileSelected(const QString& text);
     void startExport();
-    void ffmpegStdout();
-    void ffmpegFinished(int exitCode, QProcess::ExitStatus exitStatus);
+    void exportFinished(bool ok);
 
 
 private:
     Ui::GpsExportWidget *ui;
 
-    QProcess* mFFmpegProc;
-    QBuffer* mSubsData;
-    QString mOutputFile;
-    QString mCamera;
-    GpsExportFormat mExportFormat;
+    GpsClipExporter* mExporter;
 };
 
 #endif // GPSEXPORTWIDGET_H
@@ -17,10 +17,18 @@
  */
 
 #include "gpssampleparser.hpp"
+#include "gpstrack.hpp"
 
 #include <QDebug>
+#include <QRunnable>
+#include <QSemaphore>
+#include <QSharedPointer>
+#include <QThreadPool>
 #include <QTimeZone>
 
+#include <algorithm>
+#include <cstring>
+
 
 struct ParseFormat
 {
@@ -54,6 +62,219 @@ static const ParseFormat supportedCameras[] = {
 };
 
 
+// Sentences are at most 128 bytes, fields are parsed in place without
+// copying them into strings
+static const int maxNmeaFields = 16;
+static const qint64 msecsPerDay = 24 * 60 * 60 * 1000;
+
+struct NmeaField
+{
+    const char* data;
+    int length;
+
+    bool isEmpty() const {return length == 0;}
+    QLatin1String toLatin1() const {return QLatin1String(data, length);}
+
+    bool equals(const char* str) const
+    {
+        return (qstrlen(str) == uint(length)) && (memcmp(data, str, length) == 0);
+    }
+
+    int skipDigits(int pos) const
+    {
+        while (pos < length && data[pos] >= '0' && data[pos] <= '9')
+            ++pos;
+        return pos;
+    }
+
+    // Reads digits from pos, returns the number of digits consumed
+    int readDigits(int pos, qint64* value, int maxDigits = 18) const
+    {
+        int count = 0;
+        *value = 0;
+        for (; pos + count < length && count < maxDigits; ++count)
+        {
+            const char c = data[pos + count];
+            if (c < '0' || c > '9')
+                break;
+            *value = *value * 10 + (c - '0');
+        }
+        return count;
+    }
+
+    // Same result as QString::toInt, 0 if the field is not a number
+    int toInt() const
+    {
+        const bool negative = (length > 0 && data[0] == '-');
+        const int start = (length > 0 && (data[0] == '-' || data[0] == '+')) ? 1 : 0;
+        qint64 value = 0;
+        const int count = readDigits(start, &value, 9);
+        if (count == 0 || start + count != length)
+            return 0;
+        return int(negative ? -value : value);
+    }
+
+    // Plain decimal notation only, which is all NMEA uses, 0 if the field
+    // is not a number
+    double toDouble() const
+    {
+        const bool negative = (length > 0 && data[0] == '-');
+        int pos = (length > 0 && (data[0] == '-' || data[0] == '+')) ? 1 : 0;
+        qint64 whole = 0;
+        const int wholeDigits = readDigits(pos, &whole);
+        pos += wholeDigits;
+        double value = double(whole);
+        if (pos < length && data[pos] == '.')
+        {
+            qint64 frac = 0;
+            const int fracDigits = readDigits(++pos, &frac, 9);
+            pos = skipDigits(pos + fracDigits);
+            if (wholeDigits == 0 && fracDigits == 0)
+                return 0.0;
+            value += frac / powersOf10[fracDigits];
+        }
+        else if (wholeDigits == 0)
+        {
+            return 0.0;
+        }
+        if (pos != length)
+            return 0.0;
+        return negative ? -value : value;
+    }
+
+    static const double powersOf10[10];
+};
+
+const double NmeaField::powersOf10[10] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9};
+
+// Splits a nul terminated sentence into fields, leading and trailing
+// whitespace and the checksum are dropped. Returns the field count, or -1 if
+// there are too many fields.
+static int splitNmea(const char* line, NmeaField* fields)
+{
+    const char* begin = line;
+    while (*begin == ' ' || (*begin >= '\t' && *begin <= '\r'))
+        ++begin;
+    const char* end = begin;
+    while (*end && *end != '*')
+        ++end;
+    while (end > begin && (end[-1] == ' ' || (end[-1] >= '\t' && end[-1] <= '\r')))
+        --end;
+
+    int count = 0;
+    const char* start = begin;
+    for (const char* p = begin; ; ++p)
+    {
+        if (p == end || *p == ',')
+        {
+            if (count == maxNmeaFields)
+                return -1;
+            fields[count].data = start;
+            fields[count].length = int(p - start);
+            ++count;
+            if (p == end)
+                break;
+            start = p + 1;
+        }
+    }
+    return count;
+}
+
+// hhmmss with optional fractional seconds, as milliseconds since midnight
+static bool parseNmeaTime(const NmeaField& field, qint64* msecs)
+{
+    qint64 hhmmss = 0;
+    if (field.readDigits(0, &hhmmss, 6) != 6)
+        return false;
+
+    qint64 ms = 0;
+    if (field.length > 6)
+    {
+        if (field.data[6] != '.')
+            return false;
+        qint64 frac = 0;
+        const int fracDigits = field.readDigits(7, &frac, 3);
+        if (fracDigits == 0 || 7 + fracDigits != field.length)
+            return false;
+        for (int i = fracDigits; i < 3; ++i)
+            frac *= 10;
+        ms = frac;
+    }
+
+    const qint64 hour = hhmmss / 10000;
+    const qint64 minute = (hhmmss / 100) % 100;
+    const qint64 second = hhmmss % 100;
+    if (hour > 23 || minute > 59 || second > 59)
+        return false;
+
+    *msecs = ((hour * 60 + minute) * 60 + second) * 1000 + ms;
+    return true;
+}
+
+// ddmmyy, as days since 1970-01-01, two digit years are in the 2000s
+static bool parseNmeaDate(const NmeaField& field, qint64* days)
+{
+    qint64 ddmmyy = 0;
+    if (field.length != 6 || field.readDigits(0, &ddmmyy, 6) != 6)
+        return false;
+
+    const int day = int(ddmmyy / 10000);
+    const int month = int((ddmmyy / 100) % 100);
+    const int year = 2000 + int(ddmmyy % 100);
+
+    static const int daysInMonth[12] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+    if (month < 1 || month > 12 || day < 1)
+        return false;
+    const bool leap = (year % 4 == 0) && (year % 100 != 0 || year % 400 == 0);
+    if (day > daysInMonth[month - 1] + ((leap && month == 2) ? 1 : 0))
+        return false;
+
+    // Days from civil, shifting the year to start in March puts the leap
+    // day last
+    const int y = year - (month <= 2 ? 1 : 0);
+    const int era = y / 400;
+    const int yoe = y - era * 400;
+    const int doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    const int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    *days = qint64(era) * 146097 + doe - 719468;
+    return true;
+}
+
+// dddmm.mmmm, degrees are optional and up to 3 digits
+static bool parseCoord(const NmeaField& field, double* output)
+{
+    qint64 whole = 0;
+    const int wholeDigits = field.readDigits(0, &whole, 5);
+    int pos = wholeDigits;
+    double minutes = double(whole % 100);
+    if (wholeDigits < 2)
+        pos = -1;
+    else if (pos < field.length && field.data[pos] == '.')
+    {
+        qint64 frac = 0;
+        const int fracDigits = field.readDigits(++pos, &frac, 9);
+        pos = field.skipDigits(pos + fracDigits);
+        minutes += frac / NmeaField::powersOf10[fracDigits];
+    }
+
+    if (pos != field.length)
+    {
+        qDebug() << "Failed to parse coordinate" << field.toLatin1();
+        return false;
+    }
+
+    *output = whole / 100 + (minutes / 60.0);
+    return true;
+}
+
+// A time zone backed QDateTime allocates before Qt 6.5, a time spec does not
+#if QT_VERSION >= QT_VERSION_CHECK(6, 5, 0)
+static QTimeZone utcTimeSpec() {return QTimeZone(QTimeZone::UTC);}
+#else
+static Qt::TimeSpec utcTimeSpec() {return Qt::UTC;}
+#endif
+
+
 void GpsSample::reset()
 {
     datetime = QDateTime();
@@ -76,18 +297,90 @@ bool GpsSampleParser::isCameraSupported(const QString& name)
     return cameraFormat(name.toLatin1().constData()) > 0;
 }
 
+// Shared between the calling thread and the pool, workers claim chunks of
+// samples until none are left
+struct GpsSampleParser::DecodeJob
+{
+    int formatCode;
+    const char* data;
+    QVector<int> offsets;
+    GpsTrack* output;
+    char* decoded;
+    int chunkSize;
+    int chunkCount;
+    QAtomicInt nextChunk;
+    QSemaphore chunksDone;
+
+    void decodeChunks()
+    {
+        for (int chunk = nextChunk.fetchAndAddOrdered(1); chunk < chunkCount;
+             chunk = nextChunk.fetchAndAddOrdered(1))
+        {
+            const int end = qMin(offsets.size(), (chunk + 1) * chunkSize);
+            GpsSample sample;
+            for (int i = chunk * chunkSize; i < end; ++i)
+            {
+                const int offset = offsets.at(i);
+                const quint16 length = readUint16BE(data + offset - 2);
+                decoded[i] = parseSample(formatCode, data + offset + 4, length - 4, &sample);
+                if (decoded[i])
+                    output->set(i, sample);
+            }
+            chunksDone.release();
+        }
+    }
+};
+
+class GpsSampleParser::DecodeTask : public QRunnable
+{
+public:
+    explicit DecodeTask(const QSharedPointer<DecodeJob>& job) :
+        mJob(job)
+    {}
+
+    void run() override
+    {
+        mJob->decodeChunks();
+    }
+
+private:
+    QSharedPointer<DecodeJob> mJob;
+};
+
+
 GpsSampleParser::GpsSampleParser(QIODevice* device, const QString& name):
     mDevice(device),
     mFormatCode(cameraFormat(name.toLatin1().constData())),
-    mCoordRegEx("^(\\d{0,3})(\\d\\d(?:\\.\\d*)?)$")
+    mSampleData(),
+    mPendingPos(0),
+    mFailed(false)
+{}
+
+GpsSampleParser::GpsSampleParser(const QString& name):
+    GpsSampleParser(nullptr, name)
+{}
+
+bool GpsSampleParser::isValid() const
 {
-    Q_ASSERT(mCoordRegEx.isValid());
-    mCoordRegEx.optimize();
+    if (!mDevice)
+        return mFormatCode > 0;
+    return mDevice->isOpen() && mDevice->isReadable() && (mFormatCode > 0);
 }
 
-bool GpsSampleParser::isValid() const
+void GpsSampleParser::addData(const char* data, int size)
 {
-    return mDevice && mDevice->isOpen() && mDevice->isReadable() && (mFormatCode > 0);
+    Q_ASSERT(!mDevice);
+    if (mFailed)
+        return;
+
+    // Only a partial sample is left once the caller has taken everything,
+    // so moving it to the front is cheap and keeps the buffer small
+    if (mPendingPos > 0)
+    {
+        mSampleData.remove(0, mPendingPos);
+        mPendingPos = 0;
+    }
+    mSampleData.append(data, size);
 }
 
 bool GpsSampleParser::nextSample(GpsSample* sample)
@@ -95,19 +388,22 @@ bool GpsSampleParser::nextSample(GpsSample* sample)
     Q_ASSERT(sample != nullptr);
     sample->reset();
 
+    if (!mDevice)
+        return takeSample(sample);
+
     if (mDevice->atEnd())
     {
         qDebug() << "At end, no more samples";
         return false;
     }
 
-    bool ok;
-    quint16 sampleLength = readUint16BE(&ok);
-    if (!ok)
+    char lengthData[2];
+    if (mDevice->read(lengthData, 2) != 2)
     {
         qDebug() << "Failed to read sample length";
         return false;
     }
+    const quint16 sampleLength = readUint16BE(lengthData);
 
     qint64 endpos = mDevice->pos() + sampleLength;
     if (endpos > mDevice->size())
@@ -120,159 +416,208 @@ bool GpsSampleParser::nextSample(GpsSample* sample)
         return mDevice->skip(sampleLength) == sampleLength;
     }
 
-    if (mDevice->skip(4) != 4) // Not sure what this is, looks to be always zeros
+    // The buffer only grows, reading samples does not allocate once it has
+    // reached the sample size
+    mSampleData.resize(sampleLength);
+    if (mDevice->read(mSampleData.data(), sampleLength) != sampleLength)
     {
-        qDebug() << "Failed to get to start of data";
+        qDebug() << "Failed to read sample";
         return false;
     }
-    sampleLength -= 4;
-
-    bool rc = false;
-    switch (mFormatCode)
-    {
-    case 1:
-        rc = parseSample322GW(sample, sampleLength);
-        break;
-    case 2:
-        rc = parseSample622GW(sample, sampleLength);
-        break;
 
-    default:
-        qDebug() << "Unknown format" << mFormatCode;
-        break;
-    }
-    //qDebug() << mDevice->size() << mDevice->pos() << endpos << sampleLength;
-    Q_ASSERT(mDevice->pos() == endpos);
+    // First 4 bytes look to be always zeros
+    return parseSample(mFormatCode, mSampleData.constData() + 4, sampleLength - 4, sample);
+}
 
-    return rc;
+// Replaces the track contents with every complete buffered sample
+int GpsSampleParser::takeSamples(GpsTrack* track)
+{
+    Q_ASSERT(!mDevice);
+    Q_ASSERT(track != nullptr);
+    track->clear();
+
+    GpsSample sample;
+    while (takeSample(&sample))
+        track->append(sample);
+    return track->size();
 }
 
-quint16 GpsSampleParser::readUint16BE(bool* ok)
+bool GpsSampleParser::takeSample(GpsSample* sample)
 {
-    quint16 rc = 0;
-    unsigned char data[2];
-    bool ok_ = (mDevice->read((char*)data, 2) == 2);
-    if (ok)
-        *ok = ok_;
-    if (ok_)
+    while (!mFailed)
     {
-        rc = (data[0] << 8) + data[1];
+        const int available = int(mSampleData.size()) - mPendingPos;
+        if (available < 2)
+            return false;
+        const char* data = mSampleData.constData() + mPendingPos;
+        const quint16 sampleLength = readUint16BE(data);
+        if (sampleLength > available - 2)
+            return false;
+
+        mPendingPos += 2 + sampleLength;
+        if (sampleLength <= 4)
+            continue;
+
+        if (parseSample(mFormatCode, data + 6, sampleLength - 4, sample))
+            return true;
+
+        // Same as reading from a device, nothing after a bad sample is used
+        mFailed = true;
     }
-    return rc;
+    return false;
 }
 
-qint16 GpsSampleParser::readInt16LE(bool* ok)
+bool GpsSampleParser::parseBuffer(const QByteArray& data, const QString& name, GpsTrack* track)
 {
-    qint16 rc = 0;
-    unsigned char data[2];
-    bool ok_ = (mDevice->read((char*)data, 2) == 2);
-    if (ok)
-        *ok = ok_;
-    if (ok_)
+    Q_ASSERT(track != nullptr);
+    track->clear();
+
+    const int formatCode = cameraFormat(name.toLatin1().constData());
+    if (formatCode <= 0)
+        return false;
+
+    // Only the length prefixes need a sequential walk, every sample can then
+    // be decoded on its own. Samples without data are dropped, they never
+    // carry a fix.
+    QSharedPointer<DecodeJob> job(new DecodeJob);
+    const char* const begin = data.constData();
+    const int size = int(data.size());
+    bool complete = true;
+    int pos = 0;
+    while (pos < size)
     {
-        rc = (data[1] << 8) | data[0];
+        if (size - pos < 2)
+        {
+            qDebug() << "Failed to read sample length";
+            complete = false;
+            break;
+        }
+        const quint16 length = readUint16BE(begin + pos);
+        pos += 2;
+        if (length > size - pos)
+        {
+            qDebug() << "Not enough data remaining";
+            complete = false;
+            break;
+        }
+        if (length > 4)
+            job->offsets.append(pos);
+        pos += length;
     }
-    return rc;
-}
 
-qint32 GpsSampleParser::readInt32LE(bool* ok)
-{
-    qint32 rc = 0;
-    unsigned char data[4];
-    bool ok_ = (mDevice->read((char*)data, 4) == 4);
-    if (ok)
-        *ok = ok_;
-    if (ok_)
+    const int count = job->offsets.size();
+    track->resize(count);
+    QVector<char> decoded(count, 0);
+
+    QThreadPool* pool = QThreadPool::globalInstance();
+    job->formatCode = formatCode;
+    job->data = begin;
+    job->output = track;
+    job->decoded = decoded.data();
+    job->chunkSize = qMax(256, count / (qMax(1, pool->maxThreadCount()) * 4) + 1);
+    job->chunkCount = (count + job->chunkSize - 1) / job->chunkSize;
+    job->nextChunk.storeRelease(0);
+
+    // The calling thread works through the chunks as well, so this finishes
+    // even when the pool is busy. Workers starting late find nothing left.
+    const int workers = qMin(job->chunkCount, pool->maxThreadCount()) - 1;
+    for (int i = 0; i < workers; ++i)
+        pool->start(new DecodeTask(job));
+    job->decodeChunks();
+    job->chunksDone.acquire(job->chunkCount);
+
+    // Same as reading with nextSample, stop at the first sample that fails
+    const int failed = int(std::find(decoded.constBegin(), decoded.constEnd(), 0) - decoded.constBegin());
+    if (failed < count)
     {
-        rc = (data[3] << 24) | (data[2] << 16) | (data[1] << 8) | data[0];
+        qDebug() << "Failed to parse sample" << failed << "of" << count;
+        track->resize(failed);
+        complete = false;
     }
-    return rc;
+
+    return complete;
 }
 
+quint16 GpsSampleParser::readUint16BE(const char* data)
+{
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+    return quint16((p[0] << 8) | p[1]);
+}
 
-bool GpsSampleParser::parseSample322GW(GpsSample* sample, quint16 length)
+qint16 GpsSampleParser::readInt16LE(const char* data)
 {
-    Q_ASSERT(length == 284);
-    mDevice->skip(16);
-    bool xOk, yOk, zOk;
-    sample->yAcc = (readInt32LE(&yOk) / 1280.0f) * -1.0f;
-    sample->xAcc = readInt32LE(&xOk) / 1280.0f;
-    sample->zAcc = readInt32LE(&zOk) / 1280.0f;
-    if (!(xOk && yOk && zOk))
-    {
-        qDebug() << "Failed to read acceleration data";
-        return false;
-    }
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+    return qint16((p[1] << 8) | p[0]);
+}
 
-    char gprmc[129] = {0}; // 128 +1 for nul terminator
-    char gpgga[129] = {0};
-    if (mDevice->read(gprmc, 128) != 128)
-    {
-        qDebug() << "Failed to read GPRMC";
-        return false;
-    }
-    if (mDevice->read(gpgga, 128) != 128)
-    {
-        qDebug() << "Failed to read GPGGA";
-        return false;
-    }
+qint32 GpsSampleParser::readInt32LE(const char* data)
+{
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+    return qint32((quint32(p[3]) << 24) | (p[2] << 16) | (p[1] << 8) | p[0]);
+}
 
-    QString gprmcStr(QLatin1String(gprmc).trimmed());
-    QString gpggaStr(QLatin1String(gpgga).trimmed());
 
-    if (!parseGprmc(gprmcStr, sample))
+bool GpsSampleParser::parseSample(int formatCode, const char* data, int length, GpsSample* sample)
+{
+    sample->reset();
+    switch (formatCode)
     {
-        qDebug() << "Failed to parse GPRMC";
+    case 1:
+        return parseSample322GW(data, length, sample);
+    case 2:
+        return parseSample622GW(data, length, sample);
+
+    default:
+        qDebug() << "Unknown format" << formatCode;
         return false;
     }
-    if (!parseGpgga(gpggaStr, sample))
+}
+
+bool GpsSampleParser::parseSample322GW(const char* data, int length, GpsSample* sample)
+{
+    if (length != 284)
     {
-        qDebug() << "Failed to parse GPGGA";
+        qDebug() << "Unexpected sample length" << length;
         return false;
     }
 
-    return true;
+    sample->yAcc = (readInt32LE(data + 16) / 1280.0f) * -1.0f;
+    sample->xAcc = readInt32LE(data + 20) / 1280.0f;
+    sample->zAcc = readInt32LE(data + 24) / 1280.0f;
+
+    return parseNmeaPair(data + 28, sample);
 }
 
 // Untested
-bool GpsSampleParser::parseSample622GW(GpsSample* sample, quint16 length)
+bool GpsSampleParser::parseSample622GW(const char* data, int length, GpsSample* sample)
 {
-    Q_ASSERT(length == 1042);
-    mDevice->skip(24);
-    bool xOk, yOk, zOk;
-    sample->yAcc = (readInt16LE(&yOk) / 2048.0f) * -1.0f;
-    sample->xAcc = readInt16LE(&xOk) / 2048.0f;
-    sample->zAcc = readInt16LE(&zOk) / 2048.0f;
-    if (!(xOk && yOk && zOk))
-    {
-        qDebug() << "Failed to read acceleration data";
+    if (length != 1042)
+    {
+        qDebug() << "Unexpected sample length" << length;
         return false;
     }
 
-    mDevice->skip(756);
+    sample->yAcc = (readInt16LE(data + 24) / 2048.0f) * -1.0f;
+    sample->xAcc = readInt16LE(data + 26) / 2048.0f;
+    sample->zAcc = readInt16LE(data + 28) / 2048.0f;
 
-    char gprmc[129] = {0}; // 128 +1 for nul terminator
-    char gpgga[129] = {0};
-    if (mDevice->read(gprmc, 128) != 128)
-    {
-        qDebug() << "Failed to read GPRMC";
-        return false;
-    }
-    if (mDevice->read(gpgga, 128) != 128)
-    {
-        qDebug() << "Failed to read GPGGA";
-        return false;
-    }
+    return parseNmeaPair(data + 786, sample);
+}
 
-    QString gprmcStr(QLatin1String(gprmc).trimmed());
-    QString gpggaStr(QLatin1String(gpgga).trimmed());
+bool GpsSampleParser::parseNmeaPair(const char* data, GpsSample* sample)
+{
+    char gprmc[129]; // 128 +1 for nul terminator
+    char gpgga[129];
+    memcpy(gprmc, data, 128);
+    memcpy(gpgga, data + 128, 128);
+    gprmc[128] = gpgga[128] = 0;
 
-    if (!parseGprmc(gprmcStr, sample))
+    if (!parseGprmc(gprmc, sample))
     {
         qDebug() << "Failed to parse GPRMC";
         return false;
     }
-    if (!parseGpgga(gpggaStr, sample))
+    if (!parseGpgga(gpgga, sample))
     {
         qDebug() << "Failed to parse GPGGA";
         return false;
@@ -282,126 +627,83 @@ bool GpsSampleParser::parseSample622GW(GpsSample* sample, quint16 length)
 }
 
 
-bool GpsSampleParser::parseGprmc(const QString& line, GpsSample* sample)
+bool GpsSampleParser::parseGprmc(const char* line, GpsSample* sample)
 {
-    //qDebug() << line;
-
-    // Remove checksum, don't check it, never valid
-    QString lineData = line.contains('*') ? line.section('*', 0, 0) : line;
-    //qDebug() << lineData;
-
-    QStringList parts = lineData.split(',');
-    //qDebug() << parts;
-    if (parts.size() != 13 || parts.at(0) != "$GPRMC")
+    NmeaField parts[maxNmeaFields];
+    if (splitNmea(line, parts) != 13 || !parts[0].equals("$GPRMC"))
     {
         qDebug() << "Failed to split GPRMC";
         return false;
     }
 
-    if (parts.at(1).isEmpty() || parts.at(9).isEmpty())
+    if (parts[1].isEmpty() || parts[9].isEmpty())
         return true;
 
-    QTime time(QTime::fromString(parts.at(1), "HHmmss.zzz"));
-    if (!time.isValid())
+    qint64 msecs = 0;
+    if (!parseNmeaTime(parts[1], &msecs))
     {
-        qDebug() << "Time is invalid" << parts.at(1);
+        qDebug() << "Time is invalid" << parts[1].toLatin1();
         return false;
     }
 
-    QDate date(QDate::fromString(parts[9].insert(4, "20"), "ddMMyyyy"));
-    if (!date.isValid())
+    qint64 days = 0;
+    if (!parseNmeaDate(parts[9], &days))
     {
-        qDebug() << "Date is invalid" << parts[9];
+        qDebug() << "Date is invalid" << parts[9].toLatin1();
         return false;
     }
 
-    sample->datetime = QDateTime(date, time, QTimeZone::utc());
+    sample->datetime = QDateTime::fromMSecsSinceEpoch(days * msecsPerDay + msecs, utcTimeSpec());
     if (!sample->datetime.isValid())
     {
         qDebug() << "Date time is invalid";
         return false;
     }
-    //qDebug() << sample->datetime;
 
-    sample->gpsValid = (parts[2] == "A");
+    sample->gpsValid = parts[2].equals("A");
 
     if (sample->gpsValid)
     {
-        if (!parseCoord(parts[3], sample->latitude))
+        if (!parseCoord(parts[3], &sample->latitude))
         {
             qDebug() << "Failed to parse latitude";
             return false;
         }
-        sample->latitude *= (parts[4] == "N") ? 1.0f : -1.0f;
+        sample->latitude *= parts[4].equals("N") ? 1.0 : -1.0;
 
-        if (!parseCoord(parts[5], sample->longitude))
+        if (!parseCoord(parts[5], &sample->longitude))
         {
             qDebug() << "Failed to parse longitude";
             return false;
         }
-        sample->longitude *= (parts[6] == "E") ? 1.0f : -1.0f;
-
-
-        sample->speed = parts[7].toFloat() * 0.514444f; // Knots to meters/sec
-        sample->bearing = parts[8].toFloat();
+        sample->longitude *= parts[6].equals("E") ? 1.0 : -1.0;
 
-        //qDebug() << sample->latitude << sample->longitude << sample->speed << sample->bearing;
+        sample->speed = float(parts[7].toDouble()) * 0.514444f; // Knots to meters/sec
+        sample->bearing = float(parts[8].toDouble());
     }
 
     return true;
 }
 
-bool GpsSampleParser::parseGpgga(const QString& line, GpsSample* sample)
+bool GpsSampleParser::parseGpgga(const char* line, GpsSample* sample)
 {
-    //qDebug() << line;
-
-    // Remove checksum, don't check it, never valid
-    QString lineData = line.contains('*') ? line.section('*', 0, 0) : line;
-    //qDebug() << lineData;
-
-    QStringList parts = lineData.split(',');
-    //qDebug() << parts;
-    if (parts.size() != 15 || parts.at(0) != "$GPGGA")
+    NmeaField parts[maxNmeaFields];
+    if (splitNmea(line, parts) != 15 || !parts[0].equals("$GPGGA"))
     {
         qDebug() << "Failed to split GPGGA";
         return false;
     }
 
-    if (parts.at(1).isEmpty())
+    if (parts[1].isEmpty())
         return true;
 
-    int fix = parts.at(6).toInt();
+    int fix = parts[6].toInt();
     if (fix > 0)
     {
-        sample->sats = parts.at(7).toInt();
-        sample->hdop = parts.at(8).toFloat();
-        sample->altitude = parts.at(9).toFloat();
-        sample->geoidheight = parts.at(11).toFloat();
-        //qDebug() << "SATS" << sample->sats << "HDOP" << sample->hdop << "ALT" << sample->altitude;
+        sample->sats = parts[7].toInt();
+        sample->hdop = float(parts[8].toDouble());
+        sample->altitude = float(parts[9].toDouble());
+        sample->geoidheight = float(parts[11].toDouble());
     }
     return true;
 }
-
-
-
-bool GpsSampleParser::parseCoord(const QString& part, float& output)
-{
-    if (part.isEmpty())
-        return false;
-
-    QRegularExpressionMatch match = mCoordRegEx.match(part);
-    bool dOk, mOk;
-    int deg = match.captured(1).toInt(&dOk);
-    float min = match.captured(2).toFloat(&mOk);
-    //qDebug() << deg << min;
-
-    if (!(dOk && mOk))
-    {
-       qDebug() << "Failed to parse coordinate" << part;
-       return false;
-    }
-
-    output = deg + (min / 60.0f);
-    return true;
-}
-
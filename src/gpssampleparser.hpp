@@ -21,14 +21,15 @@
 
 #include <QIODevice>
 #include <QDateTime>
-#include <QRegularExpression>
+
+class GpsTrack;
 
 struct GpsSample
 {
     QDateTime datetime;
     bool gpsValid;
-    float latitude; // + N / - S
-    float longitude; // + E / - W
+    double latitude; // + N / - S
+    double longitude; // + E / - W
     float speed; // Meters/sec
     float bearing; // Degrees from true north
     float xAcc;
@@ -47,27 +48,46 @@ class GpsSampleParser
 public:
     static bool isCameraSupported(const QString& name);
 
+    // Decodes a whole subtitle stream on the global thread pool, samples are
+    // stored in stream order. Returns false if the stream could not be
+    // decoded to the end, the track holds everything before the failure.
+    static bool parseBuffer(const QByteArray& data, const QString& name, GpsTrack* track);
+
     GpsSampleParser(QIODevice* device, const QString& name);
     bool isValid() const;
 
+    // Without a device the stream is fed in pieces as it arrives, nextSample
+    // then returns false once no complete sample is buffered
+    explicit GpsSampleParser(const QString& name);
+    void addData(const char* data, int size);
+    int takeSamples(GpsTrack* track);
+
     bool nextSample(GpsSample* sample);
 
 private:
+    struct DecodeJob;
+    class DecodeTask;
+
     static int cameraFormat(const char* name);
-    quint16 readUint16BE(bool* ok);
-    qint16 readInt16LE(bool* ok);
-    qint32 readInt32LE(bool* ok);
+    static quint16 readUint16BE(const char* data);
+    static qint16 readInt16LE(const char* data);
+    static qint32 readInt32LE(const char* data);
+
+    static bool parseSample(int formatCode, const char* data, int length, GpsSample* sample);
+    static bool parseSample322GW(const char* data, int length, GpsSample* sample);
+    static bool parseSample622GW(const char* data, int length, GpsSample* sample);
+    static bool parseNmeaPair(const char* data, GpsSample* sample);
 
-    bool parseSample322GW(GpsSample* sample, quint16 length);
-    bool parseSample622GW(GpsSample* sample, quint16 length);
+    static bool parseGprmc(const char* line, GpsSample* sample);
+    static bool parseGpgga(const char* line, GpsSample* sample);
 
-    bool parseGprmc(const QString& line, GpsSample* sample);
-    bool parseGpgga(const QString& line, GpsSample* sample);
-    bool parseCoord(const QString& part, float& output);
+    bool takeSample(GpsSample* sample);
 
     QIODevice* mDevice;
     int mFormatCode;
-    QRegularExpression mCoordRegEx;
+    QByteArray mSampleData; // Current sample, or unparsed stream data without a device
+    int mPendingPos;
+    bool mFailed;
 };
 
 #endif // GPSSAMPLEPARSER_HPP
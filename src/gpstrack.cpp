@@ -0,0 +1,156 @@
+/* Copyright 2021-2023 Silas Parker.
+ *
+ * This file is part of NB Dashcam Tools.
+ *
+ * NB Dashcam Tools is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * NB Dashcam Tools is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NB Dashcam Tools. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "gpstrack.hpp"
+
+#include <QTimeZone>
+
+const double GpsTrack::coordScale = 1e7;
+
+static qint32 toFixed(double degrees)
+{
+    return qIsNaN(degrees) ? 0 : qint32(qRound64(degrees * GpsTrack::coordScale));
+}
+
+
+GpsTrack::GpsTrack() :
+    mFlags(),
+    mTime(),
+    mLatitude(),
+    mLongitude(),
+    mSpeed(),
+    mBearing(),
+    mXAcc(),
+    mYAcc(),
+    mZAcc(),
+    mHdop(),
+    mAltitude(),
+    mGeoidHeight(),
+    mSats()
+{}
+
+void GpsTrack::clear()
+{
+    resize(0);
+}
+
+void GpsTrack::reserve(int size)
+{
+    mFlags.reserve(size);
+    mTime.reserve(size);
+    mLatitude.reserve(size);
+    mLongitude.reserve(size);
+    mSpeed.reserve(size);
+    mBearing.reserve(size);
+    mXAcc.reserve(size);
+    mYAcc.reserve(size);
+    mZAcc.reserve(size);
+    mHdop.reserve(size);
+    mAltitude.reserve(size);
+    mGeoidHeight.reserve(size);
+    mSats.reserve(size);
+}
+
+void GpsTrack::resize(int size)
+{
+    mFlags.resize(size);
+    mTime.resize(size);
+    mLatitude.resize(size);
+    mLongitude.resize(size);
+    mSpeed.resize(size);
+    mBearing.resize(size);
+    mXAcc.resize(size);
+    mYAcc.resize(size);
+    mZAcc.resize(size);
+    mHdop.resize(size);
+    mAltitude.resize(size);
+    mGeoidHeight.resize(size);
+    mSats.resize(size);
+}
+
+void GpsTrack::append(const GpsSample& sample)
+{
+    resize(size() + 1);
+    set(size() - 1, sample);
+}
+
+void GpsTrack::set(int index, const GpsSample& sample)
+{
+    Q_ASSERT(index >= 0 && index < size());
+
+    const GpsTrackPoint p = GpsTrackPoint::fromSample(sample);
+    mFlags[index] = p.flags;
+    mTime[index] = p.time;
+    mLatitude[index] = toFixed(p.latitude);
+    mLongitude[index] = toFixed(p.longitude);
+    mSpeed[index] = p.speed;
+    mBearing[index] = p.bearing;
+    mXAcc[index] = p.xAcc;
+    mYAcc[index] = p.yAcc;
+    mZAcc[index] = p.zAcc;
+    mHdop[index] = p.hdop;
+    mAltitude[index] = p.altitude;
+    mGeoidHeight[index] = p.geoidHeight;
+    mSats[index] = quint8(qBound(0, p.sats, 255));
+}
+
+void GpsTrack::sample(int index, GpsSample* sample) const
+{
+    Q_ASSERT(sample);
+    Q_ASSERT(index >= 0 && index < size());
+
+    const quint8 flags = mFlags.at(index);
+    sample->datetime = (flags & TimeValid) ?
+        QDateTime::fromMSecsSinceEpoch(mTime.at(index), QTimeZone::utc()) : QDateTime();
+    sample->gpsValid = (flags & GpsValid) != 0;
+    sample->latitude = sample->gpsValid ? latitude(index) : qQNaN();
+    sample->longitude = sample->gpsValid ? longitude(index) : qQNaN();
+    sample->speed = mSpeed.at(index);
+    sample->bearing = mBearing.at(index);
+    sample->xAcc = mXAcc.at(index);
+    sample->yAcc = mYAcc.at(index);
+    sample->zAcc = mZAcc.at(index);
+    sample->hdop = mHdop.at(index);
+    sample->altitude = mAltitude.at(index);
+    sample->geoidheight = mGeoidHeight.at(index);
+    sample->sats = mSats.at(index);
+}
+
+
+GpsTrackPoint GpsTrackPoint::fromSample(const GpsSample& sample)
+{
+    GpsTrackPoint p;
+    p.flags = 0;
+    if (sample.datetime.isValid())
+        p.flags |= GpsTrack::TimeValid;
+    if (sample.gpsValid)
+        p.flags |= GpsTrack::GpsValid;
+    p.time = p.isTimeValid() ? sample.datetime.toMSecsSinceEpoch() : 0;
+    p.latitude = sample.latitude;
+    p.longitude = sample.longitude;
+    p.speed = sample.speed;
+    p.bearing = sample.bearing;
+    p.xAcc = sample.xAcc;
+    p.yAcc = sample.yAcc;
+    p.zAcc = sample.zAcc;
+    p.hdop = sample.hdop;
+    p.altitude = sample.altitude;
+    p.geoidHeight = sample.geoidheight;
+    p.sats = sample.sats;
+    return p;
+}
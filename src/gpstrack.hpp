@@ -0,0 +1,134 @@
+/* Copyright 2021-2023 Silas Parker.
+ *
+ * This file is part of NB Dashcam Tools.
+ *
+ * NB Dashcam Tools is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * NB Dashcam Tools is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NB Dashcam Tools. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef GPSTRACK_HPP
+#define GPSTRACK_HPP
+
+#include <QVector>
+
+#include "gpssampleparser.hpp"
+
+struct GpsTrackPoint;
+
+// Decoded samples stored column by column. Times are milliseconds since the
+// epoch in UTC and coordinates are fixed point in 1e-7 degree units, which
+// keeps a sample at 50 bytes and lets passes over one column vectorise.
+class GpsTrack
+{
+public:
+    enum Flag : quint8
+    {
+        TimeValid = 0x01,
+        GpsValid = 0x02
+    };
+
+    static const double coordScale;
+
+    GpsTrack();
+
+    int size() const {return mFlags.size();}
+    bool isEmpty() const {return mFlags.isEmpty();}
+    void clear();
+    void reserve(int size);
+    void resize(int size);
+
+    void append(const GpsSample& sample);
+    void set(int index, const GpsSample& sample);
+    void sample(int index, GpsSample* sample) const;
+    inline GpsTrackPoint point(int index) const;
+
+    quint8 flags(int index) const {return mFlags.at(index);}
+    bool isTimeValid(int index) const {return (mFlags.at(index) & TimeValid) != 0;}
+    bool isGpsValid(int index) const {return (mFlags.at(index) & GpsValid) != 0;}
+    qint64 time(int index) const {return mTime.at(index);}
+    double latitude(int index) const {return mLatitude.at(index) / coordScale;}
+    double longitude(int index) const {return mLongitude.at(index) / coordScale;}
+
+    const QVector<quint8>& flagColumn() const {return mFlags;}
+    const QVector<qint64>& timeColumn() const {return mTime;}
+    const QVector<qint32>& latitudeColumn() const {return mLatitude;}
+    const QVector<qint32>& longitudeColumn() const {return mLongitude;}
+    const QVector<float>& speedColumn() const {return mSpeed;}
+    const QVector<float>& bearingColumn() const {return mBearing;}
+    const QVector<float>& xAccColumn() const {return mXAcc;}
+    const QVector<float>& yAccColumn() const {return mYAcc;}
+    const QVector<float>& zAccColumn() const {return mZAcc;}
+    const QVector<float>& hdopColumn() const {return mHdop;}
+    const QVector<float>& altitudeColumn() const {return mAltitude;}
+    const QVector<float>& geoidHeightColumn() const {return mGeoidHeight;}
+    const QVector<quint8>& satsColumn() const {return mSats;}
+
+private:
+    QVector<quint8> mFlags;
+    QVector<qint64> mTime;
+    QVector<qint32> mLatitude;
+    QVector<qint32> mLongitude;
+    QVector<float> mSpeed;
+    QVector<float> mBearing;
+    QVector<float> mXAcc;
+    QVector<float> mYAcc;
+    QVector<float> mZAcc;
+    QVector<float> mHdop;
+    QVector<float> mAltitude;
+    QVector<float> mGeoidHeight;
+    QVector<quint8> mSats;
+};
+
+// One row of a track as plain values, the common input of the exporters
+struct GpsTrackPoint
+{
+    quint8 flags;
+    qint64 time;
+    double latitude; // NaN without a fix
+    double longitude;
+    float speed;
+    float bearing;
+    float xAcc;
+    float yAcc;
+    float zAcc;
+    float hdop;
+    float altitude;
+    float geoidHeight;
+    int sats;
+
+    bool isTimeValid() const {return (flags & GpsTrack::TimeValid) != 0;}
+    bool isGpsValid() const {return (flags & GpsTrack::GpsValid) != 0;}
+
+    static GpsTrackPoint fromSample(const GpsSample& sample);
+};
+
+GpsTrackPoint GpsTrack::point(int index) const
+{
+    GpsTrackPoint p;
+    p.flags = mFlags.at(index);
+    p.time = mTime.at(index);
+    p.latitude = p.isGpsValid() ? latitude(index) : qQNaN();
+    p.longitude = p.isGpsValid() ? longitude(index) : qQNaN();
+    p.speed = mSpeed.at(index);
+    p.bearing = mBearing.at(index);
+    p.xAcc = mXAcc.at(index);
+    p.yAcc = mYAcc.at(index);
+    p.zAcc = mZAcc.at(index);
+    p.hdop = mHdop.at(index);
+    p.altitude = mAltitude.at(index);
+    p.geoidHeight = mGeoidHeight.at(index);
+    p.sats = mSats.at(index);
+    return p;
+}
+
+#endif // GPSTRACK_HPP
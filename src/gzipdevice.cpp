@@ -0,0 +1,205 @@
+/* Copyright 2021-2023 Silas Parker.
+ *
+ * This file is part of NB Dashcam Tools.
+ *
+ * NB Dashcam Tools is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * NB Dashcam Tools is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NB Dashcam Tools. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "gzipdevice.hpp"
+
+#include <QDebug>
+#include <QThread>
+
+#include <cstring>
+#include <limits>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+// Blocks waiting to be compressed, writers stall once this many are queued
+static const int maxQueuedBlocks = 4;
+static const int outputBlockSize = 256 * 1024;
+
+
+class GzipDevice::Worker : public QThread
+{
+public:
+    explicit Worker(GzipDevice* device) :
+        mDevice(device)
+    {}
+
+protected:
+    void run() override
+    {
+        mDevice->compress();
+    }
+
+private:
+    GzipDevice* mDevice;
+};
+
+
+GzipDevice::GzipDevice(QIODevice* target, int level, QObject* parent) :
+    QIODevice(parent),
+    mTarget(target),
+    mLevel(qBound(1, level, 9)),
+    mMutex(),
+    mQueued(),
+    mTaken(),
+    mQueue(),
+    mFinishing(false),
+    mError(false),
+    mWorker(nullptr)
+{}
+
+GzipDevice::~GzipDevice()
+{
+    close();
+}
+
+bool GzipDevice::isAvailable()
+{
+#ifdef HAVE_ZLIB
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool GzipDevice::open(OpenMode mode)
+{
+    if (!isAvailable() || isOpen() || (mode & ReadOnly) || !(mode & WriteOnly))
+        return false;
+    if (!(mTarget && mTarget->isOpen() && mTarget->isWritable()))
+        return false;
+
+    mFinishing = false;
+    mError = false;
+    mQueue.clear();
+    mWorker = new Worker(this);
+    mWorker->start();
+    return QIODevice::open(mode | Unbuffered);
+}
+
+void GzipDevice::close()
+{
+    if (!isOpen())
+        return;
+
+    {
+        QMutexLocker lock(&mMutex);
+        mFinishing = true;
+        mQueued.wakeAll();
+    }
+    mWorker->wait();
+    delete mWorker;
+    mWorker = nullptr;
+    QIODevice::close();
+}
+
+bool GzipDevice::hasError() const
+{
+    QMutexLocker lock(&mMutex);
+    return mError;
+}
+
+qint64 GzipDevice::readData(char* data, qint64 maxSize)
+{
+    Q_UNUSED(data);
+    Q_UNUSED(maxSize);
+    return -1;
+}
+
+qint64 GzipDevice::writeData(const char* data, qint64 size)
+{
+    if (size > std::numeric_limits<int>::max())
+        size = std::numeric_limits<int>::max();
+
+    QByteArray block(data, int(size));
+    QMutexLocker lock(&mMutex);
+    while (mQueue.size() >= maxQueuedBlocks && !mError)
+        mTaken.wait(&mMutex);
+    if (mError)
+        return -1;
+    mQueue.enqueue(block);
+    mQueued.wakeOne();
+    return size;
+}
+
+void GzipDevice::compress()
+{
+#ifdef HAVE_ZLIB
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    // 16 added to the window bits selects a gzip header and trailer
+    if (deflateInit2(&stream, mLevel, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        qWarning() << "Failed to initialise compressor";
+        QMutexLocker lock(&mMutex);
+        mError = true;
+        mTaken.wakeAll();
+        return;
+    }
+
+    QByteArray output(outputBlockSize, Qt::Uninitialized);
+    bool ok = true;
+    bool finished = false;
+    while (ok && !finished)
+    {
+        QByteArray block;
+        {
+            QMutexLocker lock(&mMutex);
+            while (mQueue.isEmpty() && !mFinishing)
+                mQueued.wait(&mMutex);
+            if (!mQueue.isEmpty())
+            {
+                block = mQueue.dequeue();
+                mTaken.wakeOne();
+            }
+            else
+            {
+                finished = true;
+            }
+        }
+
+        const int flush = finished ? Z_FINISH : Z_NO_FLUSH;
+        stream.next_in = reinterpret_cast<Bytef*>(block.data());
+        stream.avail_in = uInt(block.size());
+        int rc = Z_OK;
+        do
+        {
+            stream.next_out = reinterpret_cast<Bytef*>(output.data());
+            stream.avail_out = uInt(output.size());
+            rc = deflate(&stream, flush);
+            const qint64 produced = output.size() - qint64(stream.avail_out);
+            if (rc == Z_STREAM_ERROR || (produced > 0 && mTarget->write(output.constData(), produced) != produced))
+            {
+                qWarning() << "Failed to write compressed output";
+                ok = false;
+                break;
+            }
+        } while (stream.avail_out == 0 || (finished && rc != Z_STREAM_END));
+    }
+    deflateEnd(&stream);
+
+    if (!ok)
+    {
+        QMutexLocker lock(&mMutex);
+        mError = true;
+        mQueue.clear();
+        mTaken.wakeAll();
+    }
+#endif
+}
@@ -0,0 +1,67 @@
+/* Copyright 2021-2023 Silas Parker.
+ *
+ * This file is part of NB Dashcam Tools.
+ *
+ * NB Dashcam Tools is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * NB Dashcam Tools is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NB Dashcam Tools. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef GZIPDEVICE_HPP
+#define GZIPDEVICE_HPP
+
+#include <QIODevice>
+#include <QMutex>
+#include <QQueue>
+#include <QWaitCondition>
+
+class QThread;
+
+// Write only device that gzip compresses into another device. Compression
+// and writing to the target run on a thread of their own, close() waits for
+// them and writes the gzip trailer.
+class GzipDevice : public QIODevice
+{
+    Q_OBJECT
+
+public:
+    GzipDevice(QIODevice* target, int level, QObject* parent = nullptr);
+    ~GzipDevice();
+
+    static bool isAvailable();
+
+    bool open(OpenMode mode) override;
+    void close() override;
+    bool isSequential() const override {return true;}
+    bool hasError() const;
+
+protected:
+    qint64 readData(char* data, qint64 maxSize) override;
+    qint64 writeData(const char* data, qint64 size) override;
+
+private:
+    class Worker;
+
+    void compress();
+
+    QIODevice* mTarget;
+    int mLevel;
+    mutable QMutex mMutex;
+    QWaitCondition mQueued;
+    QWaitCondition mTaken;
+    QQueue<QByteArray> mQueue;
+    bool mFinishing;
+    bool mError;
+    QThread* mWorker;
+};
+
+#endif // GZIPDEVICE_HPP
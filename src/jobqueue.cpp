@@ -0,0 +1,343 @@
+/* Copyright 2021-2023 Silas Parker.
+ *
+ * This file is part of NB Dashcam Tools.
+ *
+ * NB Dashcam Tools is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * NB Dashcam Tools is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NB Dashcam Tools. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "jobqueue.hpp"
+
+#include <QDebug>
+#include <QThread>
+
+#include "gpsclipexporter.hpp"
+
+
+JobQueue::Job::Job() :
+    kind(JobMerge),
+    resource(ResourceDisk),
+    state(JobQueued),
+    permille(0),
+    output(),
+    errMsg(),
+    inputs(),
+    encode(ClipMerger::VideoEncodeCopy),
+    quality(30),
+    includeGps(true),
+    splitEncode(false),
+    formats(),
+    options(),
+    merger(nullptr),
+    exporter(nullptr)
+{
+}
+
+
+JobQueue::JobQueue(QObject* parent) :
+    QObject(parent),
+    mJobs(),
+    mBatchStart(0)
+{
+    for (int resource = 0; resource < ResourceCount; ++resource)
+    {
+        mMaxJobs[resource] = defaultMaxJobs(Resource(resource));
+        mRunning[resource] = 0;
+    }
+}
+
+JobQueue::~JobQueue()
+{
+    // Running jobs are children, they stop their tools when deleted
+}
+
+int JobQueue::defaultMaxJobs(Resource resource)
+{
+    switch (resource)
+    {
+    case ResourceDisk:
+        // Copying is limited by the disk, more streams only add seeking
+        return 2;
+    case ResourceCpu:
+        // libx264 keeps around 8 threads busy on dashcam resolutions, run
+        // enough encodes side by side to fill the rest of the cores
+        return qMax(1, QThread::idealThreadCount() / 8);
+    case ResourceGpu:
+        // Consumer cards and QSV only allow a few encode sessions
+        return 2;
+    case ResourceCount:
+        break;
+    }
+    return 1;
+}
+
+void JobQueue::setMaxJobs(Resource resource, int count)
+{
+    mMaxJobs[resource] = qMax(1, count);
+    QMetaObject::invokeMethod(this, &JobQueue::schedule, Qt::QueuedConnection);
+}
+
+int JobQueue::addMerge(
+    const QStringList& inputs, const QString& output,
+    ClipMerger::VideoEncode encode, int quality, bool includeGps, bool splitEncode)
+{
+    Job job;
+    job.kind = JobMerge;
+    switch (encode)
+    {
+    case ClipMerger::VideoEncodeCopy:
+        job.resource = ResourceDisk;
+        break;
+    case ClipMerger::VideoEncodeSoftware:
+        job.resource = ResourceCpu;
+        break;
+    case ClipMerger::VideoEncodeNVidia:
+    case ClipMerger::VideoEncodeQsv:
+        job.resource = ResourceGpu;
+        break;
+    }
+    job.output = output;
+    job.inputs = inputs;
+    job.encode = encode;
+    job.quality = quality;
+    job.includeGps = includeGps;
+    job.splitEncode = splitEncode;
+    return addJob(job);
+}
+
+int JobQueue::addExport(
+    const QString& input, const QString& output,
+    const QVector<GpsExportFormat>& formats, const GpsExportOptions& options)
+{
+    Job job;
+    job.kind = JobExport;
+    job.resource = ResourceDisk;
+    job.output = output;
+    job.inputs << input;
+    job.formats = formats;
+    job.options = options;
+    return addJob(job);
+}
+
+void JobQueue::cancel(int id)
+{
+    Job& job = mJobs[id];
+    if (job.state == JobRunning)
+    {
+        // Finishes through jobDone once the tools have stopped
+        if (job.merger)
+            job.merger->cancel();
+        if (job.exporter)
+            job.exporter->cancel();
+        return;
+    }
+    if (job.state != JobQueued)
+        return;
+
+    job.state = JobCancelled;
+    job.permille = 1000;
+    emit jobFinished(id, false);
+    updateProgress();
+    if (isIdle())
+        emit idle();
+}
+
+void JobQueue::cancelAll()
+{
+    // Queued jobs first, so none start as the running ones stop
+    for (int id = 0; id < mJobs.size(); ++id)
+    {
+        if (mJobs.at(id).state == JobQueued)
+            cancel(id);
+    }
+    for (int id = 0; id < mJobs.size(); ++id)
+    {
+        if (mJobs.at(id).state == JobRunning)
+            cancel(id);
+    }
+}
+
+bool JobQueue::hasPendingOutput(const QString& output) const
+{
+    for (const Job& job : mJobs)
+    {
+        if ((job.state == JobQueued || job.state == JobRunning) && job.output == output)
+            return true;
+    }
+    return false;
+}
+
+int JobQueue::runningCount() const
+{
+    int count = 0;
+    for (int resource = 0; resource < ResourceCount; ++resource)
+    {
+        count += mRunning[resource];
+    }
+    return count;
+}
+
+int JobQueue::queuedCount() const
+{
+    int count = 0;
+    for (const Job& job : mJobs)
+    {
+        if (job.state == JobQueued)
+            ++count;
+    }
+    return count;
+}
+
+int JobQueue::addJob(const Job& job)
+{
+    // Overall progress covers the jobs added since the queue was last idle
+    if (isIdle())
+        mBatchStart = mJobs.size();
+
+    const int id = mJobs.size();
+    mJobs.append(job);
+    updateProgress();
+
+    // Started from the event loop so the caller has the id first
+    QMetaObject::invokeMethod(this, &JobQueue::schedule, Qt::QueuedConnection);
+    return id;
+}
+
+void JobQueue::schedule()
+{
+    // Jobs start in the order added, a job waiting on a busy resource does
+    // not hold up jobs for the others
+    for (int id = 0; id < mJobs.size(); ++id)
+    {
+        const Job& job = mJobs.at(id);
+        if (job.state == JobQueued && mRunning[job.resource] < mMaxJobs[job.resource])
+            startJob(id);
+    }
+}
+
+void JobQueue::startJob(int id)
+{
+    Job& job = mJobs[id];
+    job.state = JobRunning;
+    ++mRunning[job.resource];
+    qDebug() << "Starting job" << id << job.output;
+
+    if (job.kind == JobMerge)
+    {
+        // Cores are shared out between the encodes allowed to run at once
+        const int threads = job.resource == ResourceCpu
+            ? qMax(1, QThread::idealThreadCount() / mMaxJobs[ResourceCpu]) : 0;
+
+        ClipMerger* merger = new ClipMerger(this);
+        merger->setInputs(job.inputs);
+        merger->setOutput(job.output);
+        merger->setVideoEncode(job.encode);
+        merger->setQuality(job.quality);
+        merger->setIncludeGps(job.includeGps);
+        merger->setThreads(threads);
+        merger->setSegments(job.splitEncode ? 0 : 1);
+
+        connect(merger, &ClipMerger::progress, this, [this, id](int value, int maximum, const QString& status)
+        {
+            mergeProgress(id, value, maximum, status);
+        });
+        connect(merger, &ClipMerger::finished, this, [this, id](bool ok)
+        {
+            jobDone(id, ok);
+        });
+
+        job.merger = merger;
+        merger->start();
+    }
+    else
+    {
+        GpsClipExporter* exporter = new GpsClipExporter(this);
+        exporter->setInput(job.inputs.value(0));
+        exporter->setOutput(job.output);
+        exporter->setFormats(job.formats);
+        exporter->setOptions(job.options);
+
+        connect(exporter, &GpsClipExporter::finished, this, [this, id](bool ok)
+        {
+            jobDone(id, ok);
+        });
+
+        job.exporter = exporter;
+        exporter->start();
+    }
+
+    emit jobStarted(id);
+}
+
+void JobQueue::mergeProgress(int id, int value, int maximum, const QString& status)
+{
+    if (maximum <= 0)
+        return;
+
+    // Probing is quick next to the merge, give it the first tenth
+    Job& job = mJobs[id];
+    const int permille = int((qint64(qBound(0, value, maximum)) * 1000) / maximum);
+    if (job.merger->stage() == ClipMerger::StageProbe)
+        job.permille = permille / 10;
+    else
+        job.permille = 100 + (permille * 9) / 10;
+
+    emit jobProgress(id, status);
+    updateProgress();
+}
+
+void JobQueue::jobDone(int id, bool ok)
+{
+    Job& job = mJobs[id];
+    bool cancelled = false;
+    if (job.merger)
+    {
+        cancelled = job.merger->wasCancelled();
+        job.errMsg = job.merger->errorString();
+        job.merger->deleteLater();
+        job.merger = nullptr;
+    }
+    if (job.exporter)
+    {
+        cancelled = job.exporter->wasCancelled();
+        job.errMsg = job.exporter->errorString();
+        job.exporter->deleteLater();
+        job.exporter = nullptr;
+    }
+
+    --mRunning[job.resource];
+    job.permille = 1000;
+    if (ok)
+        job.state = JobSucceeded;
+    else if (cancelled)
+        job.state = JobCancelled;
+    else
+        job.state = JobFailed;
+    qDebug() << "Finished job" << id << job.output << job.state << job.errMsg;
+
+    emit jobFinished(id, ok);
+    updateProgress();
+    schedule();
+    if (isIdle())
+        emit idle();
+}
+
+void JobQueue::updateProgress()
+{
+    int value = 0;
+    for (int id = mBatchStart; id < mJobs.size(); ++id)
+    {
+        value += mJobs.at(id).permille;
+    }
+    emit progress(value, (mJobs.size() - mBatchStart) * 1000);
+}
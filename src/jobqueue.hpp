@@ -0,0 +1,133 @@
+/* Copyright 2021-2023 Silas Parker.
+ *
+ * This file is part of NB Dashcam Tools.
+ *
+ * NB Dashcam Tools is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * NB Dashcam Tools is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NB Dashcam Tools. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef JOBQUEUE_HPP
+#define JOBQUEUE_HPP
+
+#include <QObject>
+#include <QStringList>
+#include <QVector>
+
+#include "clipmerger.hpp"
+#include "gpsexport.hpp"
+
+class GpsClipExporter;
+
+// Runs merges and GPS exports side by side. Each job is counted against the
+// resource it mostly uses and every resource has its own limit, so copy
+// merges are not held up by encodes and encodes do not fight over cores.
+class JobQueue : public QObject
+{
+    Q_OBJECT
+
+public:
+    enum Resource
+    {
+        ResourceDisk = 0, // Copy merges and exports
+        ResourceCpu,      // libx264
+        ResourceGpu,      // NVENC and QSV sessions
+        ResourceCount
+    };
+
+    enum JobState
+    {
+        JobQueued = 0,
+        JobRunning,
+        JobSucceeded,
+        JobFailed,
+        JobCancelled
+    };
+
+    explicit JobQueue(QObject* parent = nullptr);
+    ~JobQueue();
+
+    static int defaultMaxJobs(Resource resource);
+    void setMaxJobs(Resource resource, int count);
+    int maxJobs(Resource resource) const {return mMaxJobs[resource];}
+
+    int addMerge(
+        const QStringList& inputs, const QString& output,
+        ClipMerger::VideoEncode encode, int quality, bool includeGps, bool splitEncode = false);
+    int addExport(
+        const QString& input, const QString& output,
+        const QVector<GpsExportFormat>& formats, const GpsExportOptions& options);
+
+    void cancel(int id);
+    void cancelAll();
+
+    int jobCount() const {return mJobs.size();}
+    JobState state(int id) const {return mJobs.at(id).state;}
+    const QString& output(int id) const {return mJobs.at(id).output;}
+    const QString& errorString(int id) const {return mJobs.at(id).errMsg;}
+    bool hasPendingOutput(const QString& output) const;
+    int runningCount() const;
+    int queuedCount() const;
+    bool isIdle() const {return runningCount() == 0 && queuedCount() == 0;}
+
+signals:
+    void jobStarted(int id);
+    void jobProgress(int id, const QString& status);
+    void jobFinished(int id, bool ok);
+    void progress(int value, int maximum);
+    void idle();
+
+private:
+    enum JobKind
+    {
+        JobMerge = 0,
+        JobExport
+    };
+
+    struct Job
+    {
+        JobKind kind;
+        Resource resource;
+        JobState state;
+        int permille;
+        QString output;
+        QString errMsg;
+
+        QStringList inputs;
+        ClipMerger::VideoEncode encode;
+        int quality;
+        bool includeGps;
+        bool splitEncode;
+
+        QVector<GpsExportFormat> formats;
+        GpsExportOptions options;
+
+        ClipMerger* merger;
+        GpsClipExporter* exporter;
+
+        Job();
+    };
+
+    int addJob(const Job& job);
+    void schedule();
+    void startJob(int id);
+    void mergeProgress(int id, int value, int maximum, const QString& status);
+    void jobDone(int id, bool ok);
+    void updateProgress();
+
+    QVector<Job> mJobs;
+    int mBatchStart;
+    int mMaxJobs[ResourceCount];
+    int mRunning[ResourceCount];
+};
+
+#endif // JOBQUEUE_HPP
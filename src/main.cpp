@@ -21,15 +21,37 @@
 #include <QApplication>
 #include <QMessageBox>
 
+#include "clipcache.hpp"
+#include "commandline.hpp"
 #include "toollocator.hpp"
 
-int main(int argc, char *argv[])
+static void setApplicationInfo(QCoreApplication& a)
 {
-    QApplication a(argc, argv);
     a.setOrganizationName(QLatin1String("SRP"));
     a.setOrganizationDomain(QLatin1String("silasparker.co.uk"));
     a.setApplicationName(QObject::tr("NB Dashcam Tools"));
     a.setApplicationVersion(QLatin1String("@APP_VER_STR@"));
+}
+
+int main(int argc, char *argv[])
+{
+    // Batch commands run without a display
+    if (CommandLine::isCommand(argc, argv))
+    {
+        QCoreApplication a(argc, argv);
+        setApplicationInfo(a);
+        ClipCache::instance();
+        int rc = CommandLine::run(a);
+        ClipCache::destroy();
+        ToolLocator::destroy();
+        return rc;
+    }
+
+    QApplication a(argc, argv);
+    setApplicationInfo(a);
+
+    // Before any probe runs, the first use is otherwise on a pool thread
+    ClipCache::instance();
 
     ToolLocator* tools = ToolLocator::instance();
     tools->addSearchPath(QCoreApplication::applicationDirPath());
@@ -42,9 +64,13 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    MainWindow w;
-    w.show();
-    int rc = a.exec();
+    int rc = 0;
+    { // Scope for the window, its probers finish with it before the cache goes
+        MainWindow w;
+        w.show();
+        rc = a.exec();
+    }
+    ClipCache::destroy();
     ToolLocator::destroy();
     return rc;
 }
@@ -0,0 +1,711 @@
+/* Copyright 2021-2023 Silas Parker.
+ *
+ * This file is part of NB Dashcam Tools.
+ *
+ * NB Dashcam Tools is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * NB Dashcam Tools is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NB Dashcam Tools. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "mp4concat.hpp"
+
+#include <QDebug>
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(Q_OS_LINUX) && defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+#define HAVE_COPY_FILE_RANGE
+#include <errno.h>
+#include <unistd.h>
+
+static const quint64 copySliceSize = 64 * 1024 * 1024;
+#endif
+
+static const int copyBufferSize = 4 * 1024 * 1024;
+
+
+static void appendUint32(QByteArray& data, quint32 value)
+{
+    const char buf[4] = {
+        char(value >> 24), char(value >> 16), char(value >> 8), char(value)};
+    data.append(buf, 4);
+}
+
+static void appendUint64(QByteArray& data, quint64 value)
+{
+    appendUint32(data, quint32(value >> 32));
+    appendUint32(data, quint32(value));
+}
+
+static void putUint32(QByteArray& data, int pos, quint32 value)
+{
+    data[pos + 0] = char(value >> 24);
+    data[pos + 1] = char(value >> 16);
+    data[pos + 2] = char(value >> 8);
+    data[pos + 3] = char(value);
+}
+
+static void putUint64(QByteArray& data, int pos, quint64 value)
+{
+    putUint32(data, pos, quint32(value >> 32));
+    putUint32(data, pos + 4, quint32(value));
+}
+
+static QByteArray box(const char* type, const QByteArray& payload)
+{
+    QByteArray data;
+    data.reserve(payload.size() + 8);
+    appendUint32(data, quint32(payload.size() + 8));
+    data.append(type, 4);
+    data.append(payload);
+    return data;
+}
+
+// Full box with the entry count written before the entries
+static QByteArray tableBox(const char* type, quint8 version, quint32 count, const QByteArray& entries)
+{
+    QByteArray payload;
+    payload.reserve(entries.size() + 8);
+    appendUint32(payload, quint32(version) << 24);
+    appendUint32(payload, count);
+    payload.append(entries);
+    return box(type, payload);
+}
+
+// Update the duration of a mvhd, tkhd or mdhd payload, the field position
+// depends on the full box version
+static void putDuration(QByteArray& payload, int v0Pos, int v1Pos, quint64 duration)
+{
+    if (payload.at(0) == 1)
+        putUint64(payload, v1Pos, duration);
+    else
+        putUint32(payload, v0Pos, quint32(qMin(duration, quint64(0xffffffff))));
+}
+
+static quint32 readTimescale(const QByteArray& payload)
+{
+    const quint8* p = (const quint8*)payload.constData();
+    return Mp4File::convertUint32(p + ((payload.at(0) == 1) ? 20 : 12));
+}
+
+
+// Keeps the samples between the video keyframes at or before from and at or
+// after to, both in seconds from the start of the clip. Other tracks keep
+// the samples that overlap the video, a sample running over the start is
+// shortened so the track still lines up with the video. Returns the
+// seconds kept, with the clip time they start at in cutFrom.
+static double trimTracks(QVector<Mp4File::Track>* tracks, double from, double to, double clipDuration, double* cutFrom)
+{
+    double start = qMax(0.0, from);
+    double end = qMin(clipDuration, to);
+    for (const Mp4File::Track& track : *tracks)
+    {
+        if (strncmp(track.handler, "vide", 4) != 0 || track.timescale == 0)
+            continue;
+
+        double keyStart = 0.0;
+        double keyEnd = clipDuration;
+        quint64 time = 0;
+        for (const Mp4File::Sample& sample : track.samples)
+        {
+            const double t = double(time) / track.timescale;
+            if (sample.sync && t <= start)
+            {
+                keyStart = t;
+            }
+            else if (sample.sync && t >= end)
+            {
+                keyEnd = t;
+                break;
+            }
+            time += sample.duration;
+        }
+        start = keyStart;
+        end = keyEnd;
+        break;
+    }
+
+    for (Mp4File::Track& track : *tracks)
+    {
+        if (track.timescale == 0)
+            continue;
+
+        const bool video = (strncmp(track.handler, "vide", 4) == 0);
+        const quint64 startTime = quint64(std::llround(start * track.timescale));
+        QVector<Mp4File::Sample> samples;
+        quint64 time = 0;
+        for (const Mp4File::Sample& sample : track.samples)
+        {
+            const quint64 sampleStart = time;
+            const double t0 = double(time) / track.timescale;
+            time += sample.duration;
+            const double t1 = double(time) / track.timescale;
+            if (video ? (t0 >= start && t0 < end) : (t1 > start && t0 < end))
+            {
+                samples.append(sample);
+                if (!video && sampleStart < startTime)
+                {
+                    if (time <= startTime)
+                        samples.removeLast();
+                    else
+                        samples.last().duration = quint32(time - startTime);
+                }
+            }
+        }
+        track.samples = samples;
+    }
+
+    *cutFrom = start;
+    return end - start;
+}
+
+
+Mp4Concat::Mp4Concat(QObject* parent) :
+    QThread(parent),
+    mInputs(),
+    mOutput(),
+    mIncludeSubtitles(true),
+    mRangeStart(0.0),
+    mRangeEnd(0.0),
+    mPrepared(false),
+    mSucceeded(false),
+    mUseCopyFileRange(true),
+    mError(),
+    mFtyp(),
+    mMvhd(),
+    mUdta(),
+    mDuration(0.0),
+    mInputTime(0.0),
+    mCutStart(0.0),
+    mTracks(),
+    mChunks(),
+    mMdatOrder(),
+    mMdatSize(0),
+    mWritten(0)
+{}
+
+void Mp4Concat::run()
+{
+    mSucceeded = prepare(&mError) && write(&mError);
+}
+
+bool Mp4Concat::prepare(QString* errMsg)
+{
+    mPrepared = false;
+    mTracks.clear();
+    mChunks.clear();
+    mMdatOrder.clear();
+    mDuration = 0.0;
+    mInputTime = 0.0;
+    mCutStart = 0.0;
+    mMdatSize = 0;
+    mFtyp.clear();
+
+    if (mInputs.isEmpty())
+    {
+        if (errMsg)
+            *errMsg = tr("No files to merge");
+        return false;
+    }
+
+    for (int i = 0; i < mInputs.size(); ++i)
+    {
+        if (isInterruptionRequested())
+        {
+            if (errMsg)
+                *errMsg = tr("Merge cancelled");
+            return false;
+        }
+        if (!addInput(i, errMsg))
+            return false;
+    }
+
+    if (mTracks.isEmpty())
+    {
+        if (errMsg)
+            *errMsg = tr("Range is outside the clips");
+        return false;
+    }
+
+    // Output the chunks in the same order as the inputs, so neighbouring
+    // chunks can be copied in a single operation
+    mMdatOrder.reserve(mChunks.size());
+    for (int i = 0; i < mChunks.size(); ++i)
+        mMdatOrder.append(i);
+    const QVector<Chunk>& chunks = mChunks;
+    std::sort(mMdatOrder.begin(), mMdatOrder.end(), [&chunks](int a, int b) {
+        const Chunk& ca = chunks.at(a);
+        const Chunk& cb = chunks.at(b);
+        return (ca.input != cb.input) ? (ca.input < cb.input) : (ca.srcOffset < cb.srcOffset);
+    });
+    for (int idx : mMdatOrder)
+    {
+        mChunks[idx].dstOffset = mMdatSize;
+        mMdatSize += mChunks.at(idx).size;
+    }
+
+    qDebug() << "Concat prepared" << mInputs.size() << "inputs" << mTracks.size() << "tracks"
+             << mChunks.size() << "chunks" << mMdatSize << "bytes";
+    mPrepared = true;
+    return true;
+}
+
+bool Mp4Concat::addInput(int input, QString* errMsg)
+{
+    const QString& filename = mInputs.at(input);
+    Mp4File file(filename);
+    if (!file.open(QIODevice::ReadOnly, true))
+    {
+        if (errMsg)
+            *errMsg = tr("Input file not found:\n%1").arg(filename);
+        return false;
+    }
+
+    QString err;
+    double clipDuration = file.readDuration(&err);
+    if (qIsNaN(clipDuration))
+    {
+        if (errMsg)
+            *errMsg = tr("%1\n%2").arg(err, filename);
+        return false;
+    }
+
+    // Clips outside the range are passed over before their sample tables
+    // are read
+    const bool ranged = (mRangeEnd > mRangeStart);
+    const double clipStart = mInputTime;
+    mInputTime += clipDuration;
+    if (ranged && (mRangeStart >= clipStart + clipDuration || mRangeEnd <= clipStart))
+        return true;
+
+    QVector<Mp4File::Track> tracks;
+    if (!file.readTracks(&tracks, &err))
+    {
+        if (errMsg)
+            *errMsg = tr("%1\n%2").arg(err, filename);
+        return false;
+    }
+
+    // Only audio, video and (optionally) the GPS subtitle track are merged
+    QVector<Mp4File::Track> kept;
+    for (const Mp4File::Track& track : tracks)
+    {
+        if (strncmp(track.handler, "vide", 4) == 0 ||
+            strncmp(track.handler, "soun", 4) == 0 ||
+            (mIncludeSubtitles && track.isSubtitle()))
+        {
+            kept.append(track);
+        }
+    }
+
+    double cutFrom = 0.0;
+    if (ranged)
+        clipDuration = trimTracks(&kept, mRangeStart - clipStart, mRangeEnd - clipStart, clipDuration, &cutFrom);
+
+    // The first clip used gives the file layout and camera data
+    if (mFtyp.isEmpty())
+    {
+        mCutStart = clipStart + cutFrom;
+        mFtyp = file.readAtomPayload("ftyp", &err);
+        mMvhd = file.readAtomPayload("moov/mvhd", &err);
+        if (mIncludeSubtitles)
+            mUdta = file.readUdta(&err);
+        if (mFtyp.isEmpty() || mMvhd.size() < 32 || (mIncludeSubtitles && mUdta.isEmpty()))
+        {
+            if (errMsg)
+                *errMsg = tr("%1\n%2").arg(err, filename);
+            return false;
+        }
+
+        for (const Mp4File::Track& track : kept)
+        {
+            OutTrack out;
+            out.desc = track;
+            out.desc.samples.clear();
+            mTracks.append(out);
+        }
+    }
+    else
+    {
+        // Stream copy is only valid if the codec parameters match exactly
+        bool match = (kept.size() == mTracks.size());
+        for (int t = 0; match && t < kept.size(); ++t)
+        {
+            const Mp4File::Track& desc = mTracks.at(t).desc;
+            match =
+                (strncmp(kept.at(t).handler, desc.handler, 4) == 0) &&
+                (kept.at(t).timescale == desc.timescale) &&
+                (kept.at(t).stsd == desc.stsd);
+        }
+        if (!match)
+        {
+            if (errMsg)
+                *errMsg = tr("Clip format does not match the first clip:\n%1").arg(filename);
+            return false;
+        }
+    }
+
+    for (int t = 0; t < kept.size(); ++t)
+    {
+        OutTrack& out = mTracks[t];
+        const QVector<Mp4File::Sample>& samples = kept.at(t).samples;
+        if (samples.isEmpty())
+            continue;
+        if (kept.at(t).hasCtts)
+            out.desc.hasCtts = true;
+
+        const int first = out.samples.size();
+        out.samples += samples;
+
+        // Rebase timestamps, the last sample is stretched or shortened so that
+        // every track of a clip lasts as long as the clip and the tracks stay
+        // in sync across the join
+        const double ts = kept.at(t).timescale;
+        const qint64 target =
+            qint64(std::llround((mDuration + clipDuration) * ts)) -
+            qint64(std::llround(mDuration * ts));
+        qint64 actual = 0;
+        for (const Mp4File::Sample& sample : samples)
+            actual += sample.duration;
+        Mp4File::Sample& last = out.samples.last();
+        const qint64 lastDuration = qint64(last.duration) + (target - actual);
+        if (lastDuration > 0 && lastDuration <= qint64(0xffffffff))
+            last.duration = quint32(lastDuration);
+
+        // Runs of samples that are contiguous in the input become one chunk
+        for (int i = first; i < out.samples.size(); ++i)
+        {
+            const Mp4File::Sample& sample = out.samples.at(i);
+            if (i == first || mChunks.last().srcOffset + mChunks.last().size != sample.offset)
+            {
+                Chunk chunk;
+                chunk.input = input;
+                chunk.srcOffset = sample.offset;
+                chunk.size = 0;
+                chunk.dstOffset = 0;
+                chunk.samples = 0;
+                out.chunks.append(mChunks.size());
+                mChunks.append(chunk);
+            }
+            mChunks.last().size += sample.size;
+            mChunks.last().samples += 1;
+        }
+    }
+
+    mDuration += clipDuration;
+    return true;
+}
+
+QByteArray Mp4Concat::buildMoov(quint64 base) const
+{
+    const quint32 movieTimescale = readTimescale(mMvhd);
+    QByteArray mvhd(mMvhd);
+    putDuration(mvhd, 16, 24, quint64(std::llround(mDuration * movieTimescale)));
+    const int nextTrackIdPos = (mvhd.at(0) == 1) ? 108 : 96;
+    if (mvhd.size() >= nextTrackIdPos + 4)
+        putUint32(mvhd, nextTrackIdPos, quint32(mTracks.size() + 1));
+
+    QByteArray moov = box("mvhd", mvhd);
+    for (int t = 0; t < mTracks.size(); ++t)
+        moov += buildTrak(mTracks.at(t), quint32(t + 1), base);
+
+    // Camera data last, so the file keeps the layout of the camera output
+    if (!mUdta.isEmpty())
+        moov += box("udta", mUdta);
+
+    return box("moov", moov);
+}
+
+QByteArray Mp4Concat::buildTrak(const OutTrack& track, quint32 trackId, quint64 base) const
+{
+    const QVector<Mp4File::Sample>& samples = track.samples;
+    quint64 mediaDuration = 0;
+    for (const Mp4File::Sample& sample : samples)
+        mediaDuration += sample.duration;
+
+    // stts, run length encoded durations
+    QByteArray stts;
+    quint32 sttsCount = 0;
+    for (int i = 0; i < samples.size(); )
+    {
+        const quint32 delta = samples.at(i).duration;
+        quint32 run = 0;
+        for (; i < samples.size() && samples.at(i).duration == delta; ++i)
+            ++run;
+        appendUint32(stts, run);
+        appendUint32(stts, delta);
+        ++sttsCount;
+    }
+
+    // ctts, only if the track has composition offsets
+    QByteArray ctts;
+    quint32 cttsCount = 0;
+    quint8 cttsVersion = 0;
+    if (track.desc.hasCtts)
+    {
+        for (int i = 0; i < samples.size(); )
+        {
+            const qint32 offset = samples.at(i).ctsOffset;
+            quint32 run = 0;
+            for (; i < samples.size() && samples.at(i).ctsOffset == offset; ++i)
+                ++run;
+            if (offset < 0)
+                cttsVersion = 1;
+            appendUint32(ctts, run);
+            appendUint32(ctts, quint32(offset));
+            ++cttsCount;
+        }
+    }
+
+    // stss, omitted when every sample is a sync sample
+    QByteArray stss;
+    quint32 stssCount = 0;
+    for (int i = 0; i < samples.size(); ++i)
+    {
+        if (samples.at(i).sync)
+        {
+            appendUint32(stss, quint32(i + 1));
+            ++stssCount;
+        }
+    }
+
+    // stsz, with a fixed size when all samples are the same size
+    bool fixedSize = !samples.isEmpty();
+    for (int i = 1; fixedSize && i < samples.size(); ++i)
+        fixedSize = (samples.at(i).size == samples.at(0).size);
+    QByteArray stsz;
+    appendUint32(stsz, 0); // Version & flags
+    appendUint32(stsz, fixedSize ? samples.at(0).size : 0);
+    appendUint32(stsz, quint32(samples.size()));
+    if (!fixedSize)
+    {
+        stsz.reserve(stsz.size() + samples.size() * 4);
+        for (const Mp4File::Sample& sample : samples)
+            appendUint32(stsz, sample.size);
+    }
+
+    // stsc & stco/co64, co64 only needed for outputs over 4GB
+    QByteArray stsc;
+    quint32 stscCount = 0;
+    QByteArray chunkOffsets;
+    bool longOffsets = false;
+    for (int c = 0; c < track.chunks.size(); ++c)
+    {
+        const Chunk& chunk = mChunks.at(track.chunks.at(c));
+        if (c == 0 || chunk.samples != mChunks.at(track.chunks.at(c - 1)).samples)
+        {
+            appendUint32(stsc, quint32(c + 1));
+            appendUint32(stsc, chunk.samples);
+            appendUint32(stsc, 1);
+            ++stscCount;
+        }
+        if (base + chunk.dstOffset + chunk.size > 0xffffffff)
+            longOffsets = true;
+    }
+    for (int idx : track.chunks)
+    {
+        const quint64 offset = base + mChunks.at(idx).dstOffset;
+        if (longOffsets)
+            appendUint64(chunkOffsets, offset);
+        else
+            appendUint32(chunkOffsets, quint32(offset));
+    }
+
+    QByteArray stbl = box("stsd", track.desc.stsd);
+    stbl += tableBox("stts", 0, sttsCount, stts);
+    if (cttsCount > 0)
+        stbl += tableBox("ctts", cttsVersion, cttsCount, ctts);
+    if (stssCount != quint32(samples.size()))
+        stbl += tableBox("stss", 0, stssCount, stss);
+    stbl += tableBox("stsc", 0, stscCount, stsc);
+    stbl += box("stsz", stsz);
+    stbl += tableBox(longOffsets ? "co64" : "stco", 0, quint32(track.chunks.size()), chunkOffsets);
+
+    QByteArray minf = track.desc.mediaHeader + track.desc.dinf + box("stbl", stbl);
+
+    QByteArray mdhd(track.desc.mdhd);
+    putDuration(mdhd, 16, 24, mediaDuration);
+
+    QByteArray mdia = box("mdhd", mdhd) + box("hdlr", track.desc.hdlr) + box("minf", minf);
+
+    const quint32 movieTimescale = readTimescale(mMvhd);
+    QByteArray tkhd(track.desc.tkhd);
+    putUint32(tkhd, (tkhd.at(0) == 1) ? 20 : 12, trackId);
+    putDuration(tkhd, 20, 28, quint64(std::llround(
+        double(mediaDuration) * movieTimescale / track.desc.timescale)));
+
+    return box("trak", box("tkhd", tkhd) + box("mdia", mdia));
+}
+
+bool Mp4Concat::write(QString* errMsg)
+{
+    Q_ASSERT(mPrepared);
+    mWritten = 0;
+
+    QFile output(mOutput);
+    if (!output.open(QIODevice::WriteOnly | QIODevice::Truncate))
+    {
+        if (errMsg)
+            *errMsg = tr("Failed to open output file:\n%1").arg(output.errorString());
+        return false;
+    }
+
+    const QByteArray ftyp = box("ftyp", mFtyp);
+    const bool largeMdat = (mMdatSize + 8) > 0xffffffff;
+    const quint64 base = quint64(ftyp.size()) + (largeMdat ? 16 : 8);
+    const QByteArray moov = buildMoov(base);
+
+    QByteArray mdatHdr;
+    if (largeMdat)
+    {
+        appendUint32(mdatHdr, 1);
+        mdatHdr.append("mdat", 4);
+        appendUint64(mdatHdr, mMdatSize + 16);
+    }
+    else
+    {
+        appendUint32(mdatHdr, quint32(mMdatSize + 8));
+        mdatHdr.append("mdat", 4);
+    }
+
+    bool ok =
+        (output.write(ftyp) == ftyp.size()) &&
+        (output.write(mdatHdr) == mdatHdr.size()) &&
+        output.flush();
+    if (!ok && errMsg)
+        *errMsg = tr("Failed to write output file:\n%1").arg(output.errorString());
+
+    ok = ok && copyData(output, base, errMsg);
+
+    if (ok)
+    {
+        ok = output.seek(qint64(base + mMdatSize)) &&
+             (output.write(moov) == moov.size()) &&
+             output.flush();
+        if (!ok && errMsg)
+            *errMsg = tr("Failed to write output file:\n%1").arg(output.errorString());
+    }
+
+    output.close();
+    if (!ok)
+        output.remove();
+    return ok;
+}
+
+bool Mp4Concat::copyData(QFile& output, quint64 base, QString* errMsg)
+{
+    QFile input;
+    int currentInput = -1;
+    emit progress(0, qint64(mMdatSize));
+
+    for (int k = 0; k < mMdatOrder.size(); )
+    {
+        const Chunk& first = mChunks.at(mMdatOrder.at(k));
+        const quint64 start = first.srcOffset;
+        const quint64 dst = base + first.dstOffset;
+        quint64 end = start + first.size;
+        for (++k; k < mMdatOrder.size(); ++k)
+        {
+            const Chunk& next = mChunks.at(mMdatOrder.at(k));
+            if (next.input != first.input || next.srcOffset != end)
+                break;
+            end += next.size;
+        }
+
+        if (first.input != currentInput)
+        {
+            input.close();
+            input.setFileName(mInputs.at(first.input));
+            if (!input.open(QIODevice::ReadOnly))
+            {
+                if (errMsg)
+                    *errMsg = tr("Input file not found:\n%1").arg(input.fileName());
+                return false;
+            }
+            currentInput = first.input;
+        }
+
+        if (!copyRange(input, start, output, dst, end - start, errMsg))
+            return false;
+    }
+    return true;
+}
+
+bool Mp4Concat::copyRange(QFile& input, quint64 srcOffset, QFile& output, quint64 dstOffset, quint64 length, QString* errMsg)
+{
+#ifdef HAVE_COPY_FILE_RANGE
+    // Let the kernel copy the data, avoids copying through user space and
+    // can share extents on file systems that support it
+    while (mUseCopyFileRange && length > 0)
+    {
+        if (isInterruptionRequested())
+        {
+            if (errMsg)
+                *errMsg = tr("Merge cancelled");
+            return false;
+        }
+        loff_t inOff = loff_t(srcOffset);
+        loff_t outOff = loff_t(dstOffset);
+        const ssize_t copied = ::copy_file_range(
+            input.handle(), &inOff, output.handle(), &outOff, size_t(qMin(length, copySliceSize)), 0);
+        if (copied < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP))
+        {
+            qDebug() << "copy_file_range not supported, falling back to read/write" << errno;
+            mUseCopyFileRange = false;
+            break;
+        }
+        if (copied <= 0)
+        {
+            if (errMsg)
+                *errMsg = tr("Failed to copy data from:\n%1").arg(input.fileName());
+            return false;
+        }
+        srcOffset += quint64(copied);
+        dstOffset += quint64(copied);
+        length -= quint64(copied);
+        mWritten += copied;
+        emit progress(mWritten, qint64(mMdatSize));
+    }
+    if (length == 0)
+        return true;
+#endif
+
+    QByteArray buffer(copyBufferSize, Qt::Uninitialized);
+    if (!(input.seek(qint64(srcOffset)) && output.seek(qint64(dstOffset))))
+    {
+        if (errMsg)
+            *errMsg = tr("Failed to copy data from:\n%1").arg(input.fileName());
+        return false;
+    }
+    while (length > 0)
+    {
+        if (isInterruptionRequested())
+        {
+            if (errMsg)
+                *errMsg = tr("Merge cancelled");
+            return false;
+        }
+        const qint64 want = qint64(qMin(length, quint64(copyBufferSize)));
+        const qint64 got = input.read(buffer.data(), want);
+        if (got != want || output.write(buffer.constData(), got) != got)
+        {
+            if (errMsg)
+                *errMsg = tr("Failed to copy data from:\n%1").arg(input.fileName());
+            return false;
+        }
+        length -= quint64(got);
+        mWritten += got;
+        emit progress(mWritten, qint64(mMdatSize));
+    }
+    return output.flush();
+}
@@ -0,0 +1,107 @@
+/* Copyright 2021-2023 Silas Parker.
+ *
+ * This file is part of NB Dashcam Tools.
+ *
+ * NB Dashcam Tools is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * NB Dashcam Tools is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NB Dashcam Tools. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef MP4CONCAT_HPP
+#define MP4CONCAT_HPP
+
+#include <QThread>
+#include <QStringList>
+#include <QFile>
+
+#include "mp4file.hpp"
+
+// Joins clips with matching codec parameters into one MP4 file without
+// re-muxing through ffmpeg. The sample tables are merged and the media data
+// is copied as is, in the kernel where the platform supports it. With a
+// range set only the samples in it are read and copied.
+class Mp4Concat : public QThread
+{
+    Q_OBJECT
+
+public:
+    explicit Mp4Concat(QObject* parent = nullptr);
+
+    void setInputs(const QStringList& inputs) {mInputs = inputs;}
+    void setOutput(const QString& output) {mOutput = output;}
+    void setIncludeSubtitles(bool include) {mIncludeSubtitles = include;}
+
+    // Seconds from the start of the first input, the output is cut at the
+    // video keyframes around them. An end not after the start keeps it all.
+    void setRange(double start, double end) {mRangeStart = start; mRangeEnd = end;}
+
+    bool prepare(QString* errMsg);
+    bool write(QString* errMsg);
+
+    bool prepared() const {return mPrepared;}
+    double cutStart() const {return mCutStart;} // Seconds, where the output starts in the inputs
+    double duration() const {return mDuration;} // Seconds, once prepared
+    bool succeeded() const {return mSucceeded;}
+    const QString& errorString() const {return mError;}
+
+signals:
+    void progress(qint64 written, qint64 total);
+
+protected:
+    void run() override;
+
+private:
+    struct Chunk
+    {
+        int     input;
+        quint64 srcOffset;
+        quint64 size;
+        quint64 dstOffset; // Relative to the start of the mdat payload
+        quint32 samples;
+    };
+    struct OutTrack
+    {
+        Mp4File::Track  desc;    // Taken from the first input, samples unused
+        QVector<Mp4File::Sample> samples;
+        QVector<int>    chunks;  // Indexes into mChunks, in track order
+    };
+
+    bool addInput(int input, QString* errMsg);
+    QByteArray buildMoov(quint64 base) const;
+    QByteArray buildTrak(const OutTrack& track, quint32 trackId, quint64 base) const;
+    bool copyData(QFile& output, quint64 base, QString* errMsg);
+    bool copyRange(QFile& input, quint64 srcOffset, QFile& output, quint64 dstOffset, quint64 length, QString* errMsg);
+
+    QStringList mInputs;
+    QString mOutput;
+    bool mIncludeSubtitles;
+    double mRangeStart;
+    double mRangeEnd;
+    bool mPrepared;
+    bool mSucceeded;
+    bool mUseCopyFileRange;
+    QString mError;
+
+    QByteArray mFtyp;
+    QByteArray mMvhd;
+    QByteArray mUdta;
+    double mDuration;       // Seconds
+    double mInputTime;      // Seconds of input before the one being added
+    double mCutStart;       // Seconds
+    QVector<OutTrack> mTracks;
+    QVector<Chunk> mChunks;
+    QVector<int> mMdatOrder; // Indexes into mChunks, in output order
+    quint64 mMdatSize;
+    qint64 mWritten;
+};
+
+#endif // MP4CONCAT_HPP
@@ -20,6 +20,8 @@
 
 #include <QDebug>
 
+#include <limits>
+
 QString Mp4File::cameraModel(const QString& infoString)
 {
     if (infoString.contains("222")) return "222";
@@ -46,24 +48,58 @@ QString Mp4File::cameraModel(const QString& infoString)
 
 
 Mp4File::Mp4File(const QString& filename) :
-    mFile(filename)
+    mFile(filename),
+    mMap(nullptr),
+    mMapSize(0),
+    mIndexed(false),
+    mAtoms(),
+    mMoovData(),
+    mMoov(nullptr),
+    mMoovSize(0),
+    mMoovOffset(0)
 {}
 
 Mp4File::~Mp4File()
 {
     if (mFile.isOpen())
-        mFile.close();
+        close();
 }
 
-bool Mp4File::open(QIODevice::OpenMode mode)
+// When mapped, atom headers and payloads are read directly from the mapping
+// and the views returned do not copy any data. Mapping is only used for read
+// only access, if it fails the file falls back to buffered reads.
+bool Mp4File::open(QIODevice::OpenMode mode, bool mapped)
 {
-    return mFile.open(mode);
+    mIndexed = false;
+    if (!mFile.open(mode))
+        return false;
+
+    if (mapped && !(mode & QIODevice::WriteOnly) && mFile.size() > 0)
+    {
+        mMap = mFile.map(0, mFile.size());
+        if (mMap)
+            mMapSize = quint64(mFile.size());
+        else
+            qDebug() << "Failed to map" << mFile.fileName() << mFile.errorString();
+    }
+    return true;
 }
 
 void Mp4File::close()
 {
+    if (mMap)
+    {
+        mFile.unmap(mMap);
+        mMap = nullptr;
+        mMapSize = 0;
+    }
     mFile.flush();
     mFile.close();
+    mIndexed = false;
+    mAtoms.clear();
+    mMoovData.clear();
+    mMoov = nullptr;
+    mMoovSize = 0;
 }
 
 quint32 Mp4File::convertUint32(const quint8* data)
@@ -88,250 +124,703 @@ quint64 Mp4File::convertUint64(const quint8* data)
       quint64(data[7]);
 }
 
-bool Mp4File::readHeader(AtomHeader* hdr)
+bool Mp4File::parseHeader(const quint8* data, quint64 avail, AtomHeader* hdr)
 {
     Q_ASSERT(hdr != nullptr);
-    unsigned char atomHdr[8];
-    unsigned char longLength[8];
     hdr->length = hdr->hdrSize = 0;
-    if (mFile.read((char*)atomHdr, 8) != 8)
-    {
+    if (avail < 8)
         return false;
-    }
-    hdr->length = convertUint32(atomHdr);
+    hdr->length = convertUint32(data);
     hdr->hdrSize = 8;
-    if (hdr->length == 0) // Box until end of file not supported
+    if (hdr->length == 0) // Box until end of container
     {
-        return false;
+        hdr->length = avail;
     }
     else if (hdr->length == 1) // 64 bit length
     {
-        if (mFile.read((char*)longLength, 8) != 8)
-        {
+        if (avail < 16)
             return false;
-        }
         hdr->hdrSize = 16;
-        hdr->length = convertUint64(longLength);
+        hdr->length = convertUint64(data + 8);
     }
-    memcpy(hdr->type, atomHdr + 4, 4);
+    memcpy(hdr->type, data + 4, 4);
     return true;
 }
 
+bool Mp4File::isContainer(const AtomHeader& hdr)
+{
+    return hdr == "moov" || hdr == "udta" || hdr == "trak" ||
+           hdr == "mdia" || hdr == "minf" || hdr == "stbl";
+}
+
+bool Mp4File::readHeaderAt(quint64 pos, AtomHeader* hdr)
+{
+    Q_ASSERT(hdr != nullptr);
+    hdr->length = hdr->hdrSize = 0;
+    if (mMap)
+    {
+        if (pos >= mMapSize)
+            return false;
+        return parseHeader(mMap + pos, mMapSize - pos, hdr);
+    }
 
+    // Single read covers both the short and 64 bit length header
+    unsigned char atomHdr[16];
+    if (!mFile.seek(qint64(pos)))
+        return false;
+    qint64 got = mFile.read((char*)atomHdr, 16);
+    if (got < 8)
+        return false;
+    // Box until end of file
+    if (convertUint32(atomHdr) == 0)
+    {
+        hdr->length = quint64(mFile.size()) - pos;
+        hdr->hdrSize = 8;
+        memcpy(hdr->type, atomHdr + 4, 4);
+        return true;
+    }
+    return parseHeader(atomHdr, quint64(got), hdr);
+}
 
-QByteArray Mp4File::readUdta(QString* errMsg)
+
+// Walk the top level atoms once, reading the whole of the moov atom in a
+// single read (or using it in place when mapped) and indexing the atoms
+// nested in it from memory. All queries are then answered from the index
+// without touching the file again.
+void Mp4File::buildIndex()
 {
-    AtomHeader hdr;
-    mFile.seek(0);
-    qint64 endpos = -1;
-    while (!mFile.atEnd() && ((endpos == -1) || (mFile.pos() < endpos)))
+    if (mIndexed)
+        return;
+
+    mAtoms.clear();
+    mMoovData.clear();
+    mMoov = nullptr;
+    mMoovSize = mMoovOffset = 0;
+    mIndexed = true;
+
+    const quint64 fileSize = quint64(mFile.size());
+    quint64 pos = 0;
+    while (pos < fileSize)
     {
-        if (!readHeader(&hdr))
-        {
-            if (errMsg)
-                *errMsg = QObject::tr("Failed to locate camera data in file");
-            return QByteArray();
-        }
-        if (hdr == "moov")
+        AtomHeader hdr;
+        if (!readHeaderAt(pos, &hdr) ||
+            (hdr.length < hdr.hdrSize) || (hdr.length > fileSize - pos))
         {
-            endpos = mFile.pos() + hdr.lengthAfterHdr();
-            continue;
+            qDebug() << "Failed to read atom header at pos" << pos;
+            return;
         }
-        else if (hdr == "udta")
+
+        Atom atom;
+        atom.hdr = hdr;
+        atom.offset = pos;
+        atom.parent = -1;
+        mAtoms.append(atom);
+
+        if (hdr == "moov" && !mMoov)
         {
-            QByteArray data = mFile.read(hdr.lengthAfterHdr());
-            if (data.size() != int(hdr.lengthAfterHdr()))
+            if (mMap)
             {
-                if (errMsg)
-                    *errMsg = QObject::tr("Failed to read camera data in file");
-                return QByteArray();
+                mMoov = mMap + pos + hdr.hdrSize;
             }
-            return data;
+            else
+            {
+                // The header read may have gone past a short header
+                mMoovData = readRange(pos + hdr.hdrSize, hdr.lengthAfterHdr());
+                if (quint64(mMoovData.size()) != hdr.lengthAfterHdr())
+                {
+                    qDebug() << "Failed to read 'moov' at pos" << pos;
+                    mMoovData.clear();
+                    return;
+                }
+                mMoov = (const quint8*)mMoovData.constData();
+            }
+            mMoovSize = hdr.lengthAfterHdr();
+            mMoovOffset = pos + hdr.hdrSize;
+            indexChildren(mAtoms.size() - 1, mMoov, mMoovSize, mMoovOffset);
         }
-        mFile.skip(hdr.lengthAfterHdr());
+        pos += hdr.length;
     }
-    if (errMsg)
-        *errMsg = QObject::tr("Failed to locate camera data in file");
-    return QByteArray();
 }
 
-bool Mp4File::appendUdta(const QByteArray& data, QString* errMsg)
+void Mp4File::indexChildren(int parent, const quint8* data, quint64 size, quint64 offset)
 {
-    AtomHeader hdr;
-    mFile.seek(0);
-    qint64 endpos = -1;
-    qint64 moovPos = -1;
-    quint32 moovSize = 0;
-    while (!mFile.atEnd() && ((endpos == -1) || (mFile.pos() < endpos)))
-    {
-        qint64 hdrPos = mFile.pos();
-        if (!readHeader(&hdr))
+    quint64 pos = 0;
+    while (size - pos >= 8)
+    {
+        AtomHeader hdr;
+        if (!parseHeader(data + pos, size - pos, &hdr) ||
+            (hdr.length < hdr.hdrSize) || (hdr.length > size - pos))
         {
-            qDebug() << "Read header failed, hdrPos:" << hdrPos;
-            if (errMsg)
-                *errMsg = QObject::tr("Failed to add camera data to output.\n(Failed to read atom header at pos %1)").arg(hdrPos);
-            return false;
+            // udta may be padded with a zero terminator, anything else is
+            // left out of the index
+            qDebug() << "Invalid atom in" << QLatin1String(mAtoms.at(parent).hdr.type, 4) << "at pos" << (offset + pos);
+            return;
         }
 
-        if (hdr == "moov")
+        Atom atom;
+        atom.hdr = hdr;
+        atom.offset = offset + pos;
+        atom.parent = parent;
+        mAtoms.append(atom);
+
+        if (isContainer(hdr))
         {
-            qDebug() << "Found 'moov' at " << hdrPos;
-            moovPos = hdrPos;
-            moovSize = hdr.length;
-            endpos = mFile.pos() + hdr.lengthAfterHdr();
+            indexChildren(
+                mAtoms.size() - 1, data + pos + hdr.hdrSize,
+                hdr.lengthAfterHdr(), offset + pos + hdr.hdrSize);
+        }
+        pos += hdr.length;
+    }
+}
+
+int Mp4File::findChild(int parent, const char* type) const
+{
+    for (int i = 0; i < mAtoms.size(); ++i)
+    {
+        const Atom& atom = mAtoms.at(i);
+        if (atom.parent == parent && atom.hdr == type)
+            return i;
+    }
+    return -1;
+}
+
+// Path of atom types separated by '/', e.g. "moov/udta/info", relative to
+// the parent atom or the top level when parent is -1
+int Mp4File::findPath(const char* path, int parent) const
+{
+    int idx = parent;
+    for (const char* p = path; ; p += 5)
+    {
+        idx = findChild(idx, p);
+        if (idx < 0 || p[4] == '\0')
+            return idx;
+    }
+}
+
+// Returns a non-owning view when the data is already in memory, the view is
+// only valid until the index is next rebuilt.
+QByteArray Mp4File::readRange(quint64 start, quint64 len)
+{
+    if (mMap)
+        return QByteArray::fromRawData((const char*)mMap + start, int(len));
+
+    // Atoms nested in moov are already in memory
+    if (mMoov && start >= mMoovOffset && (start + len) <= (mMoovOffset + mMoovSize))
+        return QByteArray::fromRawData((const char*)mMoov + (start - mMoovOffset), int(len));
+
+    if (!mFile.seek(qint64(start)))
+        return QByteArray();
+    return mFile.read(qint64(len));
+}
+
+QByteArray Mp4File::readPayload(int idx, quint64 maxLen)
+{
+    const Atom& atom = mAtoms.at(idx);
+    return readRange(
+        atom.offset + atom.hdr.hdrSize,
+        qMin(maxLen, atom.hdr.lengthAfterHdr()));
+}
+
+QByteArray Mp4File::readAtom(int idx)
+{
+    const Atom& atom = mAtoms.at(idx);
+    return readRange(atom.offset, atom.hdr.length);
+}
+
+// Payload of a full box (version & flags followed by data) below parent,
+// returns an empty array if the atom is missing or shorter than minLen
+QByteArray Mp4File::readFullBox(int parent, const char* path, quint64 minLen)
+{
+    if (parent < 0)
+        return QByteArray();
+    const int idx = findPath(path, parent);
+    if (idx < 0)
+        return QByteArray();
+    const quint64 len = mAtoms.at(idx).hdr.lengthAfterHdr();
+    if (len < minLen || len > quint64(std::numeric_limits<int>::max()))
+        return QByteArray();
+    QByteArray data = readPayload(idx, len);
+    if (quint64(data.size()) != len)
+        return QByteArray();
+    return data;
+}
+
+// Index of the first trak atom with a handler in the nul terminated list
+int Mp4File::findTrack(const char* const* handlerTypes)
+{
+    buildIndex();
+    const int moov = findPath("moov");
+    if (moov < 0)
+        return -1;
+    for (int trak = 0; trak < mAtoms.size(); ++trak)
+    {
+        if (!(mAtoms.at(trak).parent == moov && mAtoms.at(trak).hdr == "trak"))
             continue;
+        QByteArray hdlr = readFullBox(trak, "mdia/hdlr", 12);
+        if (hdlr.isEmpty())
+            continue;
+        for (const char* const* t = handlerTypes; *t; ++t)
+            if (strncmp(hdlr.constData() + 8, *t, 4) == 0)
+                return trak;
+    }
+    return -1;
+}
+
+// Resolve the offset and size of every sample in a track from the stsz,
+// stsc and stco/co64 tables
+bool Mp4File::readSampleTable(int trak, QVector<Sample>* samples, QString* errMsg)
+{
+    Q_ASSERT(samples != nullptr);
+    samples->clear();
+
+    const int stbl = findPath("mdia/minf/stbl", trak);
+    QByteArray stsz = readFullBox(stbl, "stsz", 12);
+    QByteArray stsc = readFullBox(stbl, "stsc", 8);
+    QByteArray stco = readFullBox(stbl, "stco", 8);
+    QByteArray co64 = readFullBox(stbl, "co64", 8);
+    if (stbl < 0 || stsz.isEmpty() || stsc.isEmpty() || (stco.isEmpty() && co64.isEmpty()))
+    {
+        if (errMsg)
+            *errMsg = QObject::tr("Failed to locate sample table in file");
+        return false;
+    }
+
+    const quint8* sz = (const quint8*)stsz.constData();
+    const quint32 fixedSize = convertUint32(sz + 4);
+    const quint32 sampleCount = convertUint32(sz + 8);
+
+    const quint8* sc = (const quint8*)stsc.constData();
+    const quint32 scCount = convertUint32(sc + 4);
+
+    const bool longOffsets = stco.isEmpty();
+    const quint8* co = (const quint8*)(longOffsets ? co64.constData() : stco.constData());
+    const quint32 chunkCount = convertUint32(co + 4);
+
+    // With a fixed sample size the count is not backed by the table, the
+    // samples still have to fit in the file
+    const quint64 maxSamples = quint64(std::numeric_limits<int>::max()) / sizeof(Sample);
+    if ((sampleCount > maxSamples) ||
+        (fixedSize != 0 && quint64(sampleCount) * fixedSize > quint64(mFile.size())) ||
+        (fixedSize == 0 && quint64(stsz.size()) < 12 + quint64(sampleCount) * 4) ||
+        (quint64(stsc.size()) < 8 + quint64(scCount) * 12) ||
+        (quint64(longOffsets ? co64.size() : stco.size()) < 8 + quint64(chunkCount) * (longOffsets ? 8 : 4)))
+    {
+        if (errMsg)
+            *errMsg = QObject::tr("Sample table in file is truncated");
+        return false;
+    }
+
+    samples->reserve(int(sampleCount));
+    for (quint32 e = 0; e < scCount; ++e)
+    {
+        const quint8* entry = sc + 8 + e * 12;
+        const quint32 firstChunk = convertUint32(entry);
+        const quint32 perChunk = convertUint32(entry + 4);
+        const quint32 lastChunk = (e + 1 < scCount) ? convertUint32(entry + 12) - 1 : chunkCount;
+        if (firstChunk == 0 || lastChunk > chunkCount)
+        {
+            if (errMsg)
+                *errMsg = QObject::tr("Sample table in file is invalid");
+            return false;
         }
-        else if (hdr == "udta")
+
+        for (quint32 chunk = firstChunk; chunk <= lastChunk; ++chunk)
         {
-            qDebug() << "Found 'udta' at " << hdrPos;
-            // Fast update only works if udta is at end of file
-            if (qint64(hdrPos + hdr.length) == mFile.size())
+            quint64 offset = longOffsets ?
+                convertUint64(co + 8 + (chunk - 1) * 8) :
+                convertUint32(co + 8 + (chunk - 1) * 4);
+            for (quint32 i = 0; i < perChunk; ++i)
             {
-                qDebug() << "POS:" << mFile.pos() << "LEN:" << hdr.length << "FILE SIZE:" << mFile.size();
-                quint32 newMoovSize = moovSize + data.size();
-                quint32 newUdtaSize = hdr.length + data.size();
-                qDebug() << "NEW ATOM SIZE:" << newMoovSize << newUdtaSize;
-                qDebug() << "moovPos" << moovPos << "hdrPos" << hdrPos;
-
-                unsigned char newMoovSizeBuf[4];
-                newMoovSizeBuf[0] = (newMoovSize >> 24) & 0xff;
-                newMoovSizeBuf[1] = (newMoovSize >> 16) & 0xff;
-                newMoovSizeBuf[2] = (newMoovSize >> 8) & 0xff;
-                newMoovSizeBuf[3] = (newMoovSize >> 0) & 0xff;
-
-                unsigned char newUdtaSizeBuf[4];
-                newUdtaSizeBuf[0] = (newUdtaSize >> 24) & 0xff;
-                newUdtaSizeBuf[1] = (newUdtaSize >> 16) & 0xff;
-                newUdtaSizeBuf[2] = (newUdtaSize >> 8) & 0xff;
-                newUdtaSizeBuf[3] = (newUdtaSize >> 0) & 0xff;
-
-                if ((mFile.seek(moovPos)) &&
-                    (mFile.write((char*)newMoovSizeBuf, 4) == 4) &&
-                    (mFile.seek(hdrPos)) &&
-                    (mFile.write((char*)newUdtaSizeBuf, 4) == 4) &&
-                    (mFile.seek(hdrPos + hdr.length)) &&
-                    (mFile.write(data) == data.size()))
-                {
-                    qDebug() << "NEW FILE SIZE:" << mFile.size() << "NEW POS:" << mFile.pos();
-                    return true;
-                }
-                else
+                const quint32 n = quint32(samples->size());
+                if (n >= sampleCount)
                 {
                     if (errMsg)
-                        *errMsg = QObject::tr("Failed to update file");
+                        *errMsg = QObject::tr("Sample table in file is invalid");
                     return false;
                 }
-            }
-            else
-            {
-                if (errMsg)
-                    *errMsg = QObject::tr("File not in expected format");
-                return false;
+                Sample sample;
+                sample.offset = offset;
+                sample.size = fixedSize ? fixedSize : convertUint32(sz + 12 + n * 4);
+                sample.duration = 0;
+                sample.ctsOffset = 0;
+                sample.sync = true;
+                samples->append(sample);
+                offset += sample.size;
             }
         }
-        else
+    }
+
+    if (quint32(samples->size()) != sampleCount)
+    {
+        if (errMsg)
+            *errMsg = QObject::tr("Sample table in file is invalid");
+        return false;
+    }
+
+    // Timing from the run length encoded stts and ctts tables, sync samples
+    // from stss, all samples are sync samples when stss is missing
+    Sample* out = samples->data();
+    QByteArray stts = readFullBox(stbl, "stts", 8);
+    QByteArray ctts = readFullBox(stbl, "ctts", 8);
+    QByteArray stss = readFullBox(stbl, "stss", 8);
+
+    const quint8* ts = (const quint8*)stts.constData();
+    const quint32 tsCount = stts.isEmpty() ? 0 : convertUint32(ts + 4);
+    const quint8* cs = (const quint8*)ctts.constData();
+    const quint32 csCount = ctts.isEmpty() ? 0 : convertUint32(cs + 4);
+    const quint8* ss = (const quint8*)stss.constData();
+    const quint32 ssCount = stss.isEmpty() ? 0 : convertUint32(ss + 4);
+    if ((stts.isEmpty()) ||
+        (quint64(stts.size()) < 8 + quint64(tsCount) * 8) ||
+        (quint64(ctts.size()) < (ctts.isEmpty() ? 0 : 8 + quint64(csCount) * 8)) ||
+        (quint64(stss.size()) < (stss.isEmpty() ? 0 : 8 + quint64(ssCount) * 4)))
+    {
+        if (errMsg)
+            *errMsg = QObject::tr("Sample timing table in file is invalid");
+        return false;
+    }
+
+    quint32 n = 0;
+    for (quint32 e = 0; e < tsCount; ++e)
+    {
+        const quint32 count = convertUint32(ts + 8 + e * 8);
+        const quint32 delta = convertUint32(ts + 12 + e * 8);
+        for (quint32 i = 0; i < count && n < sampleCount; ++i)
+            out[n++].duration = delta;
+    }
+
+    n = 0;
+    for (quint32 e = 0; e < csCount; ++e)
+    {
+        const quint32 count = convertUint32(cs + 8 + e * 8);
+        const qint32 ctsOffset = qint32(convertUint32(cs + 12 + e * 8));
+        for (quint32 i = 0; i < count && n < sampleCount; ++i)
+            out[n++].ctsOffset = ctsOffset;
+    }
+
+    if (ssCount > 0)
+    {
+        for (quint32 i = 0; i < sampleCount; ++i)
+            out[i].sync = false;
+        for (quint32 e = 0; e < ssCount; ++e)
         {
-            qDebug() << "Skip atom " << QLatin1String(hdr.type, 4) << hdr.length;
+            const quint32 number = convertUint32(ss + 8 + e * 4);
+            if (number > 0 && number <= sampleCount)
+                out[number - 1].sync = true;
         }
-        mFile.skip(hdr.lengthAfterHdr());
     }
+    return true;
+}
+
+
+
+QByteArray Mp4File::readUdta(QString* errMsg)
+{
+    // Deep copy so the data outlives the file
+    QByteArray view = udtaView(errMsg);
+    return QByteArray(view.constData(), view.size());
+}
+
+QByteArray Mp4File::udtaView(QString* errMsg)
+{
+    buildIndex();
+    const int udta = findPath("moov/udta");
+    if (udta < 0)
+    {
+        if (errMsg)
+            *errMsg = QObject::tr("Failed to locate camera data in file");
+        return QByteArray();
+    }
+
+    const quint64 len = mAtoms.at(udta).hdr.lengthAfterHdr();
+    QByteArray data = readPayload(udta, len);
+    if (quint64(data.size()) != len)
+    {
+        if (errMsg)
+            *errMsg = QObject::tr("Failed to read camera data in file");
+        return QByteArray();
+    }
+    return data;
+}
+
+bool Mp4File::appendUdta(const QByteArray& data, QString* errMsg)
+{
+    buildIndex();
+    const int moovIdx = findPath("moov");
+    const int udtaIdx = findPath("moov/udta");
+    if (moovIdx < 0 || udtaIdx < 0)
+    {
+        qDebug() << "Failed to find 'moov/udta'";
+        if (errMsg)
+            *errMsg = QObject::tr("File not in expected format");
+        return false;
+    }
+
+    const Atom moov = mAtoms.at(moovIdx);
+    const Atom udta = mAtoms.at(udtaIdx);
+    qDebug() << "Found 'moov' at " << moov.offset << "'udta' at" << udta.offset;
+
+    // Fast update only works if udta is at end of file
+    if ((qint64(udta.offset + udta.hdr.length) != mFile.size()) ||
+        (moov.hdr.hdrSize != 8) || (udta.hdr.hdrSize != 8))
+    {
+        if (errMsg)
+            *errMsg = QObject::tr("File not in expected format");
+        return false;
+    }
+
+    quint32 newMoovSize = moov.hdr.length + data.size();
+    quint32 newUdtaSize = udta.hdr.length + data.size();
+    qDebug() << "NEW ATOM SIZE:" << newMoovSize << newUdtaSize;
+
+    unsigned char newMoovSizeBuf[4];
+    newMoovSizeBuf[0] = (newMoovSize >> 24) & 0xff;
+    newMoovSizeBuf[1] = (newMoovSize >> 16) & 0xff;
+    newMoovSizeBuf[2] = (newMoovSize >> 8) & 0xff;
+    newMoovSizeBuf[3] = (newMoovSize >> 0) & 0xff;
+
+    unsigned char newUdtaSizeBuf[4];
+    newUdtaSizeBuf[0] = (newUdtaSize >> 24) & 0xff;
+    newUdtaSizeBuf[1] = (newUdtaSize >> 16) & 0xff;
+    newUdtaSizeBuf[2] = (newUdtaSize >> 8) & 0xff;
+    newUdtaSizeBuf[3] = (newUdtaSize >> 0) & 0xff;
+
+    // Atom sizes change, index must be rebuilt for any further queries
+    mIndexed = false;
+    mAtoms.clear();
+
+    if ((mFile.seek(qint64(moov.offset))) &&
+        (mFile.write((char*)newMoovSizeBuf, 4) == 4) &&
+        (mFile.seek(qint64(udta.offset))) &&
+        (mFile.write((char*)newUdtaSizeBuf, 4) == 4) &&
+        (mFile.seek(qint64(udta.offset + udta.hdr.length))) &&
+        (mFile.write(data) == data.size()))
+    {
+        qDebug() << "NEW FILE SIZE:" << mFile.size() << "NEW POS:" << mFile.pos();
+        return true;
+    }
+
+    if (errMsg)
+        *errMsg = QObject::tr("Failed to update file");
     return false;
 }
 
 QString Mp4File::readInfoString(QString* errMsg)
 {
-    AtomHeader hdr;
-    mFile.seek(0);
-    qint64 endpos = -1;
-    while (!mFile.atEnd() && ((endpos == -1) || (mFile.pos() < endpos)))
+    buildIndex();
+    const int info = findPath("moov/udta/info");
+    if (info < 0)
+    {
+        if (errMsg)
+            *errMsg = QObject::tr("Failed to locate camera data in file");
+        return QString();
+    }
+
+    const quint64 len = mAtoms.at(info).hdr.lengthAfterHdr();
+    QByteArray data = readPayload(info, len);
+    if (quint64(data.size()) != len)
+    {
+        if (errMsg)
+            *errMsg = QObject::tr("Failed to read camera data in file");
+        return QString();
+    }
+    return QString::fromLatin1(data);
+}
+
+
+double Mp4File::readDuration(QString* errMsg)
+{
+    buildIndex();
+    const int mvhd = findPath("moov/mvhd");
+    if (mvhd < 0)
+    {
+        if (errMsg)
+            *errMsg = QObject::tr("Failed to locate duration of file");
+        return qQNaN();
+    }
+
+    QByteArray data = readPayload(mvhd, 32);
+    if (data.size() != 32)
+    {
+        if (errMsg)
+            *errMsg = QObject::tr("Failed to read duration of file");
+        return qQNaN();
+    }
+    // Full box version
+    const quint8* p = (const quint8*)data.constData();
+    quint32 version = convertUint32(p + 0);
+    quint32 timescale;
+    quint64 duration;
+    switch (version)
+    {
+    case 0:
+      timescale = convertUint32(p + 12);
+      duration = convertUint32(p + 16);
+      break;
+    case 1:
+      timescale = convertUint32(p + 20);
+      duration = convertUint64(p + 24);
+      break;
+    default:
+      if (errMsg)
+          *errMsg = QObject::tr("Failed to read duration of file");
+      return qQNaN();
+    }
+    return double(duration) / double(timescale);
+}
+
+
+// Raw bytes of all the samples in the subtitle track, as written by
+// "ffmpeg -map 0:s -c:s copy -f data"
+QByteArray Mp4File::readSubtitleData(QString* errMsg)
+{
+    static const char* const subtitleHandlers[] = {"sbtl", "subt", "text", nullptr};
+    const int trak = findTrack(subtitleHandlers);
+    if (trak < 0)
     {
-        if (!readHeader(&hdr))
+        if (errMsg)
+            *errMsg = QObject::tr("Failed to locate GPS data in file");
+        return QByteArray();
+    }
+
+    QVector<Sample> samples;
+    if (!readSampleTable(trak, &samples, errMsg))
+        return QByteArray();
+
+    const quint64 fileSize = quint64(mFile.size());
+    quint64 total = 0;
+    for (const Sample& sample : samples)
+    {
+        if (sample.offset + sample.size > fileSize)
         {
             if (errMsg)
-                *errMsg = QObject::tr("Failed to locate camera data in file");
-            return QString();
-        }
-        if (hdr == "moov")
-        {
-            endpos = mFile.pos() + hdr.lengthAfterHdr();
-            continue;
+                *errMsg = QObject::tr("GPS data extends past end of file");
+            return QByteArray();
         }
-        else if (hdr == "udta")
+        total += sample.size;
+    }
+    if (total > quint64(std::numeric_limits<int>::max()))
+    {
+        if (errMsg)
+            *errMsg = QObject::tr("GPS data too large");
+        return QByteArray();
+    }
+
+    QByteArray data;
+    data.reserve(int(total));
+    for (int i = 0; i < samples.size(); )
+    {
+        // Samples in a chunk are contiguous, read each run in one go
+        const quint64 start = samples.at(i).offset;
+        quint64 end = start + samples.at(i).size;
+        for (++i; i < samples.size() && samples.at(i).offset == end; ++i)
+            end += samples.at(i).size;
+
+        if (mMap)
         {
-            endpos = mFile.pos() + hdr.lengthAfterHdr();
+            data.append((const char*)mMap + start, int(end - start));
             continue;
         }
-        else if (hdr == "info")
+
+        const int pos = data.size();
+        data.resize(pos + int(end - start));
+        if (!(mFile.seek(qint64(start)) &&
+              mFile.read(data.data() + pos, qint64(end - start)) == qint64(end - start)))
         {
-            QByteArray data = mFile.read(hdr.lengthAfterHdr());
-            if (data.size() != int(hdr.lengthAfterHdr()))
-            {
-                if (errMsg)
-                    *errMsg = QObject::tr("Failed to read camera data in file");
-                return QString();
-            }
-            return QString::fromLatin1(data);
+            if (errMsg)
+                *errMsg = QObject::tr("Failed to read GPS data from file");
+            return QByteArray();
         }
-        mFile.skip(hdr.lengthAfterHdr());
     }
-    if (errMsg)
-        *errMsg = QObject::tr("Failed to locate camera data in file");
-    return QString();
+    return data;
 }
 
 
-double Mp4File::readDuration(QString* errMsg)
+bool Mp4File::Track::isSubtitle() const
 {
-    AtomHeader hdr;
-    mFile.seek(0);
-    qint64 endpos = -1;
-    while (!mFile.atEnd() && ((endpos == -1) || (mFile.pos() < endpos)))
+    return strncmp(handler, "sbtl", 4) == 0 ||
+           strncmp(handler, "subt", 4) == 0 ||
+           strncmp(handler, "text", 4) == 0;
+}
+
+QByteArray Mp4File::readAtomPayload(const char* path, QString* errMsg)
+{
+    buildIndex();
+    const int idx = findPath(path);
+    if (idx < 0)
+    {
+        if (errMsg)
+            *errMsg = QObject::tr("Failed to locate '%1' in file").arg(QLatin1String(path));
+        return QByteArray();
+    }
+
+    const quint64 len = mAtoms.at(idx).hdr.lengthAfterHdr();
+    QByteArray view = readPayload(idx, len);
+    if (quint64(view.size()) != len)
     {
-        if (!readHeader(&hdr))
+        if (errMsg)
+            *errMsg = QObject::tr("Failed to read '%1' in file").arg(QLatin1String(path));
+        return QByteArray();
+    }
+    return QByteArray(view.constData(), view.size());
+}
+
+// Describe every trak in the file, with the sample tables resolved
+bool Mp4File::readTracks(QVector<Track>* tracks, QString* errMsg)
+{
+    Q_ASSERT(tracks != nullptr);
+    tracks->clear();
+    buildIndex();
+    const int moov = findPath("moov");
+    if (moov < 0)
+    {
+        if (errMsg)
+            *errMsg = QObject::tr("Failed to locate 'moov' in file");
+        return false;
+    }
+
+    for (int trak = 0; trak < mAtoms.size(); ++trak)
+    {
+        if (!(mAtoms.at(trak).parent == moov && mAtoms.at(trak).hdr == "trak"))
+            continue;
+
+        Track track;
+        QByteArray tkhd = readFullBox(trak, "tkhd", 84);
+        QByteArray mdhd = readFullBox(trak, "mdia/mdhd", 24);
+        QByteArray hdlr = readFullBox(trak, "mdia/hdlr", 12);
+        QByteArray stsd = readFullBox(trak, "mdia/minf/stbl/stsd", 8);
+        const int minf = findPath("mdia/minf", trak);
+        const int dinf = findPath("dinf", minf);
+        if (tkhd.isEmpty() || mdhd.isEmpty() || hdlr.isEmpty() || stsd.isEmpty() || minf < 0 || dinf < 0)
         {
             if (errMsg)
-                *errMsg = QObject::tr("Failed to read duration of file");
-            return qQNaN();
-        }
-        if (hdr == "moov")
-        {
-            endpos = mFile.pos() + hdr.lengthAfterHdr();
-            continue;
+                *errMsg = QObject::tr("Track in file is incomplete");
+            return false;
         }
-        else if (hdr == "mvhd")
+
+        track.tkhd = QByteArray(tkhd.constData(), tkhd.size());
+        track.mdhd = QByteArray(mdhd.constData(), mdhd.size());
+        track.hdlr = QByteArray(hdlr.constData(), hdlr.size());
+        track.stsd = QByteArray(stsd.constData(), stsd.size());
+        memcpy(track.handler, hdlr.constData() + 8, 4);
+        track.timescale = convertUint32((const quint8*)mdhd.constData() + ((mdhd.at(0) == 1) ? 20 : 12));
+
+        for (int i = 0; i < mAtoms.size(); ++i)
         {
-            QByteArray data = mFile.read(32);
-            if (data.size() != 32)
-            {
-                if (errMsg)
-                    *errMsg = QObject::tr("Failed to read duration of file");
-                return qQNaN();
-            }
-            // Full box version
-            const quint8* p = (const quint8*)data.data();
-            quint32 version = convertUint32(p + 0);
-            quint32 timescale;
-            quint64 duration;
-            switch (version)
-            {
-            case 0:
-              timescale = convertUint32(p + 12);
-              duration = convertUint32(p + 16);
-              break;
-            case 1:
-              timescale = convertUint32(p + 20);
-              duration = convertUint64(p + 24);
-              break;
-            default:
-              if (errMsg)
-                  *errMsg = QObject::tr("Failed to read duration of file");
-              return qQNaN();
-            }
-            return double(duration) / double(timescale);
+            const Atom& atom = mAtoms.at(i);
+            if (atom.parent != minf)
+                continue;
+            QByteArray data = readAtom(i);
+            if (atom.hdr == "dinf")
+                track.dinf = QByteArray(data.constData(), data.size());
+            else if (!(atom.hdr == "stbl") && track.mediaHeader.isEmpty())
+                track.mediaHeader = QByteArray(data.constData(), data.size());
         }
-        mFile.skip(hdr.lengthAfterHdr());
+
+        track.hasCtts = findPath("mdia/minf/stbl/ctts", trak) >= 0;
+        if (!readSampleTable(trak, &track.samples, errMsg))
+            return false;
+        tracks->append(track);
     }
-    if (errMsg)
-        *errMsg = QObject::tr("Failed to locate duration of file");
-    return qQNaN();
+    return true;
 }
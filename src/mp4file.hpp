@@ -21,21 +21,56 @@
 
 #include <QString>
 #include <QFile>
+#include <QVector>
 
 class Mp4File
 {
 public:
+    struct Sample
+    {
+        quint64 offset;
+        quint32 size;
+        quint32 duration;  // Media timescale
+        qint32  ctsOffset; // Composition time offset, media timescale
+        bool    sync;
+    };
+
+    // Description of a trak, atom payloads are copies so outlive the file
+    struct Track
+    {
+        char       handler[4];
+        quint32    timescale;
+        QByteArray tkhd;
+        QByteArray mdhd;
+        QByteArray hdlr;
+        QByteArray stsd;
+        QByteArray mediaHeader; // Complete vmhd/smhd/nmhd/gmhd atom
+        QByteArray dinf;        // Complete dinf atom
+        bool       hasCtts;
+        QVector<Sample> samples;
+
+        bool isSubtitle() const;
+    };
+
     static QString cameraModel(const QString& infoString);
+    static quint32 convertUint32(const quint8* data);
+    static quint64 convertUint64(const quint8* data);
 
     Mp4File(const QString& filename);
     ~Mp4File();
-    bool open(QIODevice::OpenMode mode);
+    bool open(QIODevice::OpenMode mode, bool mapped = false);
     void close();
+    bool isMapped() const {return mMap != nullptr;}
 
     QByteArray readUdta(QString* errMsg = nullptr);
+    // Non-owning, only valid until the file is closed or modified
+    QByteArray udtaView(QString* errMsg = nullptr);
     bool appendUdta(const QByteArray& data, QString* errMsg = nullptr);
     QString readInfoString(QString* errMsg = nullptr);
     double readDuration(QString* errMsg);
+    QByteArray readSubtitleData(QString* errMsg = nullptr);
+    QByteArray readAtomPayload(const char* path, QString* errMsg = nullptr);
+    bool readTracks(QVector<Track>* tracks, QString* errMsg = nullptr);
 
 private:
     struct AtomHeader
@@ -50,10 +85,38 @@ private:
         quint64 lengthAfterHdr() const
         {return length - hdrSize;}
     };
-    static quint32 convertUint32(const quint8* data);
-    static quint64 convertUint64(const quint8* data);
-    bool readHeader(AtomHeader* hdr);
+    struct Atom
+    {
+        AtomHeader hdr;
+        quint64    offset; // File offset of the atom header
+        int        parent; // Index of parent atom, -1 for top level
+    };
+
+    static bool parseHeader(const quint8* data, quint64 avail, AtomHeader* hdr);
+    static bool isContainer(const AtomHeader& hdr);
+    bool readHeaderAt(quint64 pos, AtomHeader* hdr);
+
+    void buildIndex();
+    void indexChildren(int parent, const quint8* data, quint64 size, quint64 offset);
+    int findChild(int parent, const char* type) const;
+    int findPath(const char* path, int parent = -1) const;
+    QByteArray readRange(quint64 start, quint64 len);
+    QByteArray readPayload(int idx, quint64 maxLen);
+    QByteArray readAtom(int idx);
+    QByteArray readFullBox(int parent, const char* path, quint64 minLen);
+
+    int findTrack(const char* const* handlerTypes);
+    bool readSampleTable(int trak, QVector<Sample>* samples, QString* errMsg);
+
     QFile mFile;
+    uchar* mMap;
+    quint64 mMapSize;
+    bool mIndexed;
+    QVector<Atom> mAtoms;
+    QByteArray mMoovData; // Copy of the moov payload when the file is not mapped
+    const quint8* mMoov;  // Payload of the moov atom, all nested atoms are read from here
+    quint64 mMoovSize;
+    quint64 mMoovOffset;
 };
 
 #endif // MP4READER_HPP
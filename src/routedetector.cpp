@@ -0,0 +1,208 @@
+/* Copyright 2021-2023 Silas Parker.
+ *
+ * This file is part of NB Dashcam Tools.
+ *
+ * NB Dashcam Tools is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * NB Dashcam Tools is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NB Dashcam Tools. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "routedetector.hpp"
+
+#include <QDir>
+#include <QFileInfo>
+
+#include <algorithm>
+
+namespace
+{
+struct ClipName
+{
+    QString path;
+    qint64 secs;
+    int sequence;
+    QString channel;
+};
+}
+
+// Reads count decimal digits, false if any character is not a digit
+static bool readDigits(const QChar* data, int count, int* value)
+{
+    int result = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        const ushort c = data[i].unicode();
+        if (c < '0' || c > '9')
+            return false;
+        result = (result * 10) + int(c - '0');
+    }
+    *value = result;
+    return true;
+}
+
+static bool isOneOf(QChar c, const char* options)
+{
+    const ushort u = c.toUpper().unicode();
+    for (const char* p = options; *p; ++p)
+    {
+        if (u == ushort(*p))
+            return true;
+    }
+    return false;
+}
+
+// Days since 1970-01-01, shifting the year to start in March puts the leap
+// day last
+static qint64 daysFromCivil(int year, int month, int day)
+{
+    const int y = year - (month <= 2 ? 1 : 0);
+    const int era = y / 400;
+    const int yoe = y - era * 400;
+    const int doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    const int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return qint64(era) * 146097 + doe - 719468;
+}
+
+
+ClipRoute::ClipRoute() :
+    channel(),
+    files(),
+    startSecs(0),
+    endSecs(0)
+{
+}
+
+QDateTime ClipRoute::startTime() const
+{
+    const qint64 days = startSecs / 86400;
+    const int secsOfDay = int(startSecs % 86400);
+    return QDateTime(QDate::fromJulianDay(days + 2440588), QTime::fromMSecsSinceStartOfDay(secsOfDay * 1000));
+}
+
+
+bool RouteDetector::parseFileName(const QString& fileName, qint64* secs, int* sequence, QString* channel)
+{
+    // 230102_120000_001_FH.MP4
+    if (fileName.size() != 24)
+        return false;
+
+    const QChar* name = fileName.constData();
+    int yymmdd = 0;
+    int hhmmss = 0;
+    int seq = 0;
+    if (!readDigits(name, 6, &yymmdd) || name[6] != QLatin1Char('_')
+        || !readDigits(name + 7, 6, &hhmmss) || name[13] != QLatin1Char('_')
+        || !readDigits(name + 14, 3, &seq) || name[17] != QLatin1Char('_')
+        || !isOneOf(name[18], "BFR") || !isOneOf(name[19], "HL")
+        || !fileName.endsWith(QLatin1String(".MP4"), Qt::CaseInsensitive))
+    {
+        return false;
+    }
+
+    static const int daysInMonth[12] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+    const int year = 2000 + yymmdd / 10000;
+    const int month = (yymmdd / 100) % 100;
+    const int day = yymmdd % 100;
+    const int hour = hhmmss / 10000;
+    const int minute = (hhmmss / 100) % 100;
+    const int second = hhmmss % 100;
+    if (month < 1 || month > 12 || day < 1 || hour > 23 || minute > 59 || second > 59)
+        return false;
+    const bool leap = (year % 4 == 0) && (year % 100 != 0 || year % 400 == 0);
+    if (day > daysInMonth[month - 1] + ((leap && month == 2) ? 1 : 0))
+        return false;
+
+    *secs = daysFromCivil(year, month, day) * 86400 + hour * 3600 + minute * 60 + second;
+    *sequence = seq;
+    *channel = fileName.mid(18, 2).toUpper();
+    return true;
+}
+
+QVector<ClipRoute> RouteDetector::detect(const QStringList& files, int maxGapSecs)
+{
+    QVector<ClipName> clips;
+    clips.reserve(files.size());
+    for (const QString& path : files)
+    {
+        ClipName clip;
+        const int slash = path.lastIndexOf(QLatin1Char('/'));
+        if (!parseFileName(path.mid(slash + 1), &clip.secs, &clip.sequence, &clip.channel))
+            continue;
+        clip.path = path;
+        clips.append(clip);
+    }
+
+    std::sort(clips.begin(), clips.end(), [](const ClipName& a, const ClipName& b)
+    {
+        if (a.channel != b.channel)
+            return a.channel < b.channel;
+        if (a.secs != b.secs)
+            return a.secs < b.secs;
+        return a.sequence < b.sequence;
+    });
+
+    // Same rule as growing a route by hand, a clip starting at the same
+    // time as the last one or after too long a gap starts a new route
+    QVector<ClipRoute> routes;
+    for (const ClipName& clip : clips)
+    {
+        if (!routes.isEmpty())
+        {
+            ClipRoute& route = routes.last();
+            const qint64 gap = clip.secs - route.endSecs;
+            if (route.channel == clip.channel && gap > 0 && gap <= maxGapSecs)
+            {
+                route.files << clip.path;
+                route.endSecs = clip.secs;
+                continue;
+            }
+        }
+
+        ClipRoute route;
+        route.channel = clip.channel;
+        route.files << clip.path;
+        route.startSecs = clip.secs;
+        route.endSecs = clip.secs;
+        routes.append(route);
+    }
+
+    std::stable_sort(routes.begin(), routes.end(), [](const ClipRoute& a, const ClipRoute& b)
+    {
+        return a.startSecs < b.startSecs;
+    });
+    return routes;
+}
+
+QVector<ClipRoute> RouteDetector::detectDirectory(const QString& dir, int maxGapSecs)
+{
+    const QDir inputDir(dir);
+    const QStringList names = inputDir.entryList(QStringList("*.mp4"), QDir::Files | QDir::Readable);
+    QStringList files;
+    files.reserve(names.size());
+    for (const QString& name : names)
+    {
+        files << inputDir.filePath(name);
+    }
+    return detect(files, maxGapSecs);
+}
+
+// trip.mp4 becomes trip_20230102_120000_FH.mp4
+QString RouteDetector::outputPath(const QString& output, const ClipRoute& route)
+{
+    const QFileInfo info(output);
+    QString suffix = info.suffix();
+    if (suffix.isEmpty())
+        suffix = QStringLiteral("mp4");
+    const QString name = QStringLiteral("%1_%2_%3.%4").arg(
+        info.completeBaseName(), route.startTime().toString(QStringLiteral("yyyyMMdd_HHmmss")), route.channel, suffix);
+    return info.dir().filePath(name);
+}
@@ -0,0 +1,54 @@
+/* Copyright 2021-2023 Silas Parker.
+ *
+ * This file is part of NB Dashcam Tools.
+ *
+ * NB Dashcam Tools is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * NB Dashcam Tools is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NB Dashcam Tools. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef ROUTEDETECTOR_HPP
+#define ROUTEDETECTOR_HPP
+
+#include <QDateTime>
+#include <QStringList>
+#include <QVector>
+
+// A run of clips from one camera channel with no more than the maximum gap
+// between the start of each clip
+struct ClipRoute
+{
+    QString channel;   // Camera and quality, e.g. FH or RL
+    QStringList files; // In recording order
+    qint64 startSecs;  // Camera local time, seconds since 1970
+    qint64 endSecs;    // Start of the last clip
+
+    ClipRoute();
+    QDateTime startTime() const;
+};
+
+// Groups clips into routes from the names the camera gives them,
+// YYMMDD_HHMMSS_NNN_CQ.MP4. Names are parsed once and sorted, so a whole
+// card is grouped without touching the file contents.
+class RouteDetector
+{
+public:
+    static const int defaultMaxGapSecs = 300;
+
+    static bool parseFileName(const QString& fileName, qint64* secs, int* sequence, QString* channel);
+    static QVector<ClipRoute> detect(const QStringList& files, int maxGapSecs = defaultMaxGapSecs);
+    static QVector<ClipRoute> detectDirectory(const QString& dir, int maxGapSecs = defaultMaxGapSecs);
+
+    static QString outputPath(const QString& output, const ClipRoute& route);
+};
+
+#endif // ROUTEDETECTOR_HPP